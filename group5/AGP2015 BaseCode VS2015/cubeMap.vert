@@ -12,7 +12,8 @@ smooth out vec3 cubeTexCoord;
 void main(void) {
 	// vertex into eye coordinates
 	vec4 vertexPosition = modelview * vec4(in_Position,1.0);
-    gl_Position = projection * vertexPosition;
+    // at the far plane: the sky is drawn after the scene, only where nothing else was
+    gl_Position = (projection * vertexPosition).xyww;
 
 	cubeTexCoord = normalize(in_Position);
 }
\ No newline at end of file
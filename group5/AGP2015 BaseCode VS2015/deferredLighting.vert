@@ -0,0 +1,10 @@
+#version 330 core
+
+// Lighting pass of the deferred path: one triangle over the whole screen, made from gl_VertexID alone,
+// so it is drawn with an empty vertex array. pointShadows.frag, built with DEFERRED, lights each pixel it covers.
+
+void main()
+{
+    vec2 corner = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);
+    gl_Position = vec4(corner * 2.0 - 1.0, 0.0, 1.0);
+}
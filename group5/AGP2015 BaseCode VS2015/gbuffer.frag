@@ -0,0 +1,33 @@
+#version 330 core
+
+// Geometry pass of the deferred path: everything pointShadows.frag needs to light a pixel later, packed small.
+// Albedo goes to an RGBA8 target and the normal, octahedral encoded, to an RG16 one; position comes back from depth.
+layout(location = 0) out vec4 gAlbedo;
+layout(location = 1) out vec2 gNormal;
+
+in VS_OUT {
+    vec3 FragPos;
+    vec3 Normal;
+    vec2 TexCoords;
+} fs_in;
+
+struct Material {
+    sampler2D diffuse;
+};
+
+uniform Material material;
+
+// The unit sphere projected onto the octahedron |x| + |y| + |z| = 1, with the lower half folded out over the corners
+// of the square, then mapped to [0,1] for an unsigned normalized target (signed ones need not be renderable)
+vec2 octEncode(vec3 n)
+{
+    n /= abs(n.x) + abs(n.y) + abs(n.z);
+    vec2 e = n.z >= 0.0 ? n.xy : (1.0 - abs(n.yx)) * vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);
+    return e * 0.5 + 0.5;
+}
+
+void main()
+{
+    gAlbedo = vec4(texture(material.diffuse, fs_in.TexCoords).rgb, 1.0);
+    gNormal = octEncode(normalize(fs_in.Normal));
+}
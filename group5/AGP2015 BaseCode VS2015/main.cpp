@@ -7,6 +7,18 @@
 // 0 on numpad to switch between lights (to see different cube shadowmaps)
 // N and M to switch on and off parallax mapping
 // Z and X to switch between particle light mode and "light shooter" mode
+// K and L to render the point light shadows one light per pass, or all lights in one layered pass (if supported)
+// O to render them into the shadow atlas instead, with each light's resolution following its size on screen
+// H to render them one light per pass as variance shadow maps, filtered with one fetch per light instead of PCF
+// G and B to add and remove a few hundred unshadowed coloured lights, culled per cluster of the view frustum
+// Q and E to shade the scene objects forward or deferred, through a G-buffer lit once per pixel
+// 5 and 6 to turn the depth pre-pass off and on, J to print how many fragments the last frame's lit pass shaded
+// 7 and 8 to draw the scene objects as they come or through the sorted render queue (U shows the binds it saved)
+// 9 and 0 to draw the tall cubes one draw each or as one instanced draw per pass
+// [ and ] to draw the objects that never move one by one or merged into one draw per texture (U shows what it saves)
+// C and V to turn per-face shadow caster culling off and on, I to print what the shadow passes drew
+// T and Y to turn shadow caching off and on, - and = to lower and raise how many shadow cube faces are redrawn per frame
+// U to print how many uniform uploads and binds the last frame made and how many the uniform and bind caches saved
 // Briefly; demo displays multiple lights attached to particles that cast shadows on simple geometry and parallax mapped cubes with self shadowing.
 
 
@@ -17,10 +29,25 @@
 // testing git hub
 #include "rt3d.h"
 #include "rt3dObjLoader.h"
+#include "rt3dMeshCache.h"
+#include "rt3dStreamBuffer.h"
+#include "rt3dUniforms.h"
+#include "rt3dShadowAtlas.h"
+#include "rt3dLightClusters.h"
+#include "rt3dRenderQueue.h"
+#include "rt3dStaticBatch.h"
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
 #include <stack>
+#include <map>
+#include <chrono>
+#include <cstdio>
+#include <cfloat>
+#include <bitset>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
 #include "md2model.h"
 #include "Bullet.h"
 #include "particleArray.h"
@@ -42,8 +69,9 @@ sky showSkybox = NORMAL;
 
 GLuint meshIndexCount = 0;
 GLuint toonIndexCount = 0;
-GLuint md2VertCount = 0;
+GLuint md2IndexCount = 0;
 GLuint meshObjects[3];
+rt3d::meshInfo meshData[3]; // bounds etc of the OBJ meshes (meshData[1] is unused, the MD2 model)
 
 //Shader programs
 GLuint shadowShaderProgram; //Main shader for colours and shadows
@@ -53,6 +81,8 @@ GLuint multipleParallaxProgram; //shader used for parallax occlusion
 GLuint particleProgram; //shader used for particles
 
 
+glm::vec3 parallaxCubePosition(1.0f, 2.0f, -5.0f);
+
 glm::vec3 eye(-2.0f, 1.0f, 8.0f);
 glm::vec3 at(0.0f, 1.0f, -1.0f);
 glm::vec3 up(0.0f, 1.0f, 0.0f);
@@ -71,6 +101,7 @@ GLuint depthMapFBO[NR_POINT_LIGHTS]; // FBO
 const GLuint SHADOW_WIDTH = 1024, SHADOW_HEIGHT = 1024;
 const GLuint screenWidth = 800, screenHeight = 600;
 
+GLuint shadowSampler; // lit passes read the shadow maps through this: hardware depth comparison, bilinear filtered
 GLfloat aspect = (GLfloat)SHADOW_WIDTH / (GLfloat)SHADOW_HEIGHT;
 GLfloat near = 0.01f;
 GLfloat far = 25.0f;
@@ -124,6 +155,248 @@ bool leftClick = false;
 // md2 stuff
 md2model tmpModel;
 int currentAnim = 0;
+bool md2GpuAnimation = true; // blend keyframes in the vertex shader rather than on the CPU
+rt3d::streamBuffer md2Stream; // animated hobgoblin vertices, rewritten every frame (CPU animation only)
+
+// handles of every uniform the scene sets, resolved once per program in init
+// a program without one of these has -1 there, which the setters ignore
+struct sceneUniforms {
+	rt3d::uniformHandle model, projection, modelview, mvp;
+	rt3d::uniformHandle currentLight, parallax, alpha;
+	rt3d::uniformHandle diffuseMap, heightMap, normalMap;
+	rt3d::uniformHandle materialDiffuse, materialSpecular, materialShininess;
+	rt3d::uniformHandle depthMap[NR_POINT_LIGHTS], depthMaps, shadowAtlas, atlasTiles;
+	rt3d::uniformHandle shadowMatrices, skipFaces, cullTriangles, instanced;
+	rt3d::uniformHandle clusterLights, clusterLists, clusterLightCount;
+	rt3d::uniformHandle gAlbedo, gNormal, gDepth, inverseViewProjection;
+};
+map<GLuint, sceneUniforms> programUniforms;
+
+// Uniform blocks shared by the scene shaders, each written once per frame by updateSceneBlocks
+// These mirror the std140 block declarations in the shaders: member order and padding must match them
+#define CAMERA_BLOCK_BINDING 0
+#define LIGHTS_BLOCK_BINDING 1
+#define FRAME_BLOCK_BINDING 2
+#define SHADOW_BLOCK_BINDING 3	// shadow matrices of every light, for layered shadows
+
+struct cameraBlock {
+	glm::mat4 projection;
+	glm::mat4 view;
+	glm::vec3 viewPos;
+	GLfloat pad;
+};
+struct pointLightBlock {
+	glm::vec3 position;
+	GLfloat constant;
+	glm::vec3 ambient;
+	GLfloat linear;
+	glm::vec3 diffuse;
+	GLfloat quadratic;
+	glm::vec3 specular;
+	GLfloat pad;
+};
+struct lightsBlock {
+	pointLightBlock pointLights[NR_POINT_LIGHTS];
+};
+struct frameBlock {
+	GLfloat farPlane;
+	GLint numShotsFired;
+	GLfloat clusterNear;		// see rt3dLightClusters.h
+	GLfloat clusterSliceScale;
+};
+static_assert(sizeof(cameraBlock) == 144 && sizeof(pointLightBlock) == 64 && sizeof(frameBlock) == 16,
+	"uniform block structs must match their std140 layout");
+GLuint cameraBuffer, lightsBuffer, frameBuffer;
+
+// Layered shadows render every light's shadow cubemap in one pass over the scene, into a cubemap array
+// (layer = light * 6 + face), with one geometry shader instance per light. That needs cubemap arrays and
+// geometry shader instancing (GL 4.0); without them each light gets its own pass as before.
+#define ALL_LIGHTS -1	// shadowPass for the layered pass
+bool layeredShadowsSupported = false;
+bool layeredShadows = false;
+GLuint layeredDepthProgram, layeredShadowProgram, layeredParallaxProgram; // LAYERED builds of the shadow shaders
+GLuint depthCubemapArray;
+GLuint layeredDepthFBO;
+GLuint shadowsBuffer;
+
+// Per-face culling of shadow casters (see drawObject): objects are tested against the frustum of each of a
+// light's cube faces, and the geometry shader is told which faces to skip. It also drops single triangles
+// outside the faces it does render.
+#define MAX_SHADOW_LIGHTS 16	// most lights one shadow pass can render (-shadowbench goes up to 16)
+bool shadowCulling = true;
+struct shadowPassLights {
+	const glm::vec3 *lights;	// lights whose cubemaps are being rendered - nullptr when not in a shadow pass
+	int firstLight;				// index of lights[0], for the stats
+	int count;					// 1 for a per-light pass, every light for the layered pass
+	const GLuint *faces;		// faces of each light being drawn - the others are skipped like culled ones
+};
+shadowPassLights currentShadowPass = { nullptr, 0, 0, nullptr };
+
+// Shadow caching: the casters are split into a static layer (base cube, tall cubes, bunny and the parallax cube)
+// and a dynamic one (the spinning and moving cubes, and the hobgoblin, which is animated every frame). Each light
+// keeps the depth of its static layer in a map of its own, redrawn only when the light moves or a static caster
+// changes. Its live map is that copied, with the dynamic casters drawn on top - and if no dynamic caster reaches the
+// light, this frame or last, the live map is still right and isn't touched at all.
+// All of this is tracked per cube face, and the faces that are out of date are refreshed under a budget (see
+// scheduleShadowFaces) - without caching, every face is out of date every frame.
+#define STATIC_CASTERS 1
+#define DYNAMIC_CASTERS 2
+#define ALL_CASTERS (STATIC_CASTERS | DYNAMIC_CASTERS)
+bool shadowCaching = true;
+struct lightShadowCache {
+	bool valid;				// false until the static layer has been drawn (and whenever it has to be again)
+	glm::vec3 position;		// where the light was when its static layer was last found out of date
+	glm::vec3 lastPosition;	// and last frame, to tell whether it's moving
+	GLuint staticVersion;	// staticCasterVersion then
+	GLuint staticStale;		// faces whose static layer is out of date
+	GLuint liveStale;		// faces whose live map is out of date
+	GLuint dynamicFaces;	// faces that had dynamic casters in them when they were last drawn
+	GLuint unusable;		// faces whose map holds nothing of this light at all - drawn whatever the budget
+	GLuint waiting[6];		// frames each out of date face has waited to be drawn
+};
+lightShadowCache shadowCache[NR_POINT_LIGHTS];
+bool shadowCacheLayered, shadowCacheAtlas, shadowCacheVSM;	// which path the cache was filled by
+GLuint staticDepthFBO[NR_POINT_LIGHTS], staticDepthCubemap[NR_POINT_LIGHTS];	// static layers, per-light path
+GLuint staticLayeredDepthFBO, staticDepthCubemapArray;						// and layered path
+GLuint shadowCopyFBO[2];	// read and draw framebuffers for copying and clearing single cube faces
+
+// Caster tracking: once a frame, before the shadow passes, the casters are run through drawObject without drawing
+GLuint trackingCasters = 0;			// layer being tracked, 0 when drawing
+GLuint staticCasterHash;			// of every static caster's mesh and model matrix
+GLuint staticCasterVersion = 0;		// bumped whenever that hash changes
+GLuint dynamicCasterFaces[NR_POINT_LIGHTS];	// faces of each light the dynamic casters reach this frame
+
+// Shadow face scheduling: at most shadowFaceBudget cube faces are redrawn per frame. Out of date faces are ranked
+// by their light's priority - higher for lights near the camera, moving, or on screen - times how long they have
+// waited, so distant lights still get their turn, just less often.
+#define SHADOW_FACE_BUDGET (3 * NR_POINT_LIGHTS)	// default: half of all faces each frame
+#define SHADOW_PRIORITY_DISTANCE 10.0f	// a light this far from the camera has half the priority of one at the camera
+GLuint shadowFaceBudget = SHADOW_FACE_BUDGET;
+GLuint refreshFaces[NR_POINT_LIGHTS];		// faces of each light's live map to redraw this frame
+GLuint staticRefreshFaces[NR_POINT_LIGHTS];	// and of its static layer
+
+// Shadow atlas: instead of a full size cubemap each, every light's six faces get tiles of one 16-bit 2D depth
+// texture, sized by how much of the screen the light's shadows can cover (see rt3dShadowAtlas.h). Tile sizes are
+// revisited every SHADOW_ATLAS_REPACK_FRAMES frames, and only tiles whose size changed are moved; when there are too
+// many lights to fit, the least important ones get smaller tiles, so the atlas never grows.
+#define SHADOW_ATLAS_SIZE 4096
+#define SHADOW_ATLAS_MAX_TILE 1024
+#define SHADOW_ATLAS_MIN_TILE 128
+#define SHADOW_ATLAS_REPACK_FRAMES 30
+#define SHADOW_LIGHT_RADIUS 5.0f	// distance within which a light's shadows are taken to matter, for tile sizes
+bool atlasShadows = false;
+GLuint atlasShadowProgram, atlasParallaxProgram; // ATLAS builds of the lighting shaders
+GLuint shadowAtlasFBO, shadowAtlasTexture;
+GLuint staticAtlasFBO, staticAtlasTexture;		// static layers, same layout
+rt3d::atlasTile shadowTiles[6 * NR_POINT_LIGHTS];	// light * 6 + face
+glm::vec4 shadowTileRects[6 * NR_POINT_LIGHTS];		// the same as atlas texture coordinates, for the shaders
+GLuint framesSinceRepack = SHADOW_ATLAS_REPACK_FRAMES;
+
+// Variance shadow maps: on the per-light path, the depth pass can also write the depth and its square to a half
+// float cubemap per light, whose mip chain is then rebuilt. The lit passes take one filtered fetch per light from the
+// mip level as wide as the PCF kernel, and bound the lit share with Chebyshev's inequality - one fetch instead of up
+// to PCF_SAMPLES. The static layers only hold depth, so faces are drawn whole here, not cached (the budget still holds).
+#define VSM_FORMAT GL_RG16F
+bool vsmShadows = false;
+GLuint vsmDepthProgram, vsmShadowProgram, vsmParallaxProgram; // VSM builds of the shadow shaders
+GLuint momentFBO[NR_POINT_LIGHTS], momentCubemap[NR_POINT_LIGHTS];	// each drawn with its light's depthCubemap as depth buffer
+
+// Clustered lights: unshadowed point lights on top of the NR_POINT_LIGHTS shadowed ones. They are binned into the
+// clusters of the view frustum every frame, and each lit fragment only shades the ones listed for its cluster.
+#define CLUSTER_NEAR 1.0f			// the scene camera's near and far planes
+#define CLUSTER_FAR 150.0f
+#define CLUSTER_DEMO_LIGHTS 256		// added by G
+#define CLUSTER_LIGHT_RADIUS 3.0f
+#define CLUSTER_TEXTURE_UNIT 13		// the lights, and the cluster lists on the unit after
+vector<rt3d::clusterLight> clusterLights;
+rt3d::clusterGrid lightClusters;
+
+// Deferred shading: the scene objects are drawn once into a G-buffer - albedo, octahedral encoded normal and depth -
+// which one full screen pass then lights, so every light is shaded once per visible pixel however much the objects
+// overdraw. The pass reads the same shadow maps and cluster lists as forward shading. The parallax cube, light cubes,
+// bullets and particles are still drawn forward on top, depth tested against the depth the lighting pass writes.
+#define GBUFFER_TEXTURE_UNIT 10	// albedo, and the normal and depth on the two units after (the parallax cube rebinds them)
+bool deferredShading = false;
+GLuint gBufferProgram; // writes the G-buffer
+GLuint deferredProgram, layeredDeferredProgram, atlasDeferredProgram, vsmDeferredProgram; // DEFERRED builds of the lighting shader
+GLuint gBufferFBO, gBufferTextures[3];
+GLuint fullscreenVAO; // no attributes - the lighting pass makes its triangle from gl_VertexID
+
+// Depth pre-pass: the opaque objects of the forward lit pass are drawn first with the position-only shader, depth
+// alone, and then lit with the depth test passing only equal depths - so pointShadows.frag and multipleParallaxLight.frag
+// run once per covered pixel, whatever order the objects come in. The vertex shaders declare gl_Position invariant so
+// both passes get the same depths. The deferred path has its own depth pass in the G-buffer, so skips this one.
+bool depthPrepass = false;
+GLuint depthPrepassProgram; // DEPTH_PREPASS build of the shadow depth shaders
+
+// fragment counts of the lit pass, gathered for one frame after J is pressed
+bool gatherOverdrawStats = false;
+bool pipelineStatisticsSupported = false;	// fragment shader invocations need ARB_pipeline_statistics_query
+GLuint overdrawQueries[2];	// GL_SAMPLES_PASSED, and GL_FRAGMENT_SHADER_INVOCATIONS_ARB where supported
+
+// what the shadow passes drew, gathered for one frame after I is pressed
+struct shadowPassStats {
+	GLuint casters[MAX_SHADOW_LIGHTS];		// objects drawn into each light's cubemap
+	GLuint culled[MAX_SHADOW_LIGHTS];		// objects in none of the light's faces, so not drawn for it
+	GLuint faces[MAX_SHADOW_LIGHTS];		// object faces left for the geometry shader (6 per object without culling)
+	GLuint primitives[MAX_SHADOW_LIGHTS];	// triangles the geometry shader emitted - for the whole pass when layered
+	GLuint staticFaces[MAX_SHADOW_LIGHTS];	// faces of the static layer redrawn
+	GLuint liveFaces[MAX_SHADOW_LIGHTS];	// faces of the live map redrawn - if no faces at all, the light cost nothing
+	GLuint waitingFaces[MAX_SHADOW_LIGHTS];	// out of date faces left for later frames
+	GLuint skipped;							// face updates over the budget, all lights
+};
+bool gatherShadowStats = false;
+shadowPassStats shadowStats;
+GLuint shadowQueries[NR_POINT_LIGHTS];	// GL_PRIMITIVES_GENERATED, one per shadow pass
+bool printUniformStats = false; // report uniform traffic at the end of the next frame
+
+// Render queue: while renderSceneObjects or renderShadowCasters runs, drawObject records each object's draw in drawQueue
+// instead of drawing it, and the lot is then sorted by state and drawn through the queue's bind cache (see rt3dRenderQueue.h)
+#define QUEUE_SHADOW_PASS 0	// pass field of the sort keys
+#define QUEUE_LIT_PASS 1
+#define QUEUE_DEPTH_RANGE 150.0f	// distance from the eye the depth field of the sort keys spans
+bool queueDraws = true;
+bool recordingDraws = false;
+rt3d::renderQueue drawQueue;
+// what a queued draw sets up once its program is bound, besides what its drawItem holds
+struct queuedObject {
+	glm::mat4 model;
+	GLint skipFaces[MAX_SHADOW_LIGHTS];	// in shadow passes
+	bool keyframed;						// the hobgoblin's pose, from tmpModel
+};
+vector<queuedObject> queuedObjects;
+// what objects are drawn with besides their mesh and model matrix, kept here for drawObject to queue
+struct objectState {
+	GLuint texture;			// bound on unit 0
+	GLenum cullFace;
+	bool keyframed;
+};
+objectState drawState = { 0, GL_BACK, false };
+
+// Instancing: props that repeat one mesh are drawn with one instanced draw per pass rather than a draw each (see
+// drawInstances). A batch keeps its model matrices in a buffer of its own, uploaded again only when they change.
+#define TALL_CUBES 5
+bool instanceDraws = true;
+GLuint instancedDraws;				// instanced draws drawInstances made, for -batchbench
+struct instanceBatch {
+	GLuint buffer;
+	vector<glm::mat4> uploaded;	// what the buffer holds
+};
+instanceBatch tallCubeBatch;
+
+// Static batching: the objects that never move - the base plate, the tall cubes and the bunny - are merged in world
+// space into one mesh per texture (see rt3dStaticBatch.h), each drawn with one call a pass and an identity model matrix.
+// Once a frame they are run through drawObject to collect them, and the batch only rebuilds the groups of those that
+// moved, appeared or went. Caster tracking still sees them one by one.
+// Off by default: a group's bounds span the whole base plate, so in the shadow passes every static caster goes to all
+// six faces of every light, and the tall cubes lose their instanced draw. -batchbench shows both next to the draws saved.
+bool staticBatching = false;
+rt3d::staticBatch staticScene;
+rt3d::meshSource meshSources[3];	// in memory copies of the OBJ meshes, for the batch (meshSources[1] is unused)
+bool collectingStatic = false;
+vector<GLuint> staticIds;			// batch id of each static object, in the order they are drawn
+GLuint staticCollected;				// static objects collected so far this frame
+GLuint shadowPassDraws;				// draw calls the shadow passes made this frame
 
 // Set up rendering context
 SDL_Window * setupRC(SDL_GLContext &context) {
@@ -234,131 +507,283 @@ GLuint loadCubeMap(const char *fname[6], GLuint *texID)
 	return *texID;	// return value of texure ID, redundant really
 }
 
-void calculateTangents(vector<GLfloat> &tangents, vector<GLfloat> &verts, vector<GLfloat> &normals, vector<GLfloat> &tex_coords, vector<GLuint> &indices) {
+// look up the handles of every uniform the scene sets in program, and attach its uniform blocks
+void resolveUniforms(GLuint program) {
+	sceneUniforms &u = programUniforms[program];
+	u.model = rt3d::uniform(program, "model");
+	u.projection = rt3d::uniform(program, "projection");
+	u.modelview = rt3d::uniform(program, "modelview");
+	u.mvp = rt3d::uniform(program, "MVP");
+	u.currentLight = rt3d::uniform(program, "currentLight");
+	u.parallax = rt3d::uniform(program, "parallax");
+	u.alpha = rt3d::uniform(program, "ex_alpha");
+	u.diffuseMap = rt3d::uniform(program, "diffuseMap");
+	u.heightMap = rt3d::uniform(program, "heightMap");
+	u.normalMap = rt3d::uniform(program, "normalMap");
+	u.materialDiffuse = rt3d::uniform(program, "material.diffuse");
+	u.materialSpecular = rt3d::uniform(program, "material.specular");
+	u.materialShininess = rt3d::uniform(program, "material.shininess");
+	u.shadowMatrices = rt3d::uniform(program, "shadowMatrices");
+	u.skipFaces = rt3d::uniform(program, "skipFaces");
+	u.cullTriangles = rt3d::uniform(program, "cullTriangles");
+	u.instanced = rt3d::uniform(program, "instanced");
+	for (int i = 0; i < NR_POINT_LIGHTS; i++) {
+		u.depthMap[i] = rt3d::uniform(program, "depthMap", i, nullptr);
+	}
+	u.depthMaps = rt3d::uniform(program, "depthMaps");
+	u.shadowAtlas = rt3d::uniform(program, "shadowAtlas");
+	u.atlasTiles = rt3d::uniform(program, "atlasTiles");
+	u.clusterLights = rt3d::uniform(program, "clusterLights");
+	u.clusterLists = rt3d::uniform(program, "clusterLists");
+	u.clusterLightCount = rt3d::uniform(program, "clusterLightCount");
+	u.gAlbedo = rt3d::uniform(program, "gAlbedo");
+	u.gNormal = rt3d::uniform(program, "gNormal");
+	u.gDepth = rt3d::uniform(program, "gDepth");
+	u.inverseViewProjection = rt3d::uniform(program, "inverseViewProjection");
+
+	rt3d::bindUniformBlock(program, "Camera", CAMERA_BLOCK_BINDING);
+	rt3d::bindUniformBlock(program, "Lights", LIGHTS_BLOCK_BINDING);
+	rt3d::bindUniformBlock(program, "Frame", FRAME_BLOCK_BINDING);
+	rt3d::bindUniformBlock(program, "Shadows", SHADOW_BLOCK_BINDING);
+}
+
+// depth cubemap of size x size for one point light, and an FBO to render into it
+void createShadowCubemap(GLuint &fbo, GLuint &cubemap, GLuint size) {
+	glGenFramebuffers(1, &fbo);
+	// Create depth cubemap texture
+	glGenTextures(1, &cubemap);
+	glBindTexture(GL_TEXTURE_CUBE_MAP, cubemap);
+	for (GLuint i = 0; i < 6; ++i)
+		glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 0, GL_DEPTH_COMPONENT, size, size, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+	// Attach cubemap as depth map FBO's color buffer
+	glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+	glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, cubemap, 0);
+	glDrawBuffer(GL_NONE);
+	glReadBuffer(GL_NONE);
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+		std::cout << "Framebuffer not complete!" << std::endl;
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+// as above, for lights point lights at once: a cubemap array attached as a layered depth buffer
+void createShadowCubemapArray(GLuint &fbo, GLuint &cubemaps, GLuint size, GLuint lights) {
+	glGenFramebuffers(1, &fbo);
+	glGenTextures(1, &cubemaps);
+	glBindTexture(GL_TEXTURE_CUBE_MAP_ARRAY, cubemaps);
+	glTexImage3D(GL_TEXTURE_CUBE_MAP_ARRAY, 0, GL_DEPTH_COMPONENT, size, size, 6 * lights, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP_ARRAY, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+	glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+	glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, cubemaps, 0); // all layers, selected by gl_Layer
+	glDrawBuffer(GL_NONE);
+	glReadBuffer(GL_NONE);
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+		std::cout << "Layered framebuffer not complete!" << std::endl;
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
 
-	// Code taken from http://www.terathon.com/code/tangent.html and modified slightly to use vectors instead of arrays
-	// Lengyel, Eric. Computing Tangent Space Basis Vectors for an Arbitrary Mesh. Terathon Software 3D Graphics Library, 2001. 
+// 16-bit depth atlas of size x size, and an FBO to render into its tiles
+void createShadowAtlas(GLuint &fbo, GLuint &atlas, GLuint size) {
+	glGenFramebuffers(1, &fbo);
+	glGenTextures(1, &atlas);
+	glBindTexture(GL_TEXTURE_2D, atlas);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT16, size, size, 0, GL_DEPTH_COMPONENT, GL_UNSIGNED_SHORT, NULL);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, atlas, 0);
+	glDrawBuffer(GL_NONE);
+	glReadBuffer(GL_NONE);
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+		std::cout << "Shadow atlas framebuffer not complete!" << std::endl;
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
 
-	// This is a little messy because my vectors are of type GLfloat:
-	// should have made them glm::vec2 and glm::vec3 - life, would be much easier!
+// mipmapped cubemap of size x size for a light's depth moments, and an FBO drawing to it with depth (the light's
+// depth cubemap) as its depth buffer
+void createMomentCubemap(GLuint &fbo, GLuint &moments, GLuint depth, GLuint size) {
+	glGenFramebuffers(1, &fbo);
+	glGenTextures(1, &moments);
+	glBindTexture(GL_TEXTURE_CUBE_MAP, moments);
+	for (GLuint i = 0; i < 6; ++i)
+		glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 0, VSM_FORMAT, size, size, 0, GL_RG, GL_FLOAT, NULL);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+	glGenerateMipmap(GL_TEXTURE_CUBE_MAP); // allocates the chain
+	glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+	glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, moments, 0);
+	glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, depth, 0);
+	glDrawBuffer(GL_COLOR_ATTACHMENT0);
+	glReadBuffer(GL_NONE);
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+		std::cout << "Moment framebuffer not complete!" << std::endl;
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
 
-	vector<glm::vec3> tan1(verts.size() / 3, glm::vec3(0.0f));
-	vector<glm::vec3> tan2(verts.size() / 3, glm::vec3(0.0f));
-	int triCount = indices.size() / 3;
-	for (int c = 0; c < indices.size(); c += 3)
-	{
-		int i1 = indices[c];
-		int i2 = indices[c + 1];
-		int i3 = indices[c + 2];
-
-		glm::vec3 v1(verts[i1 * 3], verts[i1 * 3 + 1], verts[i1 * 3 + 2]);
-		glm::vec3 v2(verts[i2 * 3], verts[i2 * 3 + 1], verts[i2 * 3 + 2]);
-		glm::vec3 v3(verts[i3 * 3], verts[i3 * 3 + 1], verts[i3 * 3 + 2]);
-
-		glm::vec2 w1(tex_coords[i1 * 2], tex_coords[i1 * 2 + 1]);
-		glm::vec2 w2(tex_coords[i2 * 2], tex_coords[i2 * 2 + 1]);
-		glm::vec2 w3(tex_coords[i3 * 2], tex_coords[i3 * 2 + 1]);
-
-		float x1 = v2.x - v1.x;
-		float x2 = v3.x - v1.x;
-		float y1 = v2.y - v1.y;
-		float y2 = v3.y - v1.y;
-		float z1 = v2.z - v1.z;
-		float z2 = v3.z - v1.z;
-
-		float s1 = w2.x - w1.x;
-		float s2 = w3.x - w1.x;
-		float t1 = w2.y - w1.y;
-		float t2 = w3.y - w1.y;
-
-		float r = 1.0F / (s1 * t2 - s2 * t1);
-		glm::vec3 sdir((t2 * x1 - t1 * x2) * r, (t2 * y1 - t1 * y2) * r,
-			(t2 * z1 - t1 * z2) * r);
-		glm::vec3 tdir((s1 * x2 - s2 * x1) * r, (s1 * y2 - s2 * y1) * r,
-			(s1 * z2 - s2 * z1) * r);
-
-		tan1[i1] += sdir;
-		tan1[i2] += sdir;
-		tan1[i3] += sdir;
-
-		tan2[i1] += tdir;
-		tan2[i2] += tdir;
-		tan2[i3] += tdir;
-	}
-
-	for (int a = 0; a < verts.size(); a += 3)
-	{
-		glm::vec3 n(normals[a], normals[a + 1], normals[a + 2]);
-		glm::vec3 t = tan1[a / 3];
+// G-buffer of width x height - RGBA8 albedo, RG16 normal and 24-bit depth - and an FBO drawing to all three
+void createGBuffer(GLuint &fbo, GLuint textures[3], GLsizei width, GLsizei height) {
+	const GLenum internalFormats[3] = { GL_RGBA8, GL_RG16, GL_DEPTH_COMPONENT24 };
+	const GLenum formats[3] = { GL_RGBA, GL_RG, GL_DEPTH_COMPONENT };
+	const GLenum types[3] = { GL_UNSIGNED_BYTE, GL_UNSIGNED_SHORT, GL_FLOAT };
+	const GLenum attachments[3] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1, GL_DEPTH_ATTACHMENT };
+	glGenFramebuffers(1, &fbo);
+	glGenTextures(3, textures);
+	glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+	for (int i = 0; i < 3; i++) {
+		glBindTexture(GL_TEXTURE_2D, textures[i]);
+		glTexImage2D(GL_TEXTURE_2D, 0, internalFormats[i], width, height, 0, formats[i], types[i], NULL);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST); // read with texelFetch, a texel per pixel
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, attachments[i], GL_TEXTURE_2D, textures[i], 0);
+	}
+	const GLenum drawBuffers[2] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1 };
+	glDrawBuffers(2, drawBuffers);
+	glReadBuffer(GL_NONE);
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+		std::cout << "G-buffer framebuffer not complete!" << std::endl;
+	glBindTexture(GL_TEXTURE_2D, 0);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+void deleteGBuffer(GLuint &fbo, GLuint textures[3]) {
+	glDeleteFramebuffers(1, &fbo);
+	glDeleteTextures(3, textures);
+}
+
+// forget everything the shadow cache knows - every face of every light is redrawn, whatever the budget
+void invalidateShadowCache() {
+	for (int i = 0; i < NR_POINT_LIGHTS; i++) {
+		shadowCache[i].valid = false;
+		shadowCache[i].unusable = 0x3F;
+	}
+}
 
-		glm::vec3 tangent;
-		tangent = (t - n * glm::normalize(glm::dot(n, t)));
+// whether live maps are drawn over copies of the static layers - which hold depth only, so not for variance shadow maps
+bool cachingShadows() {
+	return shadowCaching && !vsmShadows;
+}
+
+// the builds of the lighting shaders that read the current path's shadow maps
+GLuint litShadowProgram() {
+	return atlasShadows ? atlasShadowProgram : layeredShadows ? layeredShadowProgram : vsmShadows ? vsmShadowProgram : shadowShaderProgram;
+}
 
-		// handedness
-		GLfloat w = (glm::dot(glm::cross(n, t), tan2[a / 3]) < 0.0f) ? -1.0f : 1.0f;
+GLuint litParallaxProgram() {
+	return atlasShadows ? atlasParallaxProgram : layeredShadows ? layeredParallaxProgram : vsmShadows ? vsmParallaxProgram : multipleParallaxProgram;
+}
+
+GLuint litDeferredProgram() {
+	return atlasShadows ? atlasDeferredProgram : layeredShadows ? layeredDeferredProgram : vsmShadows ? vsmDeferredProgram : deferredProgram;
+}
 
-		tangents.push_back(tangent.x);
-		tangents.push_back(tangent.y);
-		tangents.push_back(tangent.z);
-		tangents.push_back(w);
+// count unshadowed lights of random colours scattered over the base cube, the same ones for the same seed
+void spawnClusterLights(GLuint count, unsigned int seed) {
+	srand(seed);
+	clusterLights.resize(count);
+	for (GLuint i = 0; i < count; i++) {
+		rt3d::clusterLight &light = clusterLights[i];
+		light.position = glm::vec3(rand() % 2000 / 100.0f - 10.0f, 0.3f + rand() % 300 / 100.0f, rand() % 2000 / 100.0f - 10.0f);
+		light.radius = CLUSTER_LIGHT_RADIUS;
+		light.colour = glm::vec3(rand() % 100, rand() % 100, rand() % 100) / 100.0f;
+		light.pad = 0.0f;
 	}
 }
 
+// bind the light clusters built this frame and point the shader's samplers at them
+void bindLightClusters(const sceneUniforms &u) {
+	rt3d::setUniform1i(u.clusterLights, CLUSTER_TEXTURE_UNIT);
+	rt3d::setUniform1i(u.clusterLists, CLUSTER_TEXTURE_UNIT + 1);
+	rt3d::setUniform1i(u.clusterLightCount, lightClusters.lightCount);
+	glActiveTexture(GL_TEXTURE0 + CLUSTER_TEXTURE_UNIT);
+	glBindTexture(GL_TEXTURE_BUFFER, lightClusters.lightTexture);
+	glActiveTexture(GL_TEXTURE0 + CLUSTER_TEXTURE_UNIT + 1);
+	glBindTexture(GL_TEXTURE_BUFFER, lightClusters.listTexture);
+	glActiveTexture(GL_TEXTURE0);
+}
+
 // Function that initializes shaders, objects and so on
 void init(void) {
 	// Setting up the shaders
 	shadowShaderProgram = rt3d::initShaders("pointShadows.vert", "pointShadows.frag");
 	depthShaderProgram = rt3d::initShaders("simpleShadowMap.vert", "simpleShadowMap.frag", "simpleShadowMap.gs");
+	md2model::setupShader(shadowShaderProgram);
+	md2model::setupShader(depthShaderProgram);
 	skyboxProgram = rt3d::initShaders("cubeMap.vert", "cubeMap.frag");
 	particleProgram = rt3d::initShaders("particle.vert", "particle.frag");
 	multipleParallaxProgram = rt3d::initShaders("multipleParallaxLights.vert", "multipleParallaxLight.frag");
-
-	vector<GLfloat> verts;
-	vector<GLfloat> norms;
-	vector<GLfloat> tex_coords;
+	resolveUniforms(shadowShaderProgram);
+	resolveUniforms(depthShaderProgram);
+	resolveUniforms(skyboxProgram);
+	resolveUniforms(particleProgram);
+	resolveUniforms(multipleParallaxProgram);
+	cameraBuffer = rt3d::createUniformBuffer(CAMERA_BLOCK_BINDING, sizeof(cameraBlock));
+	lightsBuffer = rt3d::createUniformBuffer(LIGHTS_BLOCK_BINDING, sizeof(lightsBlock));
+	frameBuffer = rt3d::createUniformBuffer(FRAME_BLOCK_BINDING, sizeof(frameBlock));
+
+	// the layered shadow path is used whenever the driver can do it
+	layeredShadowsSupported = GLEW_ARB_texture_cube_map_array && GLEW_ARB_gpu_shader5;
+	if (layeredShadowsSupported) {
+		layeredShadowProgram = rt3d::initShaders("pointShadows.vert", "pointShadows.frag", nullptr, "#define LAYERED\n");
+		layeredDepthProgram = rt3d::initShaders("simpleShadowMap.vert", "simpleShadowMap.frag", "simpleShadowMap.gs", "#define LAYERED\n");
+		layeredParallaxProgram = rt3d::initShaders("multipleParallaxLights.vert", "multipleParallaxLight.frag", nullptr, "#define LAYERED\n");
+		md2model::setupShader(layeredShadowProgram);
+		md2model::setupShader(layeredDepthProgram);
+		resolveUniforms(layeredShadowProgram);
+		resolveUniforms(layeredDepthProgram);
+		resolveUniforms(layeredParallaxProgram);
+		layeredDeferredProgram = rt3d::initShaders("deferredLighting.vert", "pointShadows.frag", nullptr, "#define DEFERRED\n#define LAYERED\n");
+		resolveUniforms(layeredDeferredProgram);
+		shadowsBuffer = rt3d::createUniformBuffer(SHADOW_BLOCK_BINDING, 6 * NR_POINT_LIGHTS * sizeof(glm::mat4));
+		layeredShadows = true;
+	}
+	else
+		cout << "Cubemap arrays or geometry shader instancing not supported - rendering shadows one light at a time" << endl;
 
 	const char *cubeTexFiles[6] = {
 		"Town-skybox/cloudtop_bk.bmp", "Town-skybox/cloudtop_ft.bmp", "Town-skybox/cloudtop_rt.bmp", "Town-skybox/cloudtop_lf.bmp", "Town-skybox/cloudtop_up.bmp", "Town-skybox/cloudtop_dn.bmp"
 	};
 	loadCubeMap(cubeTexFiles, &skybox[0]);
 	
-	vector<GLuint> indices;
-	rt3d::loadObj("cube.obj", verts, norms, tex_coords, indices);
-	meshIndexCount = indices.size();
+	// OBJ meshes come from their .rt3dmesh cache when it's up to date
+	// the cache also holds the tangents needed for normal mapping
+	rt3d::loadMeshCached("cube.obj", meshData[0], RT3D_FORMAT_PACKED, &meshSources[0]);
+	meshObjects[0] = meshData[0].vao;
+	meshIndexCount = meshData[0].indexCount;
 	textures_other[0] = loadBitmap("fabric.bmp");
-	meshObjects[0] = rt3d::createMesh(verts.size()/3, verts.data(), nullptr, norms.data(), tex_coords.data(), meshIndexCount, indices.data());
-
-	// also need for normal mapping a VBO for the bitangents
-	vector<GLfloat> tangents;
-	calculateTangents(tangents, verts, norms, tex_coords, indices);
 	
 	textures_other[1] = loadBitmap("hobgoblin2.bmp");
-	meshObjects[1] = tmpModel.ReadMD2Model("tris.MD2");
-	md2VertCount = tmpModel.getVertDataCount();
+	meshObjects[1] = tmpModel.ReadMD2Model("tris.MD2", md2GpuAnimation);
+	md2IndexCount = tmpModel.getIndexCount();
+	if (!md2GpuAnimation)
+		rt3d::createStreamBuffer(md2Stream, tmpModel.getVertDataSize() * sizeof(GLfloat));
 	
 	textures_other[2] = loadBitmap("studdedmetal.bmp");
 	textures_other[3] = loadBitmap("tex3.bmp");
 		
-	verts.clear(); norms.clear();tex_coords.clear();indices.clear();
-	rt3d::loadObj("bunny-5000.obj", verts, norms, tex_coords, indices);
-	toonIndexCount = indices.size();
-	meshObjects[2] = rt3d::createMesh(verts.size()/3, verts.data(), nullptr, norms.data(), nullptr, toonIndexCount, indices.data());
+	rt3d::loadMeshCached("bunny-5000.obj", meshData[2], RT3D_FORMAT_PACKED, &meshSources[2]);
+	meshObjects[2] = meshData[2].vao;
+	toonIndexCount = meshData[2].indexCount;
+	// in world space, positions need full floats; the scene shaders don't read tangents
+	rt3d::initStaticBatch(staticScene, (1 << RT3D_VERTEX) | (1 << RT3D_NORMAL) | (1 << RT3D_TEXCOORD),
+		RT3D_FORMAT_PACKED & ~RT3D_FORMAT_HALF_POSITION);
 
 	glEnable(GL_DEPTH_TEST);
 	glEnable(GL_BLEND);
 	glBlendFunc(GL_SRC_ALPHA,GL_ONE_MINUS_SRC_ALPHA);
 
-
-	glBindVertexArray(meshObjects[0]);
-	GLuint VBO;
-	glGenBuffers(1, &VBO);
-	// VBO for tangent data
-	glBindBuffer(GL_ARRAY_BUFFER, VBO);
-	glBufferData(GL_ARRAY_BUFFER, tangents.size()*sizeof(GLfloat), tangents.data(), GL_STATIC_DRAW);
-	glVertexAttribPointer((GLuint)5, 4, GL_FLOAT, GL_FALSE, 0, 0);
-	glEnableVertexAttribArray(5);
-	glBindVertexArray(0);
-
 	textures[0] = loadBitmap("diffuseMap.bmp");
 	textures[1] = loadBitmap("heightMap.bmp");
 	textures[2] = loadBitmap("normalMap.bmp");
@@ -373,29 +798,78 @@ void init(void) {
 	////////////////////
 	/// FBO for shadows
 	/////////////////////
-	for (int i = STARTING_LIGHT; i < NR_POINT_LIGHTS; i++) {
-		glGenFramebuffers(1, &depthMapFBO[i]);
-		// Create depth cubemap texture
-	//	GLuint depthCubemap;
-		glGenTextures(1, &depthCubemap[i]);
-		glBindTexture(GL_TEXTURE_CUBE_MAP, depthCubemap[i]);
-		for (GLuint i = 0; i < 6; ++i)
-			glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 0, GL_DEPTH_COMPONENT, SHADOW_WIDTH, SHADOW_HEIGHT, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
-		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
-		// Attach cubemap as depth map FBO's color buffer
-		glBindFramebuffer(GL_FRAMEBUFFER, depthMapFBO[i]);
-		glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, depthCubemap[i], 0);
+	for (int i = STARTING_LIGHT; i < NR_POINT_LIGHTS; i++)
+		createShadowCubemap(depthMapFBO[i], depthCubemap[i], SHADOW_WIDTH);
+	for (int i = STARTING_LIGHT; i < NR_POINT_LIGHTS; i++)
+		createShadowCubemap(staticDepthFBO[i], staticDepthCubemap[i], SHADOW_WIDTH);
+	glGenFramebuffers(2, shadowCopyFBO);
+	for (int i = 0; i < 2; i++) {
+		glBindFramebuffer(GL_FRAMEBUFFER, shadowCopyFBO[i]);
 		glDrawBuffer(GL_NONE);
 		glReadBuffer(GL_NONE);
-		if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
-			std::cout << "Framebuffer not complete!" << std::endl;
-		glBindFramebuffer(GL_FRAMEBUFFER, 0);
 	}
-		
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	glGenQueries(NR_POINT_LIGHTS, shadowQueries);
+
+	// the textures themselves stay unfiltered depth (the depth map skybox shows them as they are); the sampler
+	// turns lookups in the lit passes into filtered comparisons against the fragment's depth
+	glGenSamplers(1, &shadowSampler);
+	glSamplerParameteri(shadowSampler, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glSamplerParameteri(shadowSampler, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glSamplerParameteri(shadowSampler, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glSamplerParameteri(shadowSampler, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glSamplerParameteri(shadowSampler, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+	glSamplerParameteri(shadowSampler, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+	glSamplerParameteri(shadowSampler, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+
+	// the atlas path only needs GL 3.3, and its depth pass is the per-light one
+	atlasShadowProgram = rt3d::initShaders("pointShadows.vert", "pointShadows.frag", nullptr, "#define ATLAS\n");
+	atlasParallaxProgram = rt3d::initShaders("multipleParallaxLights.vert", "multipleParallaxLight.frag", nullptr, "#define ATLAS\n");
+	md2model::setupShader(atlasShadowProgram);
+	resolveUniforms(atlasShadowProgram);
+	resolveUniforms(atlasParallaxProgram);
+	createShadowAtlas(shadowAtlasFBO, shadowAtlasTexture, SHADOW_ATLAS_SIZE);
+	createShadowAtlas(staticAtlasFBO, staticAtlasTexture, SHADOW_ATLAS_SIZE);
+	invalidateShadowCache();
+	if (layeredShadowsSupported) {
+		createShadowCubemapArray(layeredDepthFBO, depthCubemapArray, SHADOW_WIDTH, NR_POINT_LIGHTS);
+		createShadowCubemapArray(staticLayeredDepthFBO, staticDepthCubemapArray, SHADOW_WIDTH, NR_POINT_LIGHTS);
+	}
+
+	// variance shadow maps, on the per-light path
+	vsmDepthProgram = rt3d::initShaders("simpleShadowMap.vert", "simpleShadowMap.frag", "simpleShadowMap.gs", "#define VSM\n");
+	vsmShadowProgram = rt3d::initShaders("pointShadows.vert", "pointShadows.frag", nullptr, "#define VSM\n");
+	vsmParallaxProgram = rt3d::initShaders("multipleParallaxLights.vert", "multipleParallaxLight.frag", nullptr, "#define VSM\n");
+	md2model::setupShader(vsmDepthProgram);
+	md2model::setupShader(vsmShadowProgram);
+	resolveUniforms(vsmDepthProgram);
+	resolveUniforms(vsmShadowProgram);
+	resolveUniforms(vsmParallaxProgram);
+	for (int i = STARTING_LIGHT; i < NR_POINT_LIGHTS; i++)
+		createMomentCubemap(momentFBO[i], momentCubemap[i], depthCubemap[i], SHADOW_WIDTH);
+	glEnable(GL_TEXTURE_CUBE_MAP_SEAMLESS); // filtering near a face's edge takes in its neighbour, as the blurred mips need
+
+	rt3d::createClusterGrid(lightClusters, CLUSTER_NEAR, CLUSTER_FAR);
+
+	// deferred shading: the G-buffer pass, and a lighting pass for each shadow path
+	gBufferProgram = rt3d::initShaders("pointShadows.vert", "gbuffer.frag");
+	md2model::setupShader(gBufferProgram);
+	resolveUniforms(gBufferProgram);
+	deferredProgram = rt3d::initShaders("deferredLighting.vert", "pointShadows.frag", nullptr, "#define DEFERRED\n");
+	atlasDeferredProgram = rt3d::initShaders("deferredLighting.vert", "pointShadows.frag", nullptr, "#define DEFERRED\n#define ATLAS\n");
+	vsmDeferredProgram = rt3d::initShaders("deferredLighting.vert", "pointShadows.frag", nullptr, "#define DEFERRED\n#define VSM\n");
+	resolveUniforms(deferredProgram);
+	resolveUniforms(atlasDeferredProgram);
+	resolveUniforms(vsmDeferredProgram);
+	createGBuffer(gBufferFBO, gBufferTextures, screenWidth, screenHeight);
+	glGenVertexArrays(1, &fullscreenVAO);
+
+	depthPrepassProgram = rt3d::initShaders("simpleShadowMap.vert", "simpleShadowMap.frag", nullptr, "#define DEPTH_PREPASS\n");
+	md2model::setupShader(depthPrepassProgram);
+	resolveUniforms(depthPrepassProgram);
+	tallCubeBatch.buffer = rt3d::createInstanceBuffer(TALL_CUBES);
+	pipelineStatisticsSupported = GLEW_ARB_pipeline_statistics_query != GL_FALSE;
+	glGenQueries(2, overdrawQueries);
 }
 
 // Functions used for camera movement
@@ -487,6 +961,43 @@ void update(SDL_Window * window, SDL_Event sdlEvent) {
 		numShotsFired = 0;
 	}
 	if (keys[SDL_SCANCODE_P]) reset = true;
+	if (keys[SDL_SCANCODE_U]) printUniformStats = true;
+	if (keys[SDL_SCANCODE_K]) layeredShadows = atlasShadows = vsmShadows = false;
+	if (keys[SDL_SCANCODE_L]) {
+		layeredShadows = layeredShadowsSupported;
+		atlasShadows = vsmShadows = false;
+	}
+	if (keys[SDL_SCANCODE_O]) {
+		atlasShadows = true;
+		layeredShadows = vsmShadows = false;
+	}
+	if (keys[SDL_SCANCODE_H]) {
+		vsmShadows = true;
+		layeredShadows = atlasShadows = false;
+	}
+	if (keys[SDL_SCANCODE_G] && clusterLights.empty()) spawnClusterLights(CLUSTER_DEMO_LIGHTS, 1);
+	if (keys[SDL_SCANCODE_B]) clusterLights.clear();
+	if (keys[SDL_SCANCODE_Q]) deferredShading = false;
+	if (keys[SDL_SCANCODE_E]) deferredShading = true;
+	if (keys[SDL_SCANCODE_5]) depthPrepass = false;
+	if (keys[SDL_SCANCODE_6]) depthPrepass = true;
+	if (keys[SDL_SCANCODE_J]) gatherOverdrawStats = true;
+	if (keys[SDL_SCANCODE_7]) queueDraws = false;
+	if (keys[SDL_SCANCODE_8]) queueDraws = true;
+	if (keys[SDL_SCANCODE_9]) instanceDraws = false;
+	if (keys[SDL_SCANCODE_0]) instanceDraws = true;
+	if (keys[SDL_SCANCODE_LEFTBRACKET]) staticBatching = false;
+	if (keys[SDL_SCANCODE_RIGHTBRACKET]) staticBatching = true;
+	if (keys[SDL_SCANCODE_C]) shadowCulling = false;
+	if (keys[SDL_SCANCODE_V]) shadowCulling = true;
+	if (keys[SDL_SCANCODE_I]) gatherShadowStats = true;
+	if (keys[SDL_SCANCODE_T]) shadowCaching = false;
+	if (keys[SDL_SCANCODE_MINUS] && shadowFaceBudget > 1) shadowFaceBudget--;
+	if (keys[SDL_SCANCODE_EQUALS] && shadowFaceBudget < 6 * NR_POINT_LIGHTS) shadowFaceBudget++;
+	if (keys[SDL_SCANCODE_Y] && !shadowCaching) {
+		shadowCaching = true;
+		invalidateShadowCache(); // static casters weren't tracked meanwhile
+	}
 	if (toggleMouse)
 	{
 		int MidX = SCREEN_WIDTH / 2;
@@ -522,6 +1033,235 @@ void update(SDL_Window * window, SDL_Event sdlEvent) {
 	}
 }
 
+// Bit n set for each cube face n (+X, -X, +Y, -Y, +Z, -Z) of a point light at lightPos whose 90 degree frustum
+// reaches the world space box boxMin..boxMax. 0 if the box is past the light's far plane.
+GLuint cubeFaceMask(glm::vec3 lightPos, glm::vec3 boxMin, glm::vec3 boxMax) {
+	glm::vec3 lo = boxMin - lightPos, hi = boxMax - lightPos;
+	glm::vec3 closest = glm::max(lo, glm::min(hi, glm::vec3(0.0f))); // point of the box nearest the light
+	if (glm::dot(closest, closest) > far * far)
+		return 0;
+	GLuint mask = 0;
+	for (int face = 0; face < 6; face++) {
+		int axis = face / 2, b = (axis + 1) % 3, c = (axis + 2) % 3;
+		// furthest the box gets in the face's direction; the face sees |b| and |c| up to that distance
+		float along = (face & 1) ? -lo[axis] : hi[axis];
+		if (along >= 0.0f && along - lo[b] >= 0.0f && along + hi[b] >= 0.0f && along - lo[c] >= 0.0f && along + hi[c] >= 0.0f)
+			mask |= 1 << face;
+	}
+	return mask;
+}
+
+// world space box around the model space box boundsMin..boundsMax transformed by model
+void worldBounds(const glm::mat4 &model, const GLfloat *boundsMin, const GLfloat *boundsMax, glm::vec3 &worldMin, glm::vec3 &worldMax) {
+	for (int corner = 0; corner < 8; corner++) {
+		glm::vec3 p = glm::vec3(model * glm::vec4((corner & 1) ? boundsMax[0] : boundsMin[0],
+			(corner & 2) ? boundsMax[1] : boundsMin[1], (corner & 4) ? boundsMax[2] : boundsMin[2], 1.0f));
+		worldMin = corner ? glm::min(worldMin, p) : p;
+		worldMax = corner ? glm::max(worldMax, p) : p;
+	}
+}
+
+// Record a caster while tracking (see trackShadowCasters)
+void trackCaster(GLuint mesh, const glm::mat4 &model, const GLfloat *boundsMin, const GLfloat *boundsMax) {
+	if (trackingCasters == STATIC_CASTERS) {
+		// FNV-1a over the mesh and the model matrix - any change to either means a new static layer
+		const unsigned char *bytes = (const unsigned char*) glm::value_ptr(model);
+		staticCasterHash = (staticCasterHash ^ mesh) * 16777619u;
+		for (size_t i = 0; i < sizeof(glm::mat4); i++)
+			staticCasterHash = (staticCasterHash ^ bytes[i]) * 16777619u;
+		return;
+	}
+	glm::vec3 worldMin, worldMax;
+	if (boundsMin)
+		worldBounds(model, boundsMin, boundsMax, worldMin, worldMax);
+	for (int i = 0; i < NR_POINT_LIGHTS; i++)
+		dynamicCasterFaces[i] |= boundsMin ? cubeFaceMask(pointLightPositions[i], worldMin, worldMax) : 0x3F;
+}
+
+// bind texture on unit 0 for the scene objects drawn after
+void bindObjectTexture(GLuint texture) {
+	drawState.texture = texture;
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, texture);
+}
+
+// add a draw of mesh to drawQueue, with what drawState holds now - instanced, from instanceBuffer, if instances isn't 0
+void queueObject(GLuint shader, GLuint mesh, GLuint indexCount, const glm::mat4 &model, const GLint *skipFaces,
+	GLuint instanceBuffer, GLuint instances) {
+	const bool shadowPass = currentShadowPass.lights != nullptr;
+	rt3d::drawItem item;
+	item.program = shader;
+	item.mesh = mesh;
+	item.indexCount = indexCount;
+	// a program without the material sampler doesn't care what's on unit 0, so needn't sort by it
+	item.texture = programUniforms[shader].materialDiffuse >= 0 ? drawState.texture : 0;
+	item.cullFace = drawState.cullFace;
+	item.instanceBuffer = instanceBuffer;
+	item.instances = instances;
+	item.user = (GLuint) queuedObjects.size();
+	item.key = rt3d::drawKey(shadowPass ? QUEUE_SHADOW_PASS : QUEUE_LIT_PASS, item.program, item.cullFace, item.texture, mesh,
+		glm::length(glm::vec3(model[3]) - eye) / QUEUE_DEPTH_RANGE);
+	drawQueue.items.push_back(item);
+
+	queuedObject object;
+	object.model = model;
+	if (shadowPass)
+		memcpy(object.skipFaces, skipFaces, currentShadowPass.count * sizeof(GLint));
+	object.keyframed = drawState.keyframed;
+	queuedObjects.push_back(object);
+}
+
+// set a queued object's uniforms, once the queue has bound its program
+void setupQueuedObject(const rt3d::drawItem &item, void *) {
+	const queuedObject &object = queuedObjects[item.user];
+	const sceneUniforms &u = programUniforms[item.program];
+	if (currentShadowPass.lights) {
+		rt3d::setUniform1iv(u.skipFaces, currentShadowPass.count, object.skipFaces);
+		rt3d::setUniform1i(u.cullTriangles, shadowCulling);
+	}
+	if (object.keyframed)
+		tmpModel.bindFrames(item.program);
+	else
+		tmpModel.unbindFrames(item.program);
+	rt3d::setUniform1i(u.instanced, item.instances != 0);
+	rt3d::setUniformMatrix4fv(u.model, glm::value_ptr(object.model));
+}
+
+// from here until submitQueuedDraws, drawObject records draws rather than drawing (if queueDraws is set)
+void recordDraws() {
+	recordingDraws = queueDraws;
+}
+
+void submitQueuedDraws() {
+	if (!recordingDraws)
+		return;
+	recordingDraws = false;
+	rt3d::sortQueue(drawQueue);
+	rt3d::submitQueue(drawQueue, setupQueuedObject, nullptr);
+	drawQueue.items.clear();
+	queuedObjects.clear();
+	glBindTexture(GL_TEXTURE_2D, 0); // as drawing them directly leaves it, the hobgoblin being last
+}
+
+// In a shadow pass, the faces of each light to leave out for an object inside worldMin..worldMax (anywhere, if not
+// bounded), as skipFaces masks - counted in the shadow stats. false if the object is in none of any light's faces.
+bool shadowPassFaces(bool bounded, const glm::vec3 &worldMin, const glm::vec3 &worldMax, GLint *skip) {
+	bool drawn = false;
+	for (int i = 0; i < currentShadowPass.count; i++) {
+		GLuint faces = currentShadowPass.faces[i];
+		if (faces && bounded)
+			faces &= cubeFaceMask(currentShadowPass.lights[i], worldMin, worldMax);
+		skip[i] = 0x3F & ~faces;
+		drawn = drawn || faces != 0;
+		if (gatherShadowStats && currentShadowPass.faces[i]) {
+			int light = currentShadowPass.firstLight + i;
+			if (faces)
+				shadowStats.casters[light]++;
+			else
+				shadowStats.culled[light]++;
+			shadowStats.faces[light] += (GLuint) std::bitset<6>(faces).count();
+		}
+	}
+	return drawn;
+}
+
+// Hand a static object to the batch while collecting (see collectStaticObjects). The n-th one drawn keeps the id the
+// n-th had last frame, so the batch only hears of it if it changed.
+void collectStaticObject(GLuint mesh, const glm::mat4 &model) {
+	const rt3d::meshSource *source = nullptr;
+	for (int m = 0; m < 3; m++)
+		if (meshObjects[m] == mesh && !meshSources[m].vertices.empty())
+			source = &meshSources[m];
+	if (!source)
+		return; // only the OBJ meshes are kept in memory to batch from
+	GLuint n = staticCollected++;
+	if (n == staticIds.size())
+		staticIds.push_back(rt3d::addStaticObject(staticScene, *source, drawState.texture, model));
+	else if (staticScene.objects[staticIds[n]].mesh == source && staticScene.objects[staticIds[n]].material == drawState.texture)
+		rt3d::moveStaticObject(staticScene, staticIds[n], model);
+	else {
+		rt3d::removeStaticObject(staticScene, staticIds[n]);
+		staticIds[n] = rt3d::addStaticObject(staticScene, *source, drawState.texture, model);
+	}
+}
+
+// Draw an indexed mesh with the given model matrix. In a shadow pass the object only goes to the cube faces its
+// bounds (model space, nullptr if unknown) reach, and isn't drawn at all if that's none of any light's faces.
+// While recording draws, the draw is queued instead.
+void drawObject(GLuint shader, GLuint mesh, GLuint indexCount, const glm::mat4 &model, const GLfloat *boundsMin, const GLfloat *boundsMax) {
+	if (collectingStatic) {
+		collectStaticObject(mesh, model);
+		return;
+	}
+	if (trackingCasters) {
+		trackCaster(mesh, model, boundsMin, boundsMax);
+		return;
+	}
+	const sceneUniforms &u = programUniforms[shader];
+	GLint skip[MAX_SHADOW_LIGHTS];
+	if (currentShadowPass.lights) {
+		const bool bounded = shadowCulling && boundsMin;
+		glm::vec3 worldMin, worldMax;
+		if (bounded)
+			worldBounds(model, boundsMin, boundsMax, worldMin, worldMax);
+		if (!shadowPassFaces(bounded, worldMin, worldMax, skip))
+			return;
+		if (!recordingDraws) {
+			rt3d::setUniform1iv(u.skipFaces, currentShadowPass.count, skip);
+			rt3d::setUniform1i(u.cullTriangles, shadowCulling);
+		}
+	}
+	if (recordingDraws) {
+		queueObject(shader, mesh, indexCount, model, skip, 0, 0);
+		return;
+	}
+	rt3d::setUniform1i(u.instanced, 0);
+	rt3d::setUniformMatrix4fv(u.model, glm::value_ptr(model));
+	rt3d::drawIndexedMesh(mesh, indexCount, GL_TRIANGLES);
+}
+
+// Draw count copies of an indexed mesh, copy i with models[i], as one instanced draw from batch's buffer (created with
+// room for count). In a shadow pass they are culled together, by the box around all their bounds. While recording
+// draws the draw is queued, and with instancing off each copy goes through drawObject on its own.
+void drawInstances(GLuint shader, GLuint mesh, GLuint indexCount, const glm::mat4 *models, GLuint count, instanceBatch &batch,
+	const GLfloat *boundsMin, const GLfloat *boundsMax) {
+	if (trackingCasters || collectingStatic || !instanceDraws) {
+		for (GLuint i = 0; i < count; i++)
+			drawObject(shader, mesh, indexCount, models[i], boundsMin, boundsMax);
+		return;
+	}
+	const sceneUniforms &u = programUniforms[shader];
+	GLint skip[MAX_SHADOW_LIGHTS];
+	if (currentShadowPass.lights) {
+		const bool bounded = shadowCulling && boundsMin;
+		glm::vec3 worldMin, worldMax;
+		for (GLuint i = 0; bounded && i < count; i++) {
+			glm::vec3 instanceMin, instanceMax;
+			worldBounds(models[i], boundsMin, boundsMax, instanceMin, instanceMax);
+			worldMin = i ? glm::min(worldMin, instanceMin) : instanceMin;
+			worldMax = i ? glm::max(worldMax, instanceMax) : instanceMax;
+		}
+		if (!shadowPassFaces(bounded, worldMin, worldMax, skip))
+			return;
+		if (!recordingDraws) {
+			rt3d::setUniform1iv(u.skipFaces, currentShadowPass.count, skip);
+			rt3d::setUniform1i(u.cullTriangles, shadowCulling);
+		}
+	}
+	instancedDraws++;
+	// every pass draws the same copies, so this is once a frame at most - and never for ones that stand still
+	if (batch.uploaded.size() != count || memcmp(batch.uploaded.data(), models, count * sizeof(glm::mat4)) != 0) {
+		batch.uploaded.assign(models, models + count);
+		rt3d::updateInstanceBuffer(batch.buffer, glm::value_ptr(models[0]), count);
+	}
+	if (recordingDraws) {
+		queueObject(shader, mesh, indexCount, models[0], skip, batch.buffer, count);
+		return;
+	}
+	rt3d::setUniform1i(u.instanced, 1);
+	rt3d::drawIndexedMeshInstanced(mesh, indexCount, GL_TRIANGLES, batch.buffer, count);
+}
+
 // Rendering functions; each of these renders a different part of the scene
 // For the sake of simplicity and not causing confusion, we reset the model matrix instead of pushing an identity to the modelview stack
 void renderBaseCube(GLuint shader) {
@@ -529,8 +1269,7 @@ void renderBaseCube(GLuint shader) {
 	model = glm::mat4();
 	model = glm::translate(model, glm::vec3(-10.0f, -0.1f, -10.0f));
 	model = glm::scale(model, glm::vec3(20.0f, 0.1f, 20.0f));
-	rt3d::setUniformMatrix4fv(shader, "model", glm::value_ptr(model));
-	rt3d::drawIndexedMesh(meshObjects[0], meshIndexCount, GL_TRIANGLES);
+	drawObject(shader, meshObjects[0], meshIndexCount, model, meshData[0].boundsMin, meshData[0].boundsMax);
 }
 
 void renderSpinningCube(GLuint shader) {
@@ -539,19 +1278,17 @@ void renderSpinningCube(GLuint shader) {
 	model = glm::translate(model, glm::vec3(-6.0f, 1.0f, -3.0f));
 	model = glm::rotate(model, float(theta*DEG_TO_RADIAN), glm::vec3(1.0f, 1.0f, 1.0f));
 	model = glm::scale(model, glm::vec3(0.5f, 0.5f, 0.5f));
-	rt3d::setUniformMatrix4fv(shader, "model", glm::value_ptr(model));
-	rt3d::drawIndexedMesh(meshObjects[0], meshIndexCount, GL_TRIANGLES);
+	drawObject(shader, meshObjects[0], meshIndexCount, model, meshData[0].boundsMin, meshData[0].boundsMax);
 }
 
 void renderTallCubes(GLuint shader) {
-	glm::mat4 model;
-	for (int b = 0; b <5; b++) {
-		model = glm::mat4();
-		model = glm::translate(model, glm::vec3(-10.0f + b * 2, 2.0f, -12.0f + b * 2));
-		model = glm::scale(model, glm::vec3(0.5f, 1.0f + b/3, 0.5f));
-		rt3d::setUniformMatrix4fv(shader, "model", glm::value_ptr(model));
-		rt3d::drawIndexedMesh(meshObjects[0], meshIndexCount, GL_TRIANGLES);
+	glm::mat4 model[TALL_CUBES];
+	for (int b = 0; b < TALL_CUBES; b++) {
+		model[b] = glm::mat4();
+		model[b] = glm::translate(model[b], glm::vec3(-10.0f + b * 2, 2.0f, -12.0f + b * 2));
+		model[b] = glm::scale(model[b], glm::vec3(0.5f, 1.0f + b/3, 0.5f));
 	}
+	drawInstances(shader, meshObjects[0], meshIndexCount, model, TALL_CUBES, tallCubeBatch, meshData[0].boundsMin, meshData[0].boundsMax);
 }
 
 void renderBunny(GLuint shader) {
@@ -559,30 +1296,38 @@ void renderBunny(GLuint shader) {
 	model = glm::mat4();
 	model = glm::translate(model, glm::vec3(-7.0f, 0.5f, -2.0f));
 	model = glm::scale(model, glm::vec3(10.0, 10.0, 10.0));
-	rt3d::setUniformMatrix4fv(shader, "model", glm::value_ptr(model));
-	rt3d::drawIndexedMesh(meshObjects[2], toonIndexCount, GL_TRIANGLES);
+	drawObject(shader, meshObjects[2], toonIndexCount, model, meshData[2].boundsMin, meshData[2].boundsMax);
 }
 
-void renderHobgoblin(GLuint shader) {
-	// animation can adversely impact performace on some machine.
-	// This is particularly true in the case of multiple lights / shadows, and has hence been commented out
-	// In a real case scenario it would be sensible to animate it outside the rendering function, as calling this twice will make all animations twice as fast
-
-	//tmpModel.Animate(currentAnim, 0.1);
-	//rt3d::updateMesh(meshObjects[1], RT3D_VERTEX, tmpModel.getAnimVerts(), tmpModel.getVertDataSize());
+// advance the hobgoblin's animation - on the GPU path that's all, otherwise stream this frame's vertices
+void animateHobgoblin() {
+	tmpModel.Animate(currentAnim, 0.1f);
+	if (!md2GpuAnimation)
+		rt3d::updateMesh(meshObjects[1], RT3D_VERTEX, md2Stream, tmpModel.getAnimVerts(), tmpModel.getVertDataSize());
+}
 
+void renderHobgoblin(GLuint shader) {
+	// animated once per frame in animateHobgoblin, so every pass draws the same pose
 	// draw the hobgoblin
 	glCullFace(GL_FRONT); // md2 faces are defined clockwise, so cull front face
-	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(GL_TEXTURE_2D, textures_other[1]);
+	const objectState previous = drawState;
+	bindObjectTexture(textures_other[1]);
+	drawState.cullFace = GL_FRONT;
+	drawState.keyframed = true;
 	glm::mat4 model;
 	model = glm::mat4();
 	model = glm::translate(model, glm::vec3(-8.0f, 1.2f, -6.0f));
 	model = glm::rotate(model, float(90.0f*DEG_TO_RADIAN), glm::vec3(-1.0f, 0.0f, 0.0f));
 	model = glm::scale(model, glm::vec3(1.0*0.05, 1.0*0.05, 1.0*0.05));
-	rt3d::setUniformMatrix4fv(shader, "model", glm::value_ptr(model));
-	rt3d::drawMesh(meshObjects[1], md2VertCount, GL_TRIANGLES);
+	GLfloat boundsMin[3], boundsMax[3];
+	tmpModel.getBounds(boundsMin, boundsMax);
+	if (!trackingCasters && !recordingDraws)
+		tmpModel.bindFrames(shader);
+	drawObject(shader, meshObjects[1], md2IndexCount, model, boundsMin, boundsMax);
+	if (!trackingCasters && !recordingDraws)
+		tmpModel.unbindFrames(shader); // nothing else is keyframed
 	glCullFace(GL_BACK);
+	drawState = previous;
 
 	// reset texture
 	glBindTexture(GL_TEXTURE_2D, 0);
@@ -594,12 +1339,17 @@ void renderMovingCube(GLuint shader) {
 	model = glm::translate(model, glm::vec3(-7.0f+moveVar, 4.0f, -2.0f+moveVar));
 	model = glm::rotate(model, float(theta*DEG_TO_RADIAN), glm::vec3(1.0f, 1.0f, 1.0f));
 	model = glm::scale(model, glm::vec3(0.3f, 0.5f, 0.6f));
-	rt3d::setUniformMatrix4fv(shader, "model", glm::value_ptr(model));
-	rt3d::drawIndexedMesh(meshObjects[0], meshIndexCount, GL_TRIANGLES);
+	drawObject(shader, meshObjects[0], meshIndexCount, model, meshData[0].boundsMin, meshData[0].boundsMax);
 }
 
 // updates variables to move objects in the scene (for testing purposes)
 void moveObjects() {
+	// the clustered lights circle slowly around the middle of the scene
+	const float turn = 0.2f * DEG_TO_RADIAN;
+	for (size_t i = 0; i < clusterLights.size(); i++) {
+		glm::vec3 &p = clusterLights[i].position;
+		p = glm::vec3(p.x * cos(turn) - p.z * sin(turn), p.y, p.x * sin(turn) + p.z * cos(turn));
+	}
 	theta += 2.0f;
 	if (moveVar >= 3.0f)
 		switchMov = false;
@@ -613,61 +1363,88 @@ void moveObjects() {
 	}
 }
 
-//function that passes all light positions and properties to the shader
-void pointLights(GLuint shader) {
+// write the camera, every light's position and properties, and the per-frame constants to their uniform blocks
+// once per frame - every pass and every program reads the same buffers
+void updateSceneBlocks(glm::mat4 projection, glm::mat4 viewMatrix) {
+	cameraBlock camera;
+	camera.projection = projection;
+	camera.view = viewMatrix;
+	camera.viewPos = eye;
+	camera.pad = 0.0f;
+	rt3d::updateUniformBuffer(cameraBuffer, &camera, sizeof(camera));
+
+	lightsBlock lights = {};
+	for (int i = STARTING_LIGHT; i < NR_POINT_LIGHTS; i++) {
+		pointLightBlock &light = lights.pointLights[i];
+		light.position = pointLightPositions[i];
+		light.ambient = glm::vec3(0.05f, 0.05f, 0.05f);
+		light.diffuse = glm::vec3(0.8f, 0.8f, 0.8f);
+		light.specular = glm::vec3(1.0f, 1.0f, 1.0f);
+		light.constant = 1.0f;
+		light.linear = 0.09f;
+		light.quadratic = 0.032f;
+	}
+	rt3d::updateUniformBuffer(lightsBuffer, &lights, sizeof(lights));
 
 	int modeSpecificVariable;
 	if (gunMode) modeSpecificVariable = numShotsFired;
 	else if (particleMode) modeSpecificVariable = numOfParticles;
 
-	GLuint uniformIndex = glGetUniformLocation(shader, "viewPos");
-	glUniform3fv(uniformIndex, 1, glm::value_ptr(eye));
-	uniformIndex = glGetUniformLocation(shader, "numShotsFired");
-	glUniform1i(uniformIndex, modeSpecificVariable);
+	frameBlock frame;
+	memset(&frame, 0, sizeof(frame));
+	frame.farPlane = far;
+	frame.numShotsFired = modeSpecificVariable;
+	frame.clusterNear = lightClusters.nearPlane;
+	frame.clusterSliceScale = rt3d::clusterSliceScale(lightClusters);
+	rt3d::updateUniformBuffer(frameBuffer, &frame, sizeof(frame));
+}
 
-	for (int i = STARTING_LIGHT; i < NR_POINT_LIGHTS; i++) {
-		string number = to_string(i);
-		uniformIndex = glGetUniformLocation(shader, ("pointLights[" + number + "].position").c_str());
-		glUniform3f(uniformIndex, pointLightPositions[i].x, pointLightPositions[i].y, pointLightPositions[i].z);
-		uniformIndex = glGetUniformLocation(shader, ("pointLights[" + number + "].ambient").c_str());
-		glUniform3f(uniformIndex, 0.05f, 0.05f, 0.05f);
-		uniformIndex = glGetUniformLocation(shader, ("pointLights[" + number + "].diffuse").c_str());
-		glUniform3f(uniformIndex, 0.8f, 0.8f, 0.8f);
-		uniformIndex = glGetUniformLocation(shader, ("pointLights[" + number + "].specular").c_str());
-		glUniform3f(uniformIndex, 1.0f, 1.0f, 1.0f);
-		uniformIndex = glGetUniformLocation(shader, ("pointLights[" + number + "].constant").c_str());
-		glUniform1f(uniformIndex, 1.0f);
-		uniformIndex = glGetUniformLocation(shader, ("pointLights[" + number + "].linear").c_str());
-		glUniform1f(uniformIndex, 0.09);
-		uniformIndex = glGetUniformLocation(shader, ("pointLights[" + number + "].quadratic").c_str());
-		glUniform1f(uniformIndex, 0.032);
+// bind the shadow maps to texture units firstUnit onwards and point the shader's shadow samplers at them
+void bindShadowMaps(const sceneUniforms &u, int firstUnit) {
+	if (atlasShadows) {
+		rt3d::setUniform1i(u.shadowAtlas, firstUnit);
+		rt3d::setUniform4fv(u.atlasTiles, 6 * NR_POINT_LIGHTS, glm::value_ptr(shadowTileRects[0]));
+		glActiveTexture(GL_TEXTURE0 + firstUnit);
+		glBindTexture(GL_TEXTURE_2D, shadowAtlasTexture);
+		glBindSampler(firstUnit, shadowSampler);
+		return;
+	}
+	if (layeredShadows) {
+		rt3d::setUniform1i(u.depthMaps, firstUnit);
+		glActiveTexture(GL_TEXTURE0 + firstUnit);
+		glBindTexture(GL_TEXTURE_CUBE_MAP_ARRAY, depthCubemapArray);
+		glBindSampler(firstUnit, shadowSampler);
+		return;
+	}
+	for (int i = 0; i < NR_POINT_LIGHTS; i++) {
+		// each in a different texture unit
+		rt3d::setUniform1i(u.depthMap[i], firstUnit + i);
+		glActiveTexture(GL_TEXTURE0 + firstUnit + i);
+		// moments are filtered as they are, with the texture's own mipmapped filtering - no comparison
+		glBindTexture(GL_TEXTURE_CUBE_MAP, vsmShadows ? momentCubemap[i] : depthCubemap[i]);
+		glBindSampler(firstUnit + i, vsmShadows ? 0 : shadowSampler);
 	}
 }
 
+// back to plain texture lookups on the units bindShadowMaps used (1 and 5 onwards)
+void releaseShadowSamplers() {
+	for (GLuint unit = 1; unit < 5 + NR_POINT_LIGHTS; unit++)
+		glBindSampler(unit, 0);
+}
+
 // draw the parallax mapped cube
 void drawMappedCube(GLuint shader, bool parallax, glm::vec3 translate, glm::mat4 projection) {
 	glUseProgram(shader);
-	pointLights(shader);
 
-	GLuint uniformIndex = glGetUniformLocation(shader, "far_plane");
-	glUniform1f(uniformIndex, far);	
-	uniformIndex = glGetUniformLocation(shader, "viewPos");
-	glUniform3fv(uniformIndex, 1, glm::value_ptr(eye));
+	const sceneUniforms &u = programUniforms[shader];
 
 	// pass in depthmaps for shadows
-	for (int i = 0; i < NR_POINT_LIGHTS; i++) {
-		uniformIndex = glGetUniformLocation(shader, ("depthMap[" + to_string(i) + "]").c_str());
-		glUniform1i(uniformIndex, 5 + i);
-		glActiveTexture(GL_TEXTURE5 + i);
-		glBindTexture(GL_TEXTURE_CUBE_MAP, depthCubemap[i]);
-	}
+	bindShadowMaps(u, 5);
+	bindLightClusters(u);
 	// Now bind textures to texture units
-	uniformIndex = glGetUniformLocation(shader, "diffuseMap");
-	glUniform1i(uniformIndex, 10);
-	uniformIndex = glGetUniformLocation(shader, "heightMap");
-	glUniform1i(uniformIndex, 11);
-	uniformIndex = glGetUniformLocation(shader, "normalMap");
-	glUniform1i(uniformIndex, 12);
+	rt3d::setUniform1i(u.diffuseMap, 10);
+	rt3d::setUniform1i(u.heightMap, 11);
+	rt3d::setUniform1i(u.normalMap, 12);
 	glActiveTexture(GL_TEXTURE10);
 	glBindTexture(GL_TEXTURE_2D, textures[0]);
 	glActiveTexture(GL_TEXTURE11);
@@ -675,40 +1452,37 @@ void drawMappedCube(GLuint shader, bool parallax, glm::vec3 translate, glm::mat4
 	glActiveTexture(GL_TEXTURE12);
 	glBindTexture(GL_TEXTURE_2D, textures[2]);
 
-	rt3d::setUniformMatrix4fv(shader, "view", glm::value_ptr(mvStack.top()));
-	rt3d::setUniformMatrix4fv(shader, "projection", glm::value_ptr(projection));
-
 	glm::mat4 model(1.0); // new
 	model = glm::translate(model, translate);
-	uniformIndex = glGetUniformLocation(shader, "cameraPos");
-	glUniform3fv(uniformIndex, 1, glm::value_ptr(eye));
-	glUniform1i(glGetUniformLocation(shader, "parallax"), parallax);
-	rt3d::setUniformMatrix4fv(shader, "model", glm::value_ptr(model));
-
-	rt3d::drawIndexedMesh(meshObjects[0], meshIndexCount, GL_TRIANGLES);
+	rt3d::setUniform1i(u.parallax, parallax);
+	drawObject(shader, meshObjects[0], meshIndexCount, model, meshData[0].boundsMin, meshData[0].boundsMax);
 }
 
 // Since we're generating a depth cubemap, we'll need a different view matrix per each of the 6 directions
 // we can generate these with glm::lookat and pass them to the geometry shader
 // these are the equivalent of the lightspace transform matrix used in conventional shadow mapping
-void pointShadows(GLuint shader, int i) {
+void shadowTransforms(glm::vec3 lightPos, glm::mat4 transforms[6]) {
 		glm::mat4 shadowProj = glm::perspective(float(90.0f*DEG_TO_RADIAN), aspect, near, far); //perspective projection is the best suited for this
-		std::vector<glm::mat4> shadowTransforms;
-		shadowTransforms.push_back(shadowProj *
-			glm::lookAt(pointLightPositions[i], pointLightPositions[i] + glm::vec3(1.0, 0.0, 0.0), glm::vec3(0.0, -1.0, 0.0)));
-		shadowTransforms.push_back(shadowProj *
-			glm::lookAt(pointLightPositions[i], pointLightPositions[i] + glm::vec3(-1.0, 0.0, 0.0), glm::vec3(0.0, -1.0, 0.0)));
-		shadowTransforms.push_back(shadowProj *
-			glm::lookAt(pointLightPositions[i], pointLightPositions[i] + glm::vec3(0.0, 1.0, 0.0), glm::vec3(0.0, 0.0, 1.0)));
-		shadowTransforms.push_back(shadowProj *
-			glm::lookAt(pointLightPositions[i], pointLightPositions[i] + glm::vec3(0.0, -1.0, 0.0), glm::vec3(0.0, 0.0, -1.0)));
-		shadowTransforms.push_back(shadowProj *
-			glm::lookAt(pointLightPositions[i], pointLightPositions[i] + glm::vec3(0.0, 0.0, 1.0), glm::vec3(0.0, -1.0, 0.0)));
-		shadowTransforms.push_back(shadowProj *
-			glm::lookAt(pointLightPositions[i], pointLightPositions[i] + glm::vec3(0.0, 0.0, -1.0), glm::vec3(0.0, -1.0, 0.0)));
-
-		for (int k = 0; k < 6; ++k)
-			glUniformMatrix4fv(glGetUniformLocation(shader, ("shadowMatrices[" + std::to_string(k) + "]").c_str()), 1, GL_FALSE, glm::value_ptr(shadowTransforms[k]));
+		transforms[0] = shadowProj * glm::lookAt(lightPos, lightPos + glm::vec3(1.0, 0.0, 0.0), glm::vec3(0.0, -1.0, 0.0));
+		transforms[1] = shadowProj * glm::lookAt(lightPos, lightPos + glm::vec3(-1.0, 0.0, 0.0), glm::vec3(0.0, -1.0, 0.0));
+		transforms[2] = shadowProj * glm::lookAt(lightPos, lightPos + glm::vec3(0.0, 1.0, 0.0), glm::vec3(0.0, 0.0, 1.0));
+		transforms[3] = shadowProj * glm::lookAt(lightPos, lightPos + glm::vec3(0.0, -1.0, 0.0), glm::vec3(0.0, 0.0, -1.0));
+		transforms[4] = shadowProj * glm::lookAt(lightPos, lightPos + glm::vec3(0.0, 0.0, 1.0), glm::vec3(0.0, -1.0, 0.0));
+		transforms[5] = shadowProj * glm::lookAt(lightPos, lightPos + glm::vec3(0.0, 0.0, -1.0), glm::vec3(0.0, -1.0, 0.0));
+}
+
+void pointShadows(GLuint shader, int i) {
+		glm::mat4 transforms[6];
+		shadowTransforms(pointLightPositions[i], transforms);
+		rt3d::setUniformMatrix4fv(programUniforms[shader].shadowMatrices, 6, glm::value_ptr(transforms[0]));
+}
+
+// the layered pass needs every light's matrices at once - write them to the Shadows uniform block
+void layeredPointShadows(GLuint buffer, const glm::vec3 *lights, int count) {
+	std::vector<glm::mat4> transforms(6 * count);
+	for (int i = 0; i < count; i++)
+		shadowTransforms(lights[i], &transforms[6 * i]);
+	rt3d::updateUniformBuffer(buffer, &transforms[0], (GLuint) (transforms.size() * sizeof(glm::mat4)));
 }
 
 //render cubes at light position, mainly used for debugging
@@ -719,32 +1493,35 @@ void renderlightCubes(GLuint shader) {
 		model = glm::mat4();
 		model = glm::translate(model, glm::vec3(pointLightPositions[i].x, pointLightPositions[i].y, pointLightPositions[i].z));
 		model = glm::scale(model, glm::vec3(0.05f, 0.05f, 0.05f));
-		rt3d::setUniformMatrix4fv(shader, "model", glm::value_ptr(model));
-		rt3d::drawIndexedMesh(meshObjects[0], meshIndexCount, GL_TRIANGLES);
+		drawObject(shader, meshObjects[0], meshIndexCount, model, meshData[0].boundsMin, meshData[0].boundsMax);
 	}
 }
 
 //render skybox; can be used to display the shadow cubemaps as the skybox for a visual representation of what the light sees
 void renderSkybox(glm::mat4 projection) {
 	glUseProgram(skyboxProgram);
-	rt3d::setUniformMatrix4fv(skyboxProgram, "projection", glm::value_ptr(projection));
+	const sceneUniforms &u = programUniforms[skyboxProgram];
+	rt3d::setUniformMatrix4fv(u.projection, glm::value_ptr(projection));
 
 	glDepthMask(GL_FALSE); // make sure writing to update depth test is off
+	glDepthFunc(GL_LEQUAL); // the sky is at the far plane, which is what the depth buffer is cleared to
 	glm::mat3 mvRotOnlyMat3 = glm::mat3(mvStack.top());
 	mvStack.push(glm::mat4(mvRotOnlyMat3));
 
 	glCullFace(GL_FRONT); // drawing inside of cube!
+	glActiveTexture(GL_TEXTURE0);
 	if (showSkybox == NORMAL)
 		glBindTexture(GL_TEXTURE_CUBE_MAP, skybox[0]);
-	else if (showSkybox == DEPTHMAP)
+	else if (showSkybox == DEPTHMAP) // the per-light cubemaps, so only up to date when not using layered shadows
 		glBindTexture(GL_TEXTURE_CUBE_MAP, depthCubemap[selectedLight]);
 	mvStack.top() = glm::scale(mvStack.top(), glm::vec3(1.5f, 1.5f, 1.5f));
-	rt3d::setUniformMatrix4fv(skyboxProgram, "modelview", glm::value_ptr(mvStack.top()));
+	rt3d::setUniformMatrix4fv(u.modelview, glm::value_ptr(mvStack.top()));
 	rt3d::drawIndexedMesh(meshObjects[0], meshIndexCount, GL_TRIANGLES);
 	mvStack.pop();
 	glCullFace(GL_BACK); // drawing inside of cube!
 
 						 // back to remainder of rendering
+	glDepthFunc(GL_LESS);
 	glDepthMask(GL_TRUE); // make sure depth test is on
 }
 
@@ -752,14 +1529,14 @@ void renderSkybox(glm::mat4 projection) {
 void renderParticleSystem(GLuint shader, GLfloat dt, glm::mat4 projection) {
 	//fade -= dt;
 
-	GLuint uniformIndex = glGetUniformLocation(shader, "ex_alpha");
-	glUniform1f(uniformIndex, fade);
+	const sceneUniforms &u = programUniforms[shader];
+	rt3d::setUniform1f(u.alpha, fade);
 	mvStack.push(mvStack.top());
 	mvStack.top() = glm::translate(mvStack.top(), glm::vec3(0.0f, 0.0f, 0.0f));
 	glm::mat4 mvp = projection*mvStack.top();
 	glActiveTexture(GL_TEXTURE0);
 	glBindTexture(GL_TEXTURE_2D, textures[7]);
-	rt3d::setUniformMatrix4fv(shader, "MVP", glm::value_ptr(mvp));
+	rt3d::setUniformMatrix4fv(u.mvp, glm::value_ptr(mvp));
 	glBlendFunc(GL_SRC_ALPHA, GL_ONE);
 
 	glEnable(GL_BLEND);
@@ -795,52 +1572,218 @@ void renderBullet(GLuint shader) {
 	}
 }
 
+// the static batch's groups, each with its texture bound
+void renderStaticBatch(GLuint shader) {
+	const GLuint texture = drawState.texture;
+	for (size_t g = 0; g < staticScene.groups.size(); g++) {
+		const rt3d::staticGroup &group = staticScene.groups[g];
+		if (!group.mesh)
+			continue;
+		if (group.material != drawState.texture)
+			bindObjectTexture(group.material);
+		drawObject(shader, group.mesh, group.indexCount, glm::mat4(1.0), group.boundsMin, group.boundsMax);
+	}
+	if (drawState.texture != texture)
+		bindObjectTexture(texture);
+}
+
+// everything that is drawn in both the shadow and the normal pass (except the parallax cube, which has its own shader)
+// - with static batching, drawn as the batch, unless they are being tracked or collected or the batch hasn't been
+// collected yet (as in the benchmarks that don't go through draw)
+void renderStaticObjects(GLuint shader) {
+	if (staticBatching && !trackingCasters && !collectingStatic && rt3d::staticObjectCount(staticScene)) {
+		renderStaticBatch(shader);
+		return;
+	}
+	renderBaseCube(shader);
+	renderTallCubes(shader);
+	renderBunny(shader);
+}
+
+void renderDynamicObjects(GLuint shader) {
+	renderSpinningCube(shader);
+	renderMovingCube(shader);
+	renderHobgoblin(shader);
+}
+
+void renderSceneObjects(GLuint shader) {
+	recordDraws();
+	renderStaticObjects(shader);
+	renderDynamicObjects(shader);
+	submitQueuedDraws();
+}
+
+// The scene objects, deferred: drawn with their albedo and normals into the G-buffer, which one full screen pass then
+// lights into the framebuffer that was bound, depth included. Leaves shader bound, as forward drawing would.
+void renderDeferredObjects(glm::mat4 projection, glm::mat4 viewMatrix, GLuint shader) {
+	GLint target;
+	glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &target);
+	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, gBufferFBO);
+	glDisable(GL_BLEND); // the normals have no alpha to blend with
+	glClear(GL_DEPTH_BUFFER_BIT); // colour is left: the lighting pass skips pixels at the far plane
+	glUseProgram(gBufferProgram);
+	rt3d::setUniform1i(programUniforms[gBufferProgram].materialDiffuse, 0);
+	bindObjectTexture(textures_other[3]);
+	renderSceneObjects(gBufferProgram);
+	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, target);
+
+	GLuint program = litDeferredProgram();
+	const sceneUniforms &u = programUniforms[program];
+	glUseProgram(program);
+	rt3d::setUniform1f(u.materialShininess, 32.0f);
+	rt3d::setUniform1i(u.gAlbedo, GBUFFER_TEXTURE_UNIT);
+	rt3d::setUniform1i(u.gNormal, GBUFFER_TEXTURE_UNIT + 1);
+	rt3d::setUniform1i(u.gDepth, GBUFFER_TEXTURE_UNIT + 2);
+	for (int i = 0; i < 3; i++) {
+		glActiveTexture(GL_TEXTURE0 + GBUFFER_TEXTURE_UNIT + i);
+		glBindTexture(GL_TEXTURE_2D, gBufferTextures[i]);
+	}
+	rt3d::setUniformMatrix4fv(u.inverseViewProjection, glm::value_ptr(glm::inverse(projection * viewMatrix)));
+	bindShadowMaps(u, 1);
+	bindLightClusters(u);
+	glDepthFunc(GL_ALWAYS); // every pixel is lit once; the depth written is the G-buffer's
+	glBindVertexArray(fullscreenVAO);
+	glDrawArrays(GL_TRIANGLES, 0, 3);
+	glBindVertexArray(0);
+	glDepthFunc(GL_LESS);
+	glUseProgram(shader);
+}
+
+// Draw the depth of every opaque object the forward lit pass will draw, with colour writes off, and leave the depth test
+// passing only fragments at exactly that depth, with shader bound. endDepthPrepass goes back to the usual test.
+void renderDepthPrepass(GLuint shader) {
+	glUseProgram(depthPrepassProgram);
+	glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+	renderSceneObjects(depthPrepassProgram);
+	if (gunMode)
+		renderlightCubes(depthPrepassProgram);
+	if (!parallax) // parallax mapping discards fragments at the cube's edges, so then it is depth tested as usual instead
+		drawObject(depthPrepassProgram, meshObjects[0], meshIndexCount, glm::translate(glm::mat4(1.0), parallaxCubePosition),
+			meshData[0].boundsMin, meshData[0].boundsMax);
+	glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+	glDepthFunc(GL_EQUAL);
+	glDepthMask(GL_FALSE); // the depth is already there
+	glUseProgram(shader);
+}
+
+void endDepthPrepass() {
+	glDepthFunc(GL_LESS);
+	glDepthMask(GL_TRUE);
+}
+
+// count the fragments of what is drawn until endOverdrawQueries
+void beginOverdrawQueries() {
+	glBeginQuery(GL_SAMPLES_PASSED, overdrawQueries[0]);
+	if (pipelineStatisticsSupported)
+		glBeginQuery(GL_FRAGMENT_SHADER_INVOCATIONS_ARB, overdrawQueries[1]);
+}
+
+void endOverdrawQueries() {
+	if (pipelineStatisticsSupported)
+		glEndQuery(GL_FRAGMENT_SHADER_INVOCATIONS_ARB);
+	glEndQuery(GL_SAMPLES_PASSED);
+}
+
+// fragments that passed the depth test and fragment shader invocations (0 if not supported) counted by the last queries
+void readOverdrawStats(GLuint64 &passed, GLuint64 &shaded) {
+	glGetQueryObjectui64v(overdrawQueries[0], GL_QUERY_RESULT, &passed);
+	shaded = 0;
+	if (pipelineStatisticsSupported)
+		glGetQueryObjectui64v(overdrawQueries[1], GL_QUERY_RESULT, &shaded);
+}
+
+void printOverdrawStats() {
+	GLuint64 passed, shaded;
+	readOverdrawStats(passed, shaded);
+	const double pixels = double(screenWidth) * screenHeight;
+	cout << "Lit pass " << (depthPrepass && !deferredShading ? "after a depth pre-pass: " : "without a depth pre-pass: ")
+		<< passed << " fragments passed the depth test (" << passed / pixels << " per pixel), ";
+	if (pipelineStatisticsSupported)
+		cout << shaded << " were shaded (" << shaded / pixels << " per pixel)" << endl;
+	else
+		cout << "fragment shader invocations need ARB_pipeline_statistics_query" << endl;
+}
+
+// the shadow casters in the given layers - the scene objects, and the parallax cube, of which the shadow pass only needs depth
+void renderShadowCasters(GLuint shader, int layers) {
+	recordDraws();
+	if (layers & STATIC_CASTERS) {
+		renderStaticObjects(shader);
+		drawObject(shader, meshObjects[0], meshIndexCount, glm::translate(glm::mat4(1.0), parallaxCubePosition),
+			meshData[0].boundsMin, meshData[0].boundsMax);
+	}
+	if (layers & DYNAMIC_CASTERS)
+		renderDynamicObjects(shader);
+	submitQueuedDraws();
+}
+
+// Run the casters through drawObject without drawing them, to find out whether a static caster changed since
+// last frame and which faces of each light the dynamic casters reach
+void trackShadowCasters() {
+	GLuint previousHash = staticCasterHash;
+	staticCasterHash = 2166136261u;
+	trackingCasters = STATIC_CASTERS;
+	renderShadowCasters(0, STATIC_CASTERS);
+	if (staticCasterHash != previousHash)
+		staticCasterVersion++;
+
+	memset(dynamicCasterFaces, 0, sizeof(dynamicCasterFaces));
+	trackingCasters = DYNAMIC_CASTERS;
+	renderShadowCasters(0, DYNAMIC_CASTERS);
+	trackingCasters = 0;
+}
+
+// Run the static objects through drawObject to bring the batch up to date with them, rebuilding the groups that changed
+void collectStaticObjects() {
+	const objectState previous = drawState;
+	drawState.texture = textures_other[3]; // what RenderShadowScene draws them with
+	collectingStatic = true;
+	staticCollected = 0;
+	renderStaticObjects(0);
+	collectingStatic = false;
+	while (staticIds.size() > staticCollected) {
+		rt3d::removeStaticObject(staticScene, staticIds.back());
+		staticIds.pop_back();
+	}
+	rt3d::updateStaticBatch(staticScene);
+	drawState = previous;
+}
+
 // main render function, sets up the shaders and then calls all other functions
-void RenderShadowScene(glm::mat4 projection, glm::mat4 viewMatrix, GLuint shader, bool cubemap, int shadowPass) {
+void RenderShadowScene(glm::mat4 projection, glm::mat4 viewMatrix, GLuint shader, bool cubemap, int shadowPass, int casters) {
 
-	GLuint uniformIndex;
+	const sceneUniforms &u = programUniforms[shader];
 	glUseProgram(shader);
-	pointLights(shader);
 	// if cubemap translates into "if rendering to the depthmap"
-	if (cubemap) {
-		glUniform1i(glGetUniformLocation(depthShaderProgram, "currentLight"), shadowPass);
+	if (cubemap && shadowPass != ALL_LIGHTS) {
+		rt3d::setUniform1i(u.currentLight, shadowPass);
 		pointShadows(shader, shadowPass);
 	}
-	
-	uniformIndex = glGetUniformLocation(shader, "far_plane");
-	glUniform1f(uniformIndex, far);
 
 	//similarly, if (!cubemap) refers to normal rendering
+	const bool prepassed = !cubemap && depthPrepass && !deferredShading;
 	if(!cubemap){
-		rt3d::setUniformMatrix4fv(shader, "projection", glm::value_ptr(projection));
-		rt3d::setUniformMatrix4fv(shader, "view", glm::value_ptr(viewMatrix));
+		if (prepassed)
+			renderDepthPrepass(shader); // first, as the hobgoblin leaves texture unit 0 empty
 		// material properties in this case roughly translate to textures
-		uniformIndex = glGetUniformLocation(shader, "material.diffuse");
-		glUniform1i(uniformIndex, 0);
-		uniformIndex = glGetUniformLocation(shader, "material.specular");
-		glUniform1i(uniformIndex, 0);
-		glUniform1f(glGetUniformLocation(shader, "material.shininess"), 32.0f); //??
-		glActiveTexture(GL_TEXTURE0);
-		glBindTexture(GL_TEXTURE_2D, textures_other[3]);
-
-		for (int i = 0; i < NR_POINT_LIGHTS; i++) {
-			// pass in the shadowmaps, each in a different texture unit
-			uniformIndex = glGetUniformLocation(shader, ("depthMap[" + to_string(i) + "]").c_str());
-			glUniform1i(uniformIndex, 1+i);
-			glActiveTexture(GL_TEXTURE1+i);
-			glBindTexture(GL_TEXTURE_CUBE_MAP, depthCubemap[i]);
-		}
+		rt3d::setUniform1i(u.materialDiffuse, 0);
+		rt3d::setUniform1i(u.materialSpecular, 0);
+		rt3d::setUniform1f(u.materialShininess, 32.0f); //??
+		bindObjectTexture(textures_other[3]);
+
+		// pass in the shadowmaps
+		bindShadowMaps(u, 1);
+		bindLightClusters(u);
 	}
-		//draw normal scene
-		renderBaseCube(shader);
-		renderSpinningCube(shader);
-		renderTallCubes(shader);
-		renderMovingCube(shader);
-		renderBunny(shader);
-		renderHobgoblin(shader);
-		
-		// if drawing to shadowmap, draw mapped cube
-		if(cubemap) drawMappedCube(shader, parallax, glm::vec3(1.0f, 2.0f, -5.0f), projection);
+		//draw normal scene - or, if drawing to shadowmap, the casters asked for, mapped cube included
+		if (!cubemap && gatherOverdrawStats)
+			beginOverdrawQueries();
+		if (cubemap)
+			renderShadowCasters(shader, casters);
+		else if (deferredShading)
+			renderDeferredObjects(projection, viewMatrix, shader);
+		else
+			renderSceneObjects(shader);
 
 		if (!cubemap) {
 			if (gunMode) {
@@ -848,7 +1791,15 @@ void RenderShadowScene(glm::mat4 projection, glm::mat4 viewMatrix, GLuint shader
 				//render small cubes at light positions when shooting
 				renderlightCubes(shader);
 			}
-			drawMappedCube(multipleParallaxProgram, parallax, glm::vec3(1.0f, 2.0f, -5.0f), projection);
+			if (prepassed && parallax)
+				endDepthPrepass(); // the parallax cube wasn't in the pre-pass
+			drawMappedCube(litParallaxProgram(), parallax, parallaxCubePosition, projection);
+			if (prepassed)
+				endDepthPrepass();
+			if (gatherOverdrawStats)
+				endOverdrawQueries();
+			// the sky goes behind all the opaque objects, and before the particles blend over it
+			renderSkybox(projection);
 		
 			currentTime = SDL_GetTicks();
 			GLfloat dt;
@@ -870,14 +1821,339 @@ void RenderShadowScene(glm::mat4 projection, glm::mat4 viewMatrix, GLuint shader
 	glBindTexture(GL_TEXTURE_2D, 0);
 	glActiveTexture(GL_TEXTURE0);
 	glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
+	if (!cubemap)
+		releaseShadowSamplers();
+
+}
+
+// attach one face of a light's shadow cubemap (or, from a cubemap array, of light's cubemap in it) to target
+void attachShadowFace(GLenum target, GLuint texture, int light, int face, bool array) {
+	if (array)
+		glFramebufferTextureLayer(target, GL_DEPTH_ATTACHMENT, texture, 0, light * 6 + face);
+	else
+		glFramebufferTexture2D(target, GL_DEPTH_ATTACHMENT, GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, texture, 0);
+}
+
+// copy the depth of the given faces of a light's shadow cubemap to another
+void copyShadowFaces(GLuint source, GLuint destination, int light, GLuint faces, bool array) {
+	if (!faces)
+		return;
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, shadowCopyFBO[0]);
+	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, shadowCopyFBO[1]);
+	for (int face = 0; face < 6; face++) {
+		if (!(faces & (1 << face)))
+			continue;
+		attachShadowFace(GL_READ_FRAMEBUFFER, source, light, face, array);
+		attachShadowFace(GL_DRAW_FRAMEBUFFER, destination, light, face, array);
+		glBlitFramebuffer(0, 0, SHADOW_WIDTH, SHADOW_HEIGHT, 0, 0, SHADOW_WIDTH, SHADOW_HEIGHT, GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+	}
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+// clear the given faces of a light's shadow cubemap, leaving the rest alone
+void clearShadowFaces(GLuint texture, int light, GLuint faces, bool array) {
+	if (!faces)
+		return;
+	glBindFramebuffer(GL_FRAMEBUFFER, shadowCopyFBO[1]);
+	for (int face = 0; face < 6; face++) {
+		if (!(faces & (1 << face)))
+			continue;
+		attachShadowFace(GL_FRAMEBUFFER, texture, light, face, array);
+		glClear(GL_DEPTH_BUFFER_BIT);
+	}
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+// clear the given faces of a light's moment cubemap to the far plane, and of its depth cubemap with them
+void clearMomentFaces(GLuint moments, GLuint depth, GLuint faces) {
+	if (!faces)
+		return;
+	const GLfloat farMoments[4] = { 1.0f, 1.0f, 0.0f, 0.0f };
+	glBindFramebuffer(GL_FRAMEBUFFER, shadowCopyFBO[1]);
+	glDrawBuffer(GL_COLOR_ATTACHMENT0);
+	for (int face = 0; face < 6; face++) {
+		if (!(faces & (1 << face)))
+			continue;
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, moments, 0);
+		attachShadowFace(GL_FRAMEBUFFER, depth, 0, face, false);
+		glClearBufferfv(GL_COLOR, 0, farMoments);
+		glClear(GL_DEPTH_BUFFER_BIT);
+	}
+	// back to depth only, as copyShadowFaces and clearShadowFaces expect
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_CUBE_MAP_POSITIVE_X, 0, 0);
+	glDrawBuffer(GL_NONE);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+bool lightOnScreen(int light, const glm::mat4 &viewProjection) {
+	glm::vec4 clip = viewProjection * glm::vec4(pointLightPositions[light], 1.0f);
+	return clip.w > 0.0f && std::abs(clip.x) <= clip.w && std::abs(clip.y) <= clip.w;
+}
+
+// how urgently a light's shadows need redrawing: more for lights near the camera, moving, or on screen
+float lightShadowPriority(int light, const glm::mat4 &viewProjection) {
+	const lightShadowCache &cache = shadowCache[light];
+	glm::vec3 position = pointLightPositions[light];
+	float priority = 1.0f / (1.0f + glm::length(position - eye) / SHADOW_PRIORITY_DISTANCE);
+	if (position != cache.lastPosition)
+		priority *= 4.0f;
+	if (lightOnScreen(light, viewProjection))
+		priority *= 2.0f;
+	return priority;
+}
+
+// Share of the screen height a light's shadows can cover: roughly the projected size of a sphere of SHADOW_LIGHT_RADIUS
+// around it (1 once the camera is inside it), and a quarter of that while the light itself is off screen
+float lightScreenImportance(int light, const glm::mat4 &viewProjection) {
+	float distance = glm::length(pointLightPositions[light] - eye);
+	float importance = distance > SHADOW_LIGHT_RADIUS ? SHADOW_LIGHT_RADIUS / distance : 1.0f;
+	return lightOnScreen(light, viewProjection) ? importance : importance * 0.25f;
+}
+
+// Size each light's tiles by its importance and pack them into the atlas, keeping the tiles whose size is the same.
+// Faces whose tile moved hold another light's depth, or none, until they are redrawn.
+void packShadowAtlas(const glm::mat4 &viewProjection) {
+	std::vector<float> importance(6 * NR_POINT_LIGHTS);
+	std::vector<GLuint> sizes(6 * NR_POINT_LIGHTS);
+	for (int i = 0; i < NR_POINT_LIGHTS; i++) {
+		float lightImportance = lightScreenImportance(i, viewProjection);
+		GLuint size = SHADOW_ATLAS_MAX_TILE;
+		while (size > SHADOW_ATLAS_MIN_TILE && size / 2 >= SHADOW_ATLAS_MAX_TILE * lightImportance)
+			size /= 2;
+		for (int face = 0; face < 6; face++) {
+			importance[i * 6 + face] = lightImportance;
+			sizes[i * 6 + face] = size;
+		}
+	}
+	std::vector<rt3d::atlasTile> tiles(shadowTiles, shadowTiles + 6 * NR_POINT_LIGHTS);
+	if (!rt3d::packShadowAtlas(SHADOW_ATLAS_SIZE, SHADOW_ATLAS_MIN_TILE, importance, sizes, tiles)) {
+		cout << "Too many lights for the shadow atlas - keeping the old tiles" << endl;
+		return;
+	}
+	for (int t = 0; t < 6 * NR_POINT_LIGHTS; t++) {
+		rt3d::atlasTile &tile = shadowTiles[t];
+		if (tile.x == tiles[t].x && tile.y == tiles[t].y && tile.size == tiles[t].size)
+			continue;
+		tile = tiles[t];
+		shadowTileRects[t] = glm::vec4(tile.x, tile.y, tile.size, tile.size) / float(SHADOW_ATLAS_SIZE);
+		shadowCache[t / 6].staticStale |= 1 << (t % 6);
+		shadowCache[t / 6].unusable |= 1 << (t % 6);
+	}
+}
+
+// one out of date cube face waiting to be drawn
+struct shadowFaceUpdate {
+	float priority;
+	int light, face;
+	bool operator<(const shadowFaceUpdate &other) const { return priority > other.priority; }
+};
+
+// Find the out of date faces of every light and pick the ones to redraw this frame, at most shadowFaceBudget of them,
+// into refreshFaces and staticRefreshFaces. The cache is updated as if they've been drawn.
+void scheduleShadowFaces(const glm::mat4 &viewProjection) {
+	std::vector<shadowFaceUpdate> updates;
+	size_t budget = shadowFaceBudget;
+	for (int i = STARTING_LIGHT; i < NR_POINT_LIGHTS; i++) {
+		lightShadowCache &cache = shadowCache[i];
+		if (!cachingShadows())
+			cache.liveStale = 0x3F; // everything is redrawn from scratch
+		else {
+			if (!cache.valid || cache.position != pointLightPositions[i] || cache.staticVersion != staticCasterVersion) {
+				cache.valid = true;
+				cache.position = pointLightPositions[i];
+				cache.staticVersion = staticCasterVersion;
+				cache.staticStale = 0x3F;
+			}
+			// a face with dynamic casters in it now, or when it was last drawn, has changed
+			cache.liveStale |= cache.staticStale | dynamicCasterFaces[i] | cache.dynamicFaces | cache.unusable;
+		}
+		float priority = lightShadowPriority(i, viewProjection);
+		cache.lastPosition = pointLightPositions[i];
+		for (int face = 0; face < 6; face++) {
+			if (!(cache.liveStale & (1 << face)))
+				continue;
+			shadowFaceUpdate update = { priority * ++cache.waiting[face], i, face };
+			if (cache.unusable & (1 << face)) {
+				update.priority = FLT_MAX; // never left showing another light's shadows
+				budget++;
+			}
+			updates.push_back(update);
+		}
+	}
+
+	std::sort(updates.begin(), updates.end());
+	memset(refreshFaces, 0, sizeof(refreshFaces));
+	for (size_t u = 0; u < updates.size() && u < budget; u++)
+		refreshFaces[updates[u].light] |= 1 << updates[u].face;
+
+	for (int i = STARTING_LIGHT; i < NR_POINT_LIGHTS; i++) {
+		lightShadowCache &cache = shadowCache[i];
+		staticRefreshFaces[i] = cachingShadows() ? refreshFaces[i] & cache.staticStale : 0;
+		cache.staticStale &= ~refreshFaces[i];
+		cache.liveStale &= ~refreshFaces[i];
+		cache.unusable &= ~refreshFaces[i];
+		cache.dynamicFaces = (cache.dynamicFaces & ~refreshFaces[i]) | (dynamicCasterFaces[i] & refreshFaces[i]);
+		for (int face = 0; face < 6; face++)
+			if (refreshFaces[i] & (1 << face))
+				cache.waiting[face] = 0;
+		if (gatherShadowStats) {
+			shadowStats.staticFaces[i] = staticRefreshFaces[i];
+			shadowStats.liveFaces[i] = refreshFaces[i];
+			shadowStats.waitingFaces[i] = cache.liveStale;
+		}
+	}
+	if (gatherShadowStats)
+		shadowStats.skipped = updates.size() > budget ? (GLuint) (updates.size() - budget) : 0;
+}
+
+// shadow maps one pass per light, drawing the faces scheduleShadowFaces picked
+void renderPointShadowMaps(glm::mat4 projection) {
+	glViewport(0, 0, SHADOW_WIDTH, SHADOW_HEIGHT);
+	if (vsmShadows)
+		glDisable(GL_BLEND); // moments are written as they are
+	for (int i = STARTING_LIGHT; i < NR_POINT_LIGHTS; i++) {
+		if (gatherShadowStats)
+			glBeginQuery(GL_PRIMITIVES_GENERATED, shadowQueries[i]);
+		if (staticRefreshFaces[i]) {
+			clearShadowFaces(staticDepthCubemap[i], i, staticRefreshFaces[i], false);
+			glBindFramebuffer(GL_FRAMEBUFFER, staticDepthFBO[i]);
+			currentShadowPass = { &pointLightPositions[i], i, 1, &staticRefreshFaces[i] };
+			RenderShadowScene(projection, mvStack.top(), depthShaderProgram, true, i, STATIC_CASTERS);
+		}
+		if (refreshFaces[i]) {
+			if (vsmShadows)
+				clearMomentFaces(momentCubemap[i], depthCubemap[i], refreshFaces[i]);
+			else if (cachingShadows())
+				copyShadowFaces(staticDepthCubemap[i], depthCubemap[i], i, refreshFaces[i], false);
+			else
+				clearShadowFaces(depthCubemap[i], i, refreshFaces[i], false);
+			glBindFramebuffer(GL_FRAMEBUFFER, vsmShadows ? momentFBO[i] : depthMapFBO[i]);
+			currentShadowPass = { &pointLightPositions[i], i, 1, &refreshFaces[i] };
+			// render using light's point of view and simpler shader program
+			RenderShadowScene(projection, mvStack.top(), vsmShadows ? vsmDepthProgram : depthShaderProgram, true, i,
+				cachingShadows() ? DYNAMIC_CASTERS : ALL_CASTERS);
+			if (vsmShadows) {
+				// the mips are the blur - rebuilt from the new faces
+				glActiveTexture(GL_TEXTURE0);
+				glBindTexture(GL_TEXTURE_CUBE_MAP, momentCubemap[i]);
+				glGenerateMipmap(GL_TEXTURE_CUBE_MAP);
+				glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
+			}
+		}
+		if (gatherShadowStats)
+			glEndQuery(GL_PRIMITIVES_GENERATED);
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	}
+	if (vsmShadows)
+		glEnable(GL_BLEND);
+}
 
+// shadow maps in the atlas - a pass per face, into that face's tile
+void renderAtlasShadowMaps(glm::mat4 projection) {
+	glEnable(GL_SCISSOR_TEST); // clears and blits stay inside the tile
+	for (int i = STARTING_LIGHT; i < NR_POINT_LIGHTS; i++) {
+		if (gatherShadowStats)
+			glBeginQuery(GL_PRIMITIVES_GENERATED, shadowQueries[i]);
+		for (int face = 0; face < 6; face++) {
+			GLuint faceBit = 1 << face;
+			if (!(refreshFaces[i] & faceBit))
+				continue;
+			const rt3d::atlasTile &tile = shadowTiles[i * 6 + face];
+			glViewport(tile.x, tile.y, tile.size, tile.size);
+			glScissor(tile.x, tile.y, tile.size, tile.size);
+			currentShadowPass = { &pointLightPositions[i], i, 1, &faceBit };
+			if (staticRefreshFaces[i] & faceBit) {
+				glBindFramebuffer(GL_FRAMEBUFFER, staticAtlasFBO);
+				glClear(GL_DEPTH_BUFFER_BIT);
+				RenderShadowScene(projection, mvStack.top(), depthShaderProgram, true, i, STATIC_CASTERS);
+			}
+			if (shadowCaching) {
+				glBindFramebuffer(GL_READ_FRAMEBUFFER, staticAtlasFBO);
+				glBindFramebuffer(GL_DRAW_FRAMEBUFFER, shadowAtlasFBO);
+				glBlitFramebuffer(tile.x, tile.y, tile.x + tile.size, tile.y + tile.size, tile.x, tile.y, tile.x + tile.size, tile.y + tile.size,
+					GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+			}
+			glBindFramebuffer(GL_FRAMEBUFFER, shadowAtlasFBO);
+			if (!shadowCaching)
+				glClear(GL_DEPTH_BUFFER_BIT);
+			RenderShadowScene(projection, mvStack.top(), depthShaderProgram, true, i, shadowCaching ? DYNAMIC_CASTERS : ALL_CASTERS);
+		}
+		if (gatherShadowStats)
+			glEndQuery(GL_PRIMITIVES_GENERATED);
+	}
+	glDisable(GL_SCISSOR_TEST);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
 }
 
+// every light at once - the geometry shader sends each triangle to every light's cubemap. Each of the two passes
+// (static layers, then live maps) only goes to the faces scheduleShadowFaces picked.
+void renderLayeredShadowMaps(glm::mat4 projection) {
+	layeredPointShadows(shadowsBuffer, pointLightPositions, NR_POINT_LIGHTS);
+	glViewport(0, 0, SHADOW_WIDTH, SHADOW_HEIGHT);
+	if (gatherShadowStats)
+		glBeginQuery(GL_PRIMITIVES_GENERATED, shadowQueries[0]);
+	GLuint staticFaces = 0, liveFaces = 0;
+	for (int i = 0; i < NR_POINT_LIGHTS; i++) {
+		staticFaces |= staticRefreshFaces[i];
+		liveFaces |= refreshFaces[i];
+		clearShadowFaces(staticDepthCubemapArray, i, staticRefreshFaces[i], true);
+	}
+	if (staticFaces) {
+		glBindFramebuffer(GL_FRAMEBUFFER, staticLayeredDepthFBO);
+		currentShadowPass = { pointLightPositions, 0, NR_POINT_LIGHTS, staticRefreshFaces };
+		RenderShadowScene(projection, mvStack.top(), layeredDepthProgram, true, ALL_LIGHTS, STATIC_CASTERS);
+	}
+	if (liveFaces) {
+		for (int i = 0; i < NR_POINT_LIGHTS; i++) {
+			if (shadowCaching)
+				copyShadowFaces(staticDepthCubemapArray, depthCubemapArray, i, refreshFaces[i], true);
+			else
+				clearShadowFaces(depthCubemapArray, i, refreshFaces[i], true);
+		}
+		glBindFramebuffer(GL_FRAMEBUFFER, layeredDepthFBO);
+		currentShadowPass = { pointLightPositions, 0, NR_POINT_LIGHTS, refreshFaces };
+		RenderShadowScene(projection, mvStack.top(), layeredDepthProgram, true, ALL_LIGHTS, shadowCaching ? DYNAMIC_CASTERS : ALL_CASTERS);
+	}
+	if (gatherShadowStats)
+		glEndQuery(GL_PRIMITIVES_GENERATED);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
 
+// report what the last shadow pass drew for each light, once the primitive queries have results
+void printShadowStats() {
+	cout << "Shadow casters (culling " << (shadowCulling ? "on" : "off") << ", caching " << (cachingShadows() ? "on" : "off") << ", "
+		<< (atlasShadows ? "atlas" : layeredShadows ? "layered" : vsmShadows ? "per-light VSM" : "per-light") << " pass):" << endl;
+	GLuint totalPrimitives = 0;
+	for (int i = layeredShadows ? 0 : STARTING_LIGHT; i < NR_POINT_LIGHTS; i++) {
+		if (layeredShadows)
+			printf("  light %d: %u objects drawn, %u culled, %u faces\n", i, shadowStats.casters[i], shadowStats.culled[i], shadowStats.faces[i]);
+		else
+			printf("  light %d: %u objects drawn, %u culled, %u faces, %u triangles emitted\n", i, shadowStats.casters[i], shadowStats.culled[i],
+				shadowStats.faces[i], shadowStats.primitives[i]);
+		printf("    faces redrawn: %u static, %u live; %u waiting\n", (GLuint) std::bitset<6>(shadowStats.staticFaces[i]).count(),
+			(GLuint) std::bitset<6>(shadowStats.liveFaces[i]).count(), (GLuint) std::bitset<6>(shadowStats.waitingFaces[i]).count());
+		if (atlasShadows)
+			printf("    atlas tiles: %u %u %u %u %u %u\n", shadowTiles[i * 6].size, shadowTiles[i * 6 + 1].size, shadowTiles[i * 6 + 2].size,
+				shadowTiles[i * 6 + 3].size, shadowTiles[i * 6 + 4].size, shadowTiles[i * 6 + 5].size);
+		totalPrimitives += shadowStats.primitives[i];
+	}
+	// one invocation renders every light in the layered pass, so its triangles can only be counted together
+	printf("  %u triangles emitted in all\n", totalPrimitives);
+	printf("  face budget %u per frame, %u face updates put off to later frames\n", shadowFaceBudget, shadowStats.skipped);
+	if (atlasShadows)
+		printf("  atlas: %ux%u 16-bit, %u MB with its static layer (cubemaps: %u MB)\n", SHADOW_ATLAS_SIZE, SHADOW_ATLAS_SIZE,
+			2 * SHADOW_ATLAS_SIZE * SHADOW_ATLAS_SIZE * 2 >> 20, 2 * NR_POINT_LIGHTS * 6 * SHADOW_WIDTH * SHADOW_HEIGHT * 4 >> 20);
+}
 
 // draw function called in the main loop
 void draw(SDL_Window * window) {
 
+	rt3d::resetUniformStats();
+	rt3d::resetStateStats();
+	rt3d::resetDrawCalls();
+	if (gatherShadowStats)
+		memset(&shadowStats, 0, sizeof(shadowStats));
+
 	// clear the screen
 	glEnable(GL_CULL_FACE);
 	glClearColor(0.5f, 0.5f, 0.5f, 1.0f);
@@ -894,27 +2170,44 @@ void draw(SDL_Window * window) {
 	// first shadow to FBO
 	// then scene using depthmap data
 	moveObjects();
+	animateHobgoblin();
+	if (staticBatching)
+		collectStaticObjects();
 
 
 	for (int pass = 0; pass < 2; pass++) {
 		camera();
 
 		if (pass == 0) {
-			// need to render once per light
-			for (int i = STARTING_LIGHT; i < NR_POINT_LIGHTS; i++) {
-				glBindFramebuffer(GL_FRAMEBUFFER, depthMapFBO[i]);
-				glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, depthCubemap[i], 0);
-				glDrawBuffer(GL_NONE);
-				glReadBuffer(GL_NONE);
-				glBindFramebuffer(GL_FRAMEBUFFER, 0);
-				glViewport(0, 0, SHADOW_WIDTH, SHADOW_HEIGHT);
-				glBindFramebuffer(GL_FRAMEBUFFER, depthMapFBO[i]);
-				glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT); // clear FBO
-				glClear(GL_DEPTH_BUFFER_BIT);
-
-				RenderShadowScene(projection, mvStack.top(), depthShaderProgram, true, i); // render using light's point of view and simpler shader program
-
-				glBindFramebuffer(GL_FRAMEBUFFER, 0);
+			updateSceneBlocks(projection, mvStack.top()); // the only light and camera uploads this frame
+			rt3d::binClusterLights(lightClusters, clusterLights.data(), (GLuint) clusterLights.size(), mvStack.top(), projection);
+			rt3d::uploadClusters(lightClusters, clusterLights.data());
+			if (shadowCacheLayered != layeredShadows || shadowCacheAtlas != atlasShadows || shadowCacheVSM != vsmShadows) {
+				invalidateShadowCache(); // the maps now being drawn hold another path's leftovers
+				shadowCacheLayered = layeredShadows;
+				shadowCacheAtlas = atlasShadows;
+				shadowCacheVSM = vsmShadows;
+			}
+			if (cachingShadows())
+				trackShadowCasters();
+			if (atlasShadows && ++framesSinceRepack >= SHADOW_ATLAS_REPACK_FRAMES) {
+				packShadowAtlas(projection * mvStack.top());
+				framesSinceRepack = 0;
+			}
+			scheduleShadowFaces(projection * mvStack.top());
+			if (atlasShadows)
+				renderAtlasShadowMaps(projection);
+			else if (layeredShadows)
+				renderLayeredShadowMaps(projection);
+			else
+				renderPointShadowMaps(projection);
+			currentShadowPass = { nullptr, 0, 0, nullptr };
+			shadowPassDraws = rt3d::getDrawCalls();
+			if (gatherShadowStats) {
+				for (int i = layeredShadows ? 0 : STARTING_LIGHT; i < (layeredShadows ? 1 : NR_POINT_LIGHTS); i++)
+					glGetQueryObjectuiv(shadowQueries[i], GL_QUERY_RESULT, &shadowStats.primitives[i]);
+				printShadowStats();
+				gatherShadowStats = false;
 			}
 
 		} else {
@@ -927,19 +2220,648 @@ void draw(SDL_Window * window) {
 			glEnable(GL_CULL_FACE);
 			glClearColor(0.5f, 0.5f, 0.5f, 1.0f);
 	
-			renderSkybox(projection);		
 			// normal rendering
-			RenderShadowScene(projection, mvStack.top(), shadowShaderProgram, false, 0); // render normal scene from normal point of view
+			RenderShadowScene(projection, mvStack.top(), litShadowProgram(), false, 0, ALL_CASTERS); // render normal scene from normal point of view
+			if (gatherOverdrawStats) {
+				printOverdrawStats();
+				gatherOverdrawStats = false;
+			}
 		}
 		glDepthMask(GL_TRUE);
 	}
 	mvStack.pop();
+	if (!md2GpuAnimation)
+		rt3d::endStreamFrame(md2Stream);
+	if (printUniformStats) {
+		const rt3d::uniformStats &stats = rt3d::getUniformStats();
+		cout << "Uniforms this frame: " << stats.uploads << " uploaded, " << stats.redundant << " unchanged and skipped, "
+			<< stats.queriesSaved << " location queries and " << stats.namesSaved << " name strings saved, "
+			<< stats.nameLookups << " looked up by name" << endl;
+		const rt3d::stateStats &state = rt3d::getStateStats();
+		if (queueDraws)
+			cout << "Binds this frame: the " << state.draws << " queued draws asked for " << state.requested << ", "
+				<< state.issued << " were issued after sorting and caching; ";
+		else
+			cout << "Binds this frame: not counted, the scene objects were drawn directly; ";
+		cout << rt3d::getDrawCalls() << " draw calls in all, " << shadowPassDraws << " of them in the shadow passes" << endl;
+		if (staticBatching)
+			cout << "Static batch: " << rt3d::staticObjectCount(staticScene) << " objects drawn as " << rt3d::staticGroupCount(staticScene)
+				<< " per pass (-batchbench counts the draws saved), " << staticScene.rebuilds << " group rebuilds so far" << endl;
+		else
+			cout << "Static batch: off, the static objects were drawn one by one" << endl;
+		printUniformStats = false;
+	}
 	SDL_GL_SwapWindow(window); // swap buffers
 
 }
 
+#define BENCH_SHADOW_SIZE 512	// cubemap size for -shadowbench, so 16 lights' worth still fits comfortably
+
+// Time the shadow pass for 4, 8 and 16 lights: one pass per light against one layered pass for all of them,
+// each with per-face caster culling off and on. Renders the real scene objects with shadow shaders built for each light count.
+void benchmarkShadows(int frames) {
+	if (!layeredShadowsSupported)
+		cout << "Layered shadows not supported here - timing one pass per light only" << endl;
+	const int lightCounts[3] = { 4, 8, 16 };
+	updateSceneBlocks(glm::mat4(1.0), glm::mat4(1.0)); // for far_plane
+
+	GLuint primitivesQuery;
+	glGenQueries(1, &primitivesQuery);
+	bool culling = shadowCulling;
+
+	cout << "lights  path        culling  draws/frame  triangles/frame  CPU ms/frame  CPU+GPU ms/frame" << endl;
+	for (int c = 0; c < 3; c++) {
+		int lights = lightCounts[c];
+		char defines[64];
+		sprintf(defines, "#define NR_POINT_LIGHTS %d\n", lights);
+		string layeredDefines = string(defines) + "#define LAYERED\n";
+
+		// lights spread around the scene, in a Lights block big enough for all of them
+		std::vector<glm::vec3> positions(lights);
+		std::vector<GLuint> allFaces(lights, 0x3F);
+		std::vector<pointLightBlock> lightData(lights);
+		for (int i = 0; i < lights; i++) {
+			float angle = 6.2831853f * i / lights;
+			positions[i] = glm::vec3(-6.0f + 5.0f * std::cos(angle), 2.0f + (i % 3), -6.0f + 5.0f * std::sin(angle));
+			lightData[i].position = positions[i];
+		}
+		GLuint benchLights = rt3d::createUniformBuffer(LIGHTS_BLOCK_BINDING, lights * sizeof(pointLightBlock));
+		rt3d::updateUniformBuffer(benchLights, &lightData[0], lights * sizeof(pointLightBlock));
+
+		for (int run = 0; run < (layeredShadowsSupported ? 4 : 2); run++) {
+			int layered = run / 2;
+			shadowCulling = (run % 2) != 0;
+			GLuint program = rt3d::initShaders("simpleShadowMap.vert", "simpleShadowMap.frag", "simpleShadowMap.gs",
+				layered ? layeredDefines.c_str() : defines);
+			md2model::setupShader(program);
+			resolveUniforms(program);
+			const sceneUniforms &u = programUniforms[program];
+
+			std::vector<GLuint> fbos(layered ? 1 : lights), cubemaps(layered ? 1 : lights);
+			GLuint benchShadows = 0;
+			if (layered) {
+				createShadowCubemapArray(fbos[0], cubemaps[0], BENCH_SHADOW_SIZE, lights);
+				benchShadows = rt3d::createUniformBuffer(SHADOW_BLOCK_BINDING, 6 * lights * sizeof(glm::mat4));
+			}
+			else {
+				for (int i = 0; i < lights; i++)
+					createShadowCubemap(fbos[i], cubemaps[i], BENCH_SHADOW_SIZE);
+			}
+			glViewport(0, 0, BENCH_SHADOW_SIZE, BENCH_SHADOW_SIZE);
+
+			double cpu = 0.0, total = 0.0;
+			GLuint primitives = 0;
+			rt3d::resetDrawCalls();
+			glBeginQuery(GL_PRIMITIVES_GENERATED, primitivesQuery);
+			for (int f = 0; f < frames; f++) {
+				std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+				glUseProgram(program);
+				if (layered) {
+					layeredPointShadows(benchShadows, &positions[0], lights);
+					glBindFramebuffer(GL_FRAMEBUFFER, fbos[0]);
+					glClear(GL_DEPTH_BUFFER_BIT);
+					currentShadowPass = { &positions[0], 0, lights, &allFaces[0] };
+					renderShadowCasters(program, ALL_CASTERS);
+				}
+				else {
+					for (int i = 0; i < lights; i++) {
+						glm::mat4 transforms[6];
+						shadowTransforms(positions[i], transforms);
+						glBindFramebuffer(GL_FRAMEBUFFER, fbos[i]);
+						glClear(GL_DEPTH_BUFFER_BIT);
+						rt3d::setUniform1i(u.currentLight, i);
+						rt3d::setUniformMatrix4fv(u.shadowMatrices, 6, glm::value_ptr(transforms[0]));
+						currentShadowPass = { &positions[i], i, 1, &allFaces[i] };
+						renderShadowCasters(program, ALL_CASTERS);
+					}
+				}
+				currentShadowPass = { nullptr, 0, 0, nullptr };
+				std::chrono::high_resolution_clock::time_point submitted = std::chrono::high_resolution_clock::now();
+				glFinish();
+				std::chrono::high_resolution_clock::time_point finished = std::chrono::high_resolution_clock::now();
+				cpu += std::chrono::duration<double, std::milli>(submitted - start).count();
+				total += std::chrono::duration<double, std::milli>(finished - start).count();
+			}
+			glEndQuery(GL_PRIMITIVES_GENERATED);
+			glGetQueryObjectuiv(primitivesQuery, GL_QUERY_RESULT, &primitives);
+			glBindFramebuffer(GL_FRAMEBUFFER, 0);
+			printf("%6d  %-10s  %-7s  %11u  %15u  %12.3f  %16.3f\n", lights, layered ? "layered" : "per-light", shadowCulling ? "on" : "off",
+				rt3d::getDrawCalls() / frames, primitives / frames, cpu / frames, total / frames);
+
+			glDeleteFramebuffers((GLsizei) fbos.size(), &fbos[0]);
+			glDeleteTextures((GLsizei) cubemaps.size(), &cubemaps[0]);
+			if (benchShadows)
+				glDeleteBuffers(1, &benchShadows);
+			glDeleteProgram(program);
+		}
+		glDeleteBuffers(1, &benchLights);
+	}
+	glDeleteQueries(1, &primitivesQuery);
+	shadowCulling = culling;
+}
+
+// bytes a cubemap takes on the GPU, every mip level included, going by the sizes the driver reports
+GLuint64 cubemapBytes(GLuint cubemap) {
+	GLuint64 bytes = 0;
+	glBindTexture(GL_TEXTURE_CUBE_MAP, cubemap);
+	for (GLint level = 0; ; level++) {
+		GLint width = 0, height = 0, bits = 0;
+		glGetTexLevelParameteriv(GL_TEXTURE_CUBE_MAP_POSITIVE_X, level, GL_TEXTURE_WIDTH, &width);
+		glGetTexLevelParameteriv(GL_TEXTURE_CUBE_MAP_POSITIVE_X, level, GL_TEXTURE_HEIGHT, &height);
+		if (width == 0)
+			break;
+		const GLenum sizes[5] = { GL_TEXTURE_RED_SIZE, GL_TEXTURE_GREEN_SIZE, GL_TEXTURE_BLUE_SIZE, GL_TEXTURE_ALPHA_SIZE, GL_TEXTURE_DEPTH_SIZE };
+		for (int c = 0; c < 5; c++) {
+			GLint size = 0;
+			glGetTexLevelParameteriv(GL_TEXTURE_CUBE_MAP_POSITIVE_X, level, sizes[c], &size);
+			bits += size;
+		}
+		bytes += 6 * (GLuint64) width * height * bits / 8;
+		if (width == 1 && height == 1)
+			break;
+	}
+	glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
+	return bytes;
+}
+
+// an offscreen colour and depth target of width x height for the benchmarks, bound for drawing, with the viewport set to it
+void createBenchTarget(GLsizei width, GLsizei height, GLuint &fbo, GLuint renderbuffers[2]) {
+	glGenFramebuffers(1, &fbo);
+	glGenRenderbuffers(2, renderbuffers);
+	glBindRenderbuffer(GL_RENDERBUFFER, renderbuffers[0]);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+	glBindRenderbuffer(GL_RENDERBUFFER, renderbuffers[1]);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+	glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, renderbuffers[0]);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, renderbuffers[1]);
+	glViewport(0, 0, width, height);
+}
+
+void deleteBenchTarget(GLuint &fbo, GLuint renderbuffers[2]) {
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	glDeleteFramebuffers(1, &fbo);
+	glDeleteRenderbuffers(2, renderbuffers);
+}
+
+// average GPU ms per frame of the lit pass over the scene objects with program (a build of pointShadows), timed with timer;
+// deferred if deferredShading is set, through the G-buffer and litDeferredProgram, for the camera given
+double timeLitPass(GLuint program, int frames, GLuint timer, const glm::mat4 &projection, const glm::mat4 &viewMatrix) {
+	const sceneUniforms &u = programUniforms[program];
+	GLuint64 total = 0;
+	for (int f = 0; f < frames; f++) {
+		glBeginQuery(GL_TIME_ELAPSED, timer);
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+		glUseProgram(program);
+		rt3d::setUniform1i(u.materialDiffuse, 0);
+		rt3d::setUniform1i(u.materialSpecular, 0);
+		rt3d::setUniform1f(u.materialShininess, 32.0f);
+		bindObjectTexture(textures_other[3]);
+		bindShadowMaps(u, 1);
+		bindLightClusters(u);
+		if (deferredShading)
+			renderDeferredObjects(projection, viewMatrix, program);
+		else
+			renderSceneObjects(program);
+		releaseShadowSamplers();
+		glEndQuery(GL_TIME_ELAPSED);
+		GLuint64 elapsed;
+		glGetQueryObjectui64v(timer, GL_QUERY_RESULT, &elapsed);
+		total += elapsed;
+	}
+	return total / 1.0e6 / frames;
+}
+
+// GPU time of the lit pass with the full 20 tap PCF kernel, the adaptive one and variance shadow maps, at 800x600 and
+// 1920x1080; then the time to draw every face of every light's shadow maps, and their memory, with and without VSM.
+// Uses the per-light shadow maps and renders the scene objects only, from the starting camera.
+void benchmarkShadowFilter(int frames) {
+	const GLsizei widths[2] = { 800, 1920 }, heights[2] = { 600, 1080 };
+	const char *filters[3] = { "full", "adaptive", "vsm" };
+	const char *defines[3] = { "#define PCF_PROBE_SAMPLES PCF_SAMPLES\n", nullptr, "#define VSM\n" };
+	layeredShadows = atlasShadows = false;
+	mvStack.push(glm::mat4(1.0));
+	camera();
+
+	// draw the shadow maps once - with VSM, so the moments are there too; the depth is the same either way
+	glm::mat4 projection = glm::perspective(float(60.0f*DEG_TO_RADIAN), 800.0f / 600.0f, 1.0f, 150.0f);
+	updateSceneBlocks(projection, mvStack.top());
+	vsmShadows = true;
+	invalidateShadowCache();
+	scheduleShadowFaces(projection * mvStack.top());
+	renderPointShadowMaps(projection);
+	currentShadowPass = { nullptr, 0, 0, nullptr };
+
+	GLuint timer;
+	glGenQueries(1, &timer);
+	cout << "resolution  filter    GPU ms/frame" << endl;
+	for (int r = 0; r < 2; r++) {
+		GLuint fbo, renderbuffers[2];
+		createBenchTarget(widths[r], heights[r], fbo, renderbuffers);
+		projection = glm::perspective(float(60.0f*DEG_TO_RADIAN), float(widths[r]) / heights[r], 1.0f, 150.0f);
+		updateSceneBlocks(projection, mvStack.top());
+
+		for (int filter = 0; filter < 3; filter++) {
+			vsmShadows = filter == 2; // which maps bindShadowMaps binds
+			GLuint program = rt3d::initShaders("pointShadows.vert", "pointShadows.frag", nullptr, defines[filter]);
+			md2model::setupShader(program);
+			resolveUniforms(program);
+			printf("%4dx%-4d   %-8s  %12.3f\n", widths[r], heights[r], filters[filter], timeLitPass(program, frames, timer, projection, mvStack.top()));
+			glDeleteProgram(program);
+		}
+		deleteBenchTarget(fbo, renderbuffers);
+	}
+
+	// the other side of the trade: what the maps cost to draw (uncached, every face) and to keep
+	projection = glm::perspective(float(60.0f*DEG_TO_RADIAN), 800.0f / 600.0f, 1.0f, 150.0f);
+	updateSceneBlocks(projection, mvStack.top());
+	bool caching = shadowCaching;
+	shadowCaching = false;
+	cout << "maps   GPU ms/frame   MB per light" << endl;
+	for (int vsm = 0; vsm < 2; vsm++) {
+		vsmShadows = vsm != 0;
+		GLuint64 total = 0;
+		for (int f = 0; f < frames; f++) {
+			invalidateShadowCache();
+			scheduleShadowFaces(projection * mvStack.top());
+			glBeginQuery(GL_TIME_ELAPSED, timer);
+			renderPointShadowMaps(projection);
+			glEndQuery(GL_TIME_ELAPSED);
+			GLuint64 elapsed;
+			glGetQueryObjectui64v(timer, GL_QUERY_RESULT, &elapsed);
+			total += elapsed;
+		}
+		currentShadowPass = { nullptr, 0, 0, nullptr };
+		GLuint64 bytes = cubemapBytes(depthCubemap[STARTING_LIGHT]) + (vsm ? cubemapBytes(momentCubemap[STARTING_LIGHT]) : 0);
+		printf("%-5s  %12.3f   %12.1f\n", vsm ? "vsm" : "pcf", total / 1.0e6 / frames, bytes / 1048576.0);
+	}
+	shadowCaching = caching;
+	vsmShadows = false;
+	glDeleteQueries(1, &timer);
+	mvStack.pop();
+}
+
+// CPU time to bin the clustered lights, and GPU time of the lit pass shading only each cluster's lights against shading
+// every light for every fragment, for 16 to RT3D_CLUSTER_MAX_LIGHTS unshadowed lights at 1920x1080, from the starting camera
+void benchmarkClusteredLights(int frames) {
+	const GLsizei width = 1920, height = 1080;
+	layeredShadows = atlasShadows = vsmShadows = false;
+	mvStack.push(glm::mat4(1.0));
+	camera();
+	glm::mat4 projection = glm::perspective(float(60.0f*DEG_TO_RADIAN), float(width) / height, CLUSTER_NEAR, CLUSTER_FAR);
+	updateSceneBlocks(projection, mvStack.top());
+
+	// the shadowed lights' maps, drawn once
+	invalidateShadowCache();
+	scheduleShadowFaces(projection * mvStack.top());
+	renderPointShadowMaps(projection);
+	currentShadowPass = { nullptr, 0, 0, nullptr };
+
+	GLuint fbo, renderbuffers[2], timer;
+	createBenchTarget(width, height, fbo, renderbuffers);
+	glGenQueries(1, &timer);
+	GLuint programs[2] = { rt3d::initShaders("pointShadows.vert", "pointShadows.frag"),
+		rt3d::initShaders("pointShadows.vert", "pointShadows.frag", nullptr, "#define CLUSTER_BRUTE_FORCE\n") };
+	for (int p = 0; p < 2; p++) {
+		md2model::setupShader(programs[p]);
+		resolveUniforms(programs[p]);
+	}
+
+	cout << "lights   bin ms   per cluster   dropped   clustered GPU ms   every light GPU ms" << endl;
+	for (GLuint count = 16; count <= RT3D_CLUSTER_MAX_LIGHTS; count *= 4) {
+		spawnClusterLights(count, 1);
+		std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+		for (int f = 0; f < frames; f++)
+			rt3d::binClusterLights(lightClusters, clusterLights.data(), count, mvStack.top(), projection);
+		double binMs = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count() / frames;
+		rt3d::uploadClusters(lightClusters, clusterLights.data());
+		double clustered = timeLitPass(programs[0], frames, timer, projection, mvStack.top());
+		double everyLight = timeLitPass(programs[1], frames, timer, projection, mvStack.top());
+		printf("%6u   %6.3f   %11.1f   %7u   %16.3f   %18.3f\n", count, binMs, lightClusters.listedLights / double(RT3D_CLUSTER_COUNT),
+			lightClusters.droppedLights, clustered, everyLight);
+	}
+
+	for (int p = 0; p < 2; p++)
+		glDeleteProgram(programs[p]);
+	glDeleteQueries(1, &timer);
+	deleteBenchTarget(fbo, renderbuffers);
+	clusterLights.clear();
+	mvStack.pop();
+}
+
+// GPU time of the scene objects' lit pass shaded forward against deferred, at 800x600 and 1920x1080, with only the
+// shadowed lights and then with CLUSTER_DEMO_LIGHTS and RT3D_CLUSTER_MAX_LIGHTS clustered ones, from the starting camera
+void benchmarkDeferred(int frames) {
+	const GLsizei widths[2] = { 800, 1920 }, heights[2] = { 600, 1080 };
+	const GLuint lightCounts[3] = { 0, CLUSTER_DEMO_LIGHTS, RT3D_CLUSTER_MAX_LIGHTS };
+	layeredShadows = atlasShadows = vsmShadows = false;
+	mvStack.push(glm::mat4(1.0));
+	camera();
+	glm::mat4 projection = glm::perspective(float(60.0f*DEG_TO_RADIAN), 800.0f / 600.0f, CLUSTER_NEAR, CLUSTER_FAR);
+	updateSceneBlocks(projection, mvStack.top());
+
+	// the shadowed lights' maps, drawn once
+	invalidateShadowCache();
+	scheduleShadowFaces(projection * mvStack.top());
+	renderPointShadowMaps(projection);
+	currentShadowPass = { nullptr, 0, 0, nullptr };
+
+	// the G-buffer goes with the target's size, so the window's is set aside meanwhile
+	GLuint windowGBufferFBO = gBufferFBO, windowGBufferTextures[3];
+	memcpy(windowGBufferTextures, gBufferTextures, sizeof(windowGBufferTextures));
+	GLuint timer;
+	glGenQueries(1, &timer);
+	cout << "resolution  lights   forward GPU ms   deferred GPU ms" << endl;
+	for (int r = 0; r < 2; r++) {
+		GLuint fbo, renderbuffers[2];
+		createGBuffer(gBufferFBO, gBufferTextures, widths[r], heights[r]);
+		createBenchTarget(widths[r], heights[r], fbo, renderbuffers);
+		projection = glm::perspective(float(60.0f*DEG_TO_RADIAN), float(widths[r]) / heights[r], CLUSTER_NEAR, CLUSTER_FAR);
+		updateSceneBlocks(projection, mvStack.top());
+		for (int l = 0; l < 3; l++) {
+			spawnClusterLights(lightCounts[l], 1);
+			rt3d::binClusterLights(lightClusters, clusterLights.data(), lightCounts[l], mvStack.top(), projection);
+			rt3d::uploadClusters(lightClusters, clusterLights.data());
+			deferredShading = false;
+			double forward = timeLitPass(shadowShaderProgram, frames, timer, projection, mvStack.top());
+			deferredShading = true;
+			double deferred = timeLitPass(shadowShaderProgram, frames, timer, projection, mvStack.top());
+			printf("%4dx%-4d   %6u   %14.3f   %15.3f\n", widths[r], heights[r], lightCounts[l], forward, deferred);
+		}
+		deleteBenchTarget(fbo, renderbuffers);
+		deleteGBuffer(gBufferFBO, gBufferTextures);
+	}
+	gBufferFBO = windowGBufferFBO;
+	memcpy(gBufferTextures, windowGBufferTextures, sizeof(gBufferTextures));
+
+	deferredShading = false;
+	clusterLights.clear();
+	glDeleteQueries(1, &timer);
+	mvStack.pop();
+}
+
+// GPU time of the whole forward main pass (sky, particles and pre-pass included) without and with the depth pre-pass,
+// and how many fragments per pixel of its opaque objects passed the depth test and were shaded, at 800x600 and
+// 1920x1080, from the starting camera
+void benchmarkDepthPrepass(int frames) {
+	const GLsizei widths[2] = { 800, 1920 }, heights[2] = { 600, 1080 };
+	layeredShadows = atlasShadows = vsmShadows = deferredShading = false;
+	mvStack.push(glm::mat4(1.0));
+	camera();
+	glm::mat4 projection = glm::perspective(float(60.0f*DEG_TO_RADIAN), 800.0f / 600.0f, 1.0f, 150.0f);
+	updateSceneBlocks(projection, mvStack.top());
+
+	// the shadow maps, drawn once
+	invalidateShadowCache();
+	scheduleShadowFaces(projection * mvStack.top());
+	renderPointShadowMaps(projection);
+	currentShadowPass = { nullptr, 0, 0, nullptr };
+
+	GLuint timer;
+	glGenQueries(1, &timer);
+	cout << "resolution  pre-pass   GPU ms/frame   depth passed/pixel   shaded/pixel" << endl;
+	for (int r = 0; r < 2; r++) {
+		GLuint fbo, renderbuffers[2];
+		createBenchTarget(widths[r], heights[r], fbo, renderbuffers);
+		projection = glm::perspective(float(60.0f*DEG_TO_RADIAN), float(widths[r]) / heights[r], 1.0f, 150.0f);
+		updateSceneBlocks(projection, mvStack.top());
+		for (int prepass = 0; prepass < 2; prepass++) {
+			depthPrepass = prepass != 0;
+			GLuint64 total = 0;
+			for (int f = 0; f < frames; f++) {
+				gatherOverdrawStats = f == frames - 1; // the counts don't change from frame to frame
+				glBeginQuery(GL_TIME_ELAPSED, timer);
+				glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+				RenderShadowScene(projection, mvStack.top(), litShadowProgram(), false, 0, ALL_CASTERS);
+				glEndQuery(GL_TIME_ELAPSED);
+				GLuint64 elapsed;
+				glGetQueryObjectui64v(timer, GL_QUERY_RESULT, &elapsed);
+				total += elapsed;
+			}
+			gatherOverdrawStats = false;
+			GLuint64 passed, shaded;
+			readOverdrawStats(passed, shaded);
+			const double pixels = double(widths[r]) * heights[r];
+			printf("%4dx%-4d   %-8s   %12.3f   %18.2f   ", widths[r], heights[r], depthPrepass ? "on" : "off", total / 1.0e6 / frames, passed / pixels);
+			if (pipelineStatisticsSupported)
+				printf("%12.2f\n", shaded / pixels);
+			else
+				printf("%12s\n", "n/a");
+		}
+		deleteBenchTarget(fbo, renderbuffers);
+	}
+	depthPrepass = false;
+	glDeleteQueries(1, &timer);
+	mvStack.pop();
+}
+
+// Draw calls, CPU time and GPU time per frame of 10 to 10000 cubes in a grid drawn one by one against instanced, depth
+// only into an 800x600 target, so what is measured is mostly the cost of submitting them
+void benchmarkInstancing(int frames) {
+	const GLuint counts[4] = { 10, 100, 1000, 10000 };
+	mvStack.push(glm::mat4(1.0));
+	camera();
+	glm::mat4 projection = glm::perspective(float(60.0f*DEG_TO_RADIAN), 800.0f / 600.0f, 1.0f, 150.0f);
+	updateSceneBlocks(projection, mvStack.top());
+
+	vector<glm::mat4> models(counts[3]);
+	for (GLuint i = 0; i < counts[3]; i++) {
+		models[i] = glm::translate(glm::mat4(1.0), glm::vec3(-50.0f + i % 100, 0.5f, -10.0f - float(i / 100)));
+		models[i] = glm::scale(models[i], glm::vec3(0.25f, 0.25f, 0.25f));
+	}
+	instanceBatch batch;
+	batch.buffer = rt3d::createInstanceBuffer(counts[3]);
+	GLuint fbo, renderbuffers[2];
+	createBenchTarget(800, 600, fbo, renderbuffers);
+	GLuint timer;
+	glGenQueries(1, &timer);
+	glUseProgram(depthPrepassProgram);
+	cout << "copies   instanced   draws/frame   CPU ms/frame   GPU ms/frame" << endl;
+	for (int c = 0; c < 4; c++) {
+		for (int instanced = 0; instanced < 2; instanced++) {
+			instanceDraws = instanced != 0;
+			double cpu = 0.0;
+			GLuint64 gpu = 0;
+			for (int f = 0; f < frames; f++) {
+				glClear(GL_DEPTH_BUFFER_BIT);
+				rt3d::resetDrawCalls();
+				glBeginQuery(GL_TIME_ELAPSED, timer);
+				std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+				drawInstances(depthPrepassProgram, meshObjects[0], meshIndexCount, models.data(), counts[c], batch,
+					meshData[0].boundsMin, meshData[0].boundsMax);
+				cpu += std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+				glEndQuery(GL_TIME_ELAPSED);
+				GLuint64 elapsed;
+				glGetQueryObjectui64v(timer, GL_QUERY_RESULT, &elapsed);
+				gpu += elapsed;
+			}
+			printf("%6u   %-9s   %11u   %12.3f   %12.3f\n", counts[c], instanceDraws ? "on" : "off", rt3d::getDrawCalls(),
+				cpu / frames, gpu / 1.0e6 / frames);
+		}
+	}
+
+	instanceDraws = true;
+	glDeleteBuffers(1, &batch.buffer);
+	glDeleteQueries(1, &timer);
+	deleteBenchTarget(fbo, renderbuffers);
+	mvStack.pop();
+}
+
+// Draw calls and GPU time of one light's shadow pass (every face, every caster) and of the forward main pass, with the
+// static objects drawn one by one and as the static batch, from the starting camera. What batching gives up is shown
+// alongside: the object faces the shadow pass's culling left for the geometry shader, and the instanced draws made.
+void benchmarkStaticBatch(int frames) {
+	const bool wasBatching = staticBatching, wasGathering = gatherShadowStats;
+	layeredShadows = atlasShadows = vsmShadows = deferredShading = false;
+	mvStack.push(glm::mat4(1.0));
+	camera();
+	glm::mat4 projection = glm::perspective(float(60.0f*DEG_TO_RADIAN), 800.0f / 600.0f, 1.0f, 150.0f);
+	updateSceneBlocks(projection, mvStack.top());
+	collectStaticObjects();
+
+	GLuint fbo, renderbuffers[2];
+	createBenchTarget(800, 600, fbo, renderbuffers);
+	GLuint timer;
+	glGenQueries(1, &timer);
+	const GLuint allFaces = 0x3F;
+	cout << "static objects   shadow pass draws   shadow pass faces   shadow pass GPU ms   main pass draws   instanced draws   main pass GPU ms" << endl;
+	for (int batched = 0; batched < 2; batched++) {
+		staticBatching = batched != 0;
+		GLuint draws[2], shadowFaces = 0, instanced = 0;
+		double ms[2];
+		for (int pass = 0; pass < 2; pass++) {
+			GLuint64 total = 0;
+			for (int f = 0; f < frames; f++) {
+				rt3d::resetDrawCalls();
+				instancedDraws = 0;
+				memset(&shadowStats, 0, sizeof(shadowStats));
+				gatherShadowStats = pass == 0;
+				glBeginQuery(GL_TIME_ELAPSED, timer);
+				if (pass == 0) {
+					glBindFramebuffer(GL_FRAMEBUFFER, depthMapFBO[STARTING_LIGHT]);
+					glViewport(0, 0, SHADOW_WIDTH, SHADOW_HEIGHT);
+					glClear(GL_DEPTH_BUFFER_BIT);
+					currentShadowPass = { &pointLightPositions[STARTING_LIGHT], STARTING_LIGHT, 1, &allFaces };
+					RenderShadowScene(projection, mvStack.top(), depthShaderProgram, true, STARTING_LIGHT, ALL_CASTERS);
+					currentShadowPass = { nullptr, 0, 0, nullptr };
+				}
+				else {
+					glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+					glViewport(0, 0, 800, 600);
+					glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+					RenderShadowScene(projection, mvStack.top(), litShadowProgram(), false, 0, ALL_CASTERS);
+				}
+				glEndQuery(GL_TIME_ELAPSED);
+				GLuint64 elapsed;
+				glGetQueryObjectui64v(timer, GL_QUERY_RESULT, &elapsed);
+				total += elapsed;
+				draws[pass] = rt3d::getDrawCalls();
+				if (pass == 0)
+					shadowFaces = shadowStats.faces[STARTING_LIGHT];
+				else
+					instanced = instancedDraws;
+			}
+			ms[pass] = total / 1.0e6 / frames;
+		}
+		printf("%-14s   %17u   %17u   %18.3f   %15u   %15u   %16.3f\n", staticBatching ? "batched" : "one by one", draws[0],
+			shadowFaces, ms[0], draws[1], instanced, ms[1]);
+	}
+
+	staticBatching = wasBatching;
+	gatherShadowStats = wasGathering;
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	glDeleteQueries(1, &timer);
+	deleteBenchTarget(fbo, renderbuffers);
+	mvStack.pop();
+}
+
+// Command line tools - these run without opening a window (except the GPU benchmarks -shadowbench to -batchbench, which need a GL context)
+// -objbench [file.obj] [runs] : time rt3d::loadObj; with no file, times bunny-5000.obj and a generated 2M triangle grid
+// -objscale [file.obj] [maxThreads] [runs] : triangles/s of the parallel loader against thread count
+// -bake file.obj [file.obj ...] : write the .rt3dmesh cache for each file, so assets can be shipped pre-baked (packed, as init loads them)
+// -md2bench [file.md2] : md2 keyframe blend throughput for 1, 100 and 10000 instances, with each blend kernel
+// -shadowbench [frames] : draw calls, triangles and frame time of per-light against layered shadow passes for 4, 8 and 16 lights
+// -pcfbench [frames] : GPU time of the lit pass with full and adaptive PCF and with VSM, at 800x600 and 1920x1080,
+//   and the time and memory of the shadow maps with and without VSM
+// -clusterbench [frames] : light binning time and lit pass GPU time for 16 to 1024 clustered lights, against shading every light
+// -deferredbench [frames] : lit pass GPU time shaded forward against deferred, at 800x600 and 1920x1080, for 0, 256 and 1024 clustered lights
+// -prepassbench [frames] : main pass GPU time and fragments passed and shaded per pixel, without and with the depth pre-pass
+// -instancebench [frames] : draw calls, CPU and GPU time of 10 to 10000 cubes drawn one by one against instanced
+// -batchbench [frames] : draw calls and GPU time of a shadow pass and the main pass, without and with static batching, with the
+//   shadow faces culling saved and the instanced draws made
+// Returns true if a tool was run and the program should exit
+bool commandLineTools(int argc, char *argv[]) {
+	if (argc < 2)
+		return false;
+	if (strcmp(argv[1], "-objbench") == 0) {
+		int runs = (argc > 3) ? atoi(argv[3]) : 5;
+		if (argc > 2)
+			rt3d::benchmarkObj(argv[2], runs, 1);
+		else {
+			rt3d::benchmarkObj("bunny-5000.obj", runs, 1);
+			rt3d::generateObj("bench-grid.obj", 1000);
+			rt3d::benchmarkObj("bench-grid.obj", runs, 1);
+		}
+		return true;
+	}
+	if (strcmp(argv[1], "-objscale") == 0) {
+		unsigned int maxThreads = (argc > 3) ? (unsigned int) atoi(argv[3]) : 0;
+		int runs = (argc > 4) ? atoi(argv[4]) : 3;
+		if (argc > 2)
+			rt3d::benchmarkObjScaling(argv[2], runs, maxThreads);
+		else {
+			rt3d::generateObj("bench-grid.obj", 1000);
+			rt3d::benchmarkObjScaling("bench-grid.obj", runs, maxThreads);
+		}
+		return true;
+	}
+	if (strcmp(argv[1], "-md2bench") == 0) {
+		md2model::BenchmarkAnimation(argc > 2 ? argv[2] : "tris.MD2");
+		return true;
+	}
+	if (strcmp(argv[1], "-shadowbench") == 0 || strcmp(argv[1], "-pcfbench") == 0 || strcmp(argv[1], "-clusterbench") == 0
+		|| strcmp(argv[1], "-deferredbench") == 0 || strcmp(argv[1], "-prepassbench") == 0 || strcmp(argv[1], "-instancebench") == 0
+		|| strcmp(argv[1], "-batchbench") == 0) {
+		SDL_GLContext context;
+		SDL_Window *window = setupRC(context);
+		glewExperimental = GL_TRUE;
+		if (glewInit() != GLEW_OK) {
+			cout << "glewInit failed, aborting." << endl;
+			return true;
+		}
+		init();
+		if (strcmp(argv[1], "-shadowbench") == 0)
+			benchmarkShadows(argc > 2 ? atoi(argv[2]) : 100);
+		else if (strcmp(argv[1], "-pcfbench") == 0)
+			benchmarkShadowFilter(argc > 2 ? atoi(argv[2]) : 100);
+		else if (strcmp(argv[1], "-clusterbench") == 0)
+			benchmarkClusteredLights(argc > 2 ? atoi(argv[2]) : 100);
+		else if (strcmp(argv[1], "-deferredbench") == 0)
+			benchmarkDeferred(argc > 2 ? atoi(argv[2]) : 100);
+		else if (strcmp(argv[1], "-prepassbench") == 0)
+			benchmarkDepthPrepass(argc > 2 ? atoi(argv[2]) : 100);
+		else if (strcmp(argv[1], "-instancebench") == 0)
+			benchmarkInstancing(argc > 2 ? atoi(argv[2]) : 100);
+		else
+			benchmarkStaticBatch(argc > 2 ? atoi(argv[2]) : 100);
+		SDL_GL_DeleteContext(context);
+		SDL_DestroyWindow(window);
+		SDL_Quit();
+		return true;
+	}
+	if (strcmp(argv[1], "-bake") == 0) {
+		for (int i = 2; i < argc; i++)
+			rt3d::bakeMesh(argv[i], rt3d::meshCacheName(argv[i]).c_str(), RT3D_FORMAT_PACKED);
+		return true;
+	}
+	return false;
+}
+
 // Program entry point - SDL manages the actual WinMain entry point for us
 int main(int argc, char *argv[]) {
+	if (commandLineTools(argc, argv))
+		return 0;
+
     SDL_Window * hWindow; // window handle
     SDL_GLContext glContext; // OpenGL context handle
     hWindow = setupRC(glContext); // Create window and render context 
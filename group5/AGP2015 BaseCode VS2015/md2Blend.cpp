@@ -0,0 +1,123 @@
+#include "md2Blend.h"
+
+#if defined(_M_X64) || defined(__x86_64__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2) || defined(__SSE2__)
+#define MD2_HAVE_SSE2
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define MD2_TARGET_AVX2
+#else
+#define MD2_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+// x * sa + y * sb + offset, evaluated in the same order by every kernel so results match exactly
+static void blendScalar(const unsigned char *a, const unsigned char *b, unsigned int count,
+	const float scaleA[4], const float scaleB[4], const float offset[4], float *out) {
+	for (unsigned int i = 0; i < count; i++, a += 4, b += 4, out += 4) {
+		for (int c = 0; c < 3; c++)
+			out[c] = (a[c] * scaleA[c] + b[c] * scaleB[c]) + offset[c];
+		out[3] = 0.0f;
+	}
+}
+
+#ifdef MD2_HAVE_SSE2
+
+// 4 vertices (16 bytes) per iteration: widen bytes to 32 bit ints, then to one float vector per vertex
+static void blendSSE2(const unsigned char *a, const unsigned char *b, unsigned int count,
+	const float scaleA[4], const float scaleB[4], const float offset[4], float *out) {
+	const __m128 sa = _mm_loadu_ps(scaleA);
+	const __m128 sb = _mm_loadu_ps(scaleB);
+	const __m128 off = _mm_loadu_ps(offset);
+	const __m128i zero = _mm_setzero_si128();
+	unsigned int i = 0;
+	for (; i + 4 <= count; i += 4, a += 16, b += 16, out += 16) {
+		__m128i va = _mm_loadu_si128((const __m128i *) a);
+		__m128i vb = _mm_loadu_si128((const __m128i *) b);
+		__m128i aLo = _mm_unpacklo_epi8(va, zero), aHi = _mm_unpackhi_epi8(va, zero);
+		__m128i bLo = _mm_unpacklo_epi8(vb, zero), bHi = _mm_unpackhi_epi8(vb, zero);
+		__m128i a32[4] = { _mm_unpacklo_epi16(aLo, zero), _mm_unpackhi_epi16(aLo, zero),
+			_mm_unpacklo_epi16(aHi, zero), _mm_unpackhi_epi16(aHi, zero) };
+		__m128i b32[4] = { _mm_unpacklo_epi16(bLo, zero), _mm_unpackhi_epi16(bLo, zero),
+			_mm_unpacklo_epi16(bHi, zero), _mm_unpackhi_epi16(bHi, zero) };
+		for (int v = 0; v < 4; v++) {
+			__m128 p = _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(a32[v]), sa), _mm_mul_ps(_mm_cvtepi32_ps(b32[v]), sb));
+			_mm_storeu_ps(out + v * 4, _mm_add_ps(p, off));
+		}
+	}
+	blendScalar(a, b, count - i, scaleA, scaleB, offset, out);
+}
+
+// 8 vertices per iteration, 2 vertices per 256 bit vector
+MD2_TARGET_AVX2 static void blendAVX2(const unsigned char *a, const unsigned char *b, unsigned int count,
+	const float scaleA[4], const float scaleB[4], const float offset[4], float *out) {
+	const __m256 sa = _mm256_setr_ps(scaleA[0], scaleA[1], scaleA[2], scaleA[3], scaleA[0], scaleA[1], scaleA[2], scaleA[3]);
+	const __m256 sb = _mm256_setr_ps(scaleB[0], scaleB[1], scaleB[2], scaleB[3], scaleB[0], scaleB[1], scaleB[2], scaleB[3]);
+	const __m256 off = _mm256_setr_ps(offset[0], offset[1], offset[2], offset[3], offset[0], offset[1], offset[2], offset[3]);
+	unsigned int i = 0;
+	for (; i + 8 <= count; i += 8, a += 32, b += 32, out += 32) {
+		for (int v = 0; v < 4; v++) {
+			__m256 fa = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *) (a + v * 8))));
+			__m256 fb = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *) (b + v * 8))));
+			__m256 p = _mm256_add_ps(_mm256_mul_ps(fa, sa), _mm256_mul_ps(fb, sb));
+			_mm256_storeu_ps(out + v * 8, _mm256_add_ps(p, off));
+		}
+	}
+	blendScalar(a, b, count - i, scaleA, scaleB, offset, out);
+}
+
+static bool cpuHasAVX2() {
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] < 7)
+		return false;
+	__cpuid(info, 1);
+	// AVX needs the OS to save the YMM registers too
+	if (!(info[2] & (1 << 27)) || !(info[2] & (1 << 28)) || (_xgetbv(0) & 6) != 6)
+		return false;
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1 << 5)) != 0;
+#else
+	return __builtin_cpu_supports("avx2") != 0;
+#endif
+}
+
+#endif
+
+typedef void (*blendKernel)(const unsigned char *, const unsigned char *, unsigned int,
+	const float *, const float *, const float *, float *);
+
+static blendKernel currentKernel = nullptr;
+
+int md2SetBlendKernel(int kernel) {
+	int best = MD2_BLEND_SCALAR;
+#ifdef MD2_HAVE_SSE2
+	best = cpuHasAVX2() ? MD2_BLEND_AVX2 : MD2_BLEND_SSE2;
+#endif
+	if (kernel < 0 || kernel > best)
+		kernel = best;
+	switch (kernel) {
+#ifdef MD2_HAVE_SSE2
+	case MD2_BLEND_AVX2: currentKernel = blendAVX2; break;
+	case MD2_BLEND_SSE2: currentKernel = blendSSE2; break;
+#endif
+	default: currentKernel = blendScalar;
+	}
+	return kernel;
+}
+
+const char* md2BlendKernelName(int kernel) {
+	switch (kernel) {
+	case MD2_BLEND_AVX2: return "AVX2";
+	case MD2_BLEND_SSE2: return "SSE2";
+	default: return "scalar";
+	}
+}
+
+void md2BlendFrames(const unsigned char *a, const unsigned char *b, unsigned int count,
+	const float scaleA[4], const float scaleB[4], const float offset[4], float *out) {
+	if (currentKernel == nullptr)
+		md2SetBlendKernel(MD2_BLEND_AUTO);
+	currentKernel(a, b, count, scaleA, scaleB, offset, out);
+}
@@ -0,0 +1,26 @@
+// md2Blend.h
+// Keyframe blend kernel for quantized MD2 frames
+//
+// a and b are count md2 vertices (x, y, z, normal index - one byte each) from two frames.
+// For each vertex, out gets 4 floats: a.xyz * scaleA + b.xyz * scaleB + offset, and 0.
+// With scaleA = (1 - t) * frame A's scale, scaleB = t * frame B's scale and offset the blended translate
+// that is the decoded, interpolated pose. The w lanes of scaleA/scaleB/offset must be 0.
+//
+// AVX2 or SSE2 is used when the CPU has it, scalar code otherwise - every kernel gives identical results.
+#ifndef MD2_BLEND
+#define MD2_BLEND
+
+#define MD2_BLEND_AUTO		-1
+#define MD2_BLEND_SCALAR	0
+#define MD2_BLEND_SSE2		1
+#define MD2_BLEND_AVX2		2
+
+void md2BlendFrames(const unsigned char *a, const unsigned char *b, unsigned int count,
+	const float scaleA[4], const float scaleB[4], const float offset[4], float *out);
+
+// Pick the kernel md2BlendFrames uses (for benchmarking). Asking for one the CPU can't run falls back
+// to the best one it can; returns the kernel actually selected
+int md2SetBlendKernel(int kernel);
+const char* md2BlendKernelName(int kernel);
+
+#endif
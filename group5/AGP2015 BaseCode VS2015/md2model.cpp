@@ -35,6 +35,14 @@
 
 #include "md2model.h"
 #include <vector>
+#include <unordered_map>
+#include <map>
+#include <string>
+#include <chrono>
+#include <algorithm>
+#include <iostream>
+#include "md2Blend.h"
+#include "rt3dUniforms.h"
 
 /* Table of precalculated normals */
 md2vec3 anorms_table[162] = {
@@ -65,30 +73,49 @@ static int animFrameList[40] = {
 	190, 196 //death3
 };
 
+md2FrameData::md2FrameData()
+{
+	numFrames = 0;
+	numVerts = 0;
+	framesBuffer = 0;
+	framesTexture = 0;
+	gpuMesh = 0;
+	keyframeIndexBuffer = 0;
+}
+
+md2FrameData::~md2FrameData()
+{
+	if (framesBuffer) {
+		glDeleteTextures(1, &framesTexture);
+		glDeleteBuffers(1, &framesBuffer);
+	}
+	if (gpuMesh) {
+		rt3d::deleteMesh(gpuMesh);
+		glDeleteBuffers(1, &keyframeIndexBuffer);
+	}
+}
+
 md2model::md2model()
 {
+	memset(&mdl, 0, sizeof(mdl));
+	md2Instance start = { 0, 0, 1, 0.0f, nullptr };
+	state = start;
+	gpuAnimated = false;
 	currentAnim = 0;
-	currentFrame = 0;
-	nextFrame = 1;
-	interp = 0.0f;
+	indexCount = 0;
+	vertDataSize = 0;
+	animVerts = nullptr;
+	meshVAO = 0;
 }
 
-md2model::md2model(const char *filename)
+md2model::md2model(const char *filename) : md2model()
 {
 	ReadMD2Model(filename);
-	currentAnim = 0;
-	currentFrame = 0;
-	nextFrame = 1;
-	interp = 0.0f;
 }
 
 md2model::~md2model()
 {
 	FreeModel();
-	int i;
-	for (i=0;i<mdl.header.num_frames;++i) {
-		delete [] vertData[i];
-	}
 	delete [] animVerts;
 }
 
@@ -99,6 +126,86 @@ md2model::~md2model()
 * big-endian machines, you'll have to perform proper conversions.
 */
 GLuint md2model::ReadMD2Model (const char *filename)
+{
+	return ReadMD2Model(filename, false);
+}
+
+GLuint md2model::ReadMD2Model (const char *filename, bool gpuAnimation)
+{
+	frames = LoadFrames(filename);
+	if (!frames)
+		return 0;
+
+	gpuAnimated = gpuAnimation;
+	vertDataSize = (GLuint) frames->uniqueVertex.size() * 3;
+	indexCount = (GLuint) frames->indices.size();
+	md2Instance start = { 0, 0, 1, 0.0f, nullptr };
+	state = start;
+
+	// the mesh starts out posed in frame 0
+	delete [] animVerts;
+	animVerts = new GLfloat[vertDataSize];
+	state.verts = animVerts;
+	AnimateBatch(*frames, &state, 1, 0.0f);
+
+	if (gpuAnimation) {
+		if (!frames->gpuMesh) {
+			// all frames go into a buffer texture; the vertex shader fetches each vertex's md2 vertex from the
+			// current and next frame by index, decodes them with the frame's scale/translate and blends
+			size_t gpuFrameBytes = frames->frameVerts.size() * sizeof(md2_vertex_t);
+			glGenBuffers(1, &frames->framesBuffer);
+			glBindBuffer(GL_TEXTURE_BUFFER, frames->framesBuffer);
+			glBufferData(GL_TEXTURE_BUFFER, gpuFrameBytes, frames->frameVerts.data(), GL_STATIC_DRAW);
+			glBindBuffer(GL_TEXTURE_BUFFER, 0);
+			glGenTextures(1, &frames->framesTexture);
+			glBindTexture(GL_TEXTURE_BUFFER, frames->framesTexture);
+			glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA8UI, frames->framesBuffer);
+			glBindTexture(GL_TEXTURE_BUFFER, 0);
+
+			// nothing about the mesh changes as it animates, so every GPU animated instance draws the same one
+			frames->gpuMesh = rt3d::createMesh(getVertDataCount(), animVerts, nullptr, frames->normals.data(), frames->texCoords.data(),
+				nullptr, indexCount, frames->indices.data(), RT3D_FORMAT_SHORT_INDEX);
+
+			// per mesh vertex md2 vertex index
+			glBindVertexArray(frames->gpuMesh);
+			glGenBuffers(1, &frames->keyframeIndexBuffer);
+			glBindBuffer(GL_ARRAY_BUFFER, frames->keyframeIndexBuffer);
+			glBufferData(GL_ARRAY_BUFFER, frames->uniqueVertex.size() * sizeof(GLushort), frames->uniqueVertex.data(), GL_STATIC_DRAW);
+			glVertexAttribIPointer(RT3D_KEYFRAME_INDEX, 1, GL_UNSIGNED_SHORT, 0, 0);
+			glEnableVertexAttribArray(RT3D_KEYFRAME_INDEX);
+			glBindVertexArray(0);
+			glBindBuffer(GL_ARRAY_BUFFER, 0);
+		}
+		meshVAO = frames->gpuMesh;
+
+		// the pose is never needed on the CPU
+		delete [] animVerts;
+		animVerts = nullptr;
+		state.verts = nullptr;
+	}
+	else {
+		meshVAO = rt3d::createMesh(getVertDataCount(), animVerts, nullptr, frames->normals.data(), frames->texCoords.data(),
+			nullptr, indexCount, frames->indices.data(), RT3D_FORMAT_SHORT_INDEX);
+	}
+
+	return meshVAO;
+}
+
+std::shared_ptr<md2FrameData> md2model::LoadFrames(const char *filename)
+{
+	// weak pointers, so frame data goes away with the last model using it
+	static std::map<std::string, std::weak_ptr<md2FrameData> > loadedFrames;
+	std::shared_ptr<md2FrameData> data = loadedFrames[filename].lock();
+	if (!data) {
+		md2model reader;
+		data = reader.ReadFrames(filename);
+		if (data)
+			loadedFrames[filename] = data;
+	}
+	return data;
+}
+
+std::shared_ptr<md2FrameData> md2model::ReadFrames(const char *filename)
 {
 	FILE *fp;
 	int i;
@@ -107,7 +214,7 @@ GLuint md2model::ReadMD2Model (const char *filename)
 	if (!fp)
 	{
 		fprintf (stderr, "Error: couldn't open \"%s\"!\n", filename);
-		return 0;
+		return nullptr;
 	}
 
 	/* Read header */
@@ -119,7 +226,7 @@ GLuint md2model::ReadMD2Model (const char *filename)
 		/* Error! */
 		fprintf (stderr, "Error: bad version or identifier\n");
 		fclose (fp);
-		return 0;
+		return nullptr;
 	}
 
 	/* Memory allocations */
@@ -177,82 +284,63 @@ GLuint md2model::ReadMD2Model (const char *filename)
 	struct md2_frame_t *pframe;
 	struct md2_vertex_t *pvert;
 
-	//std::vector<GLfloat> verts;
-	// these automatic variables will be created on stack and automatically deleted when this
-	// function ends - no need to delete
-	std::vector<GLfloat> tex_coords;
-	std::vector<GLfloat> norms;
-	std::vector<GLuint> indices;
+	std::shared_ptr<md2FrameData> data = std::make_shared<md2FrameData>();
 
 	pframe = &mdl.frames[0]; // first frame
-	// For each triangle 
-	// The bad news for MD2 is that we need to expand the triangles to get the data
-	// The number of tex coords need not match the number of vertices, and the number of normals
-	// is different again. So we need to calculate each vertex
-	// Is it possible to use indexing and remove duplicates though...
-	// But I'll not bother doing that for this aged format that I'm definately dumping next year
-	// (about 8 years overdue...! :-D )
+	// The number of tex coords need not match the number of vertices, so a mesh vertex is a unique
+	// (vertex, st) pair - normals come with the vertex. Each pair is only emitted once and triangles
+	// index them, so the post-transform cache can do its job and frames only hold the unique set
+	std::unordered_map<GLuint, GLushort> uniquePairs;
+	uniquePairs.reserve(mdl.header.num_tris * 3);
+	data->indices.reserve(mdl.header.num_tris * 3);
 	for (i = 0; i < mdl.header.num_tris; ++i)
 	{
 		// For each vertex 
 		for (j = 0; j < 3; ++j)
 		{
+			GLuint key = ((GLuint) mdl.triangles[i].vertex[j] << 16) | mdl.triangles[i].st[j];
+			std::unordered_map<GLuint, GLushort>::iterator found = uniquePairs.find(key);
+			if (found != uniquePairs.end()) {
+				data->indices.push_back(found->second);
+				continue;
+			}
+			GLushort index = (GLushort) data->uniqueVertex.size();
+			uniquePairs[key] = index;
+			data->indices.push_back(index);
+			data->uniqueVertex.push_back(mdl.triangles[i].vertex[j]);
+
 			// Get texture coordinates 
-			tex_coords.push_back( (GLfloat)mdl.texcoords[mdl.triangles[i].st[j]].s / mdl.header.skinwidth );
-			tex_coords.push_back( (GLfloat)mdl.texcoords[mdl.triangles[i].st[j]].t / mdl.header.skinheight );
+			data->texCoords.push_back( (GLfloat)mdl.texcoords[mdl.triangles[i].st[j]].s / mdl.header.skinwidth );
+			data->texCoords.push_back( (GLfloat)mdl.texcoords[mdl.triangles[i].st[j]].t / mdl.header.skinheight );
 
 			// get current vertex
 			pvert = &pframe->verts[mdl.triangles[i].vertex[j]];
 
 			// Get normals 
-			//norm = anorms_table[pvert->normalIndex][0];
-			norms.push_back(anorms_table[pvert->normalIndex][0]);
-			norms.push_back(anorms_table[pvert->normalIndex][1]);
-			norms.push_back(anorms_table[pvert->normalIndex][2]);
-
-			// Vertices 
-			// Doing these scaling operations *every* refresh is *very* wasteful
-			// Should do all the scaling calculations once only, when loading the file
-			//verts.push_back( pframe->scale[0] * pvert->v[0] + pframe->translate[0] );
-			//verts.push_back( pframe->scale[1] * pvert->v[1] + pframe->translate[1] );
-			//verts.push_back( pframe->scale[2] * pvert->v[2] + pframe->translate[2] );
-			
+			data->normals.push_back(anorms_table[pvert->normalIndex][0]);
+			data->normals.push_back(anorms_table[pvert->normalIndex][1]);
+			data->normals.push_back(anorms_table[pvert->normalIndex][2]);
 		}
 	}
-	// now repeat for each frame...
+
+	// Keep every frame in its quantized form: num_vertices md2_vertex_t (xyz + normal index, 4 bytes)
+	// plus a scale and translate per frame. Mesh vertices just index into the frame's vertices,
+	// rather than every frame being expanded out to num_tris * 9 floats
 	int k = 0;
-	GLfloat *verts;
-	vertDataSize = mdl.header.num_tris * 9;
-	for (k=0;k<mdl.header.num_frames;++k) {
-		verts = new GLfloat[vertDataSize];
-		pframe = &mdl.frames[k]; // first frame
-		for (i = 0; i < mdl.header.num_tris; ++i)
-		{
-			// For each vertex 
-			for (j = 0; j < 3; ++j)
-			{
-				// get current vertex
-				pvert = &pframe->verts[mdl.triangles[i].vertex[j]];
-				verts[(i*3 + j)*3] = GLfloat(pframe->scale[0] * pvert->v[0] + pframe->translate[0]);
-				verts[(i*3 + j)*3+1] = GLfloat(pframe->scale[1] * pvert->v[1] + pframe->translate[1]);
-				verts[(i*3 + j)*3+2] = GLfloat(pframe->scale[2] * pvert->v[2] + pframe->translate[2]);
-			}
-		}
-		vertData.push_back(verts);
+	data->numFrames = mdl.header.num_frames;
+	data->numVerts = mdl.header.num_vertices;
+	data->frameVerts.resize(data->numFrames * data->numVerts);
+	data->frameInfo.resize(data->numFrames);
+	for (k=0;k<data->numFrames;++k) {
+		memcpy(&data->frameVerts[k * data->numVerts], mdl.frames[k].verts, data->numVerts * sizeof(md2_vertex_t));
+		memcpy(data->frameInfo[k].scale, mdl.frames[k].scale, sizeof(md2vec3));
+		memcpy(data->frameInfo[k].translate, mdl.frames[k].translate, sizeof(md2vec3));
 	}
 
-	// initialise animVerts with frame 0 data
-	animVerts = new GLfloat[vertDataSize];
-	memcpy(animVerts,vertData[0],vertDataSize*sizeof(float));
-
-
-	GLuint VAO;
-	VAO = rt3d::createMesh(mdl.header.num_tris * 3,vertData[0],nullptr,norms.data(),tex_coords.data());
-	
 	// actually have all the data we need, so call FreeModel
 	this->FreeModel();
 
-	return VAO;
+	return data;
 }
 
 
@@ -310,33 +398,206 @@ void md2model::FreeModel ()
 * If interpolation is past 1.0, move current frame to next
 * and next frame = current frame + 1
 */
-
-void md2model::Animate (int animation, float dt)
+static void advanceAnimation(md2Instance &instance, float dt)
 {
-	int start = animFrameList[animation * 2];
-	int end =  animFrameList[animation * 2 + 1];
-	if ((currentFrame < start) || (currentFrame > end))
+	int start = animFrameList[instance.animation * 2];
+	int end =  animFrameList[instance.animation * 2 + 1];
+	if ((instance.currentFrame < start) || (instance.currentFrame > end))
 	{
-		currentFrame = start;
-		nextFrame = start + 1;
+		instance.currentFrame = start;
+		instance.nextFrame = start + 1;
 	}
-	interp += dt;
-	if (interp >= 1.0f)
+	instance.interp += dt;
+	if (instance.interp >= 1.0f)
 	{
 
 		// Move to next frame 
-		interp = 0.0f;
-		currentFrame = nextFrame;
-		nextFrame++;
+		instance.interp = 0.0f;
+		instance.currentFrame = instance.nextFrame;
+		instance.nextFrame++;
 
-		if (nextFrame >= end+1)
-			nextFrame = start;
+		if (instance.nextFrame >= end+1)
+			instance.nextFrame = start;
 	}
-	if (interp == 0.0f)
-		memcpy(animVerts,vertData[currentFrame],vertDataSize*sizeof(float));
-	else {
-		for (int i=0;i<vertDataSize;i++)
-			animVerts[i] = vertData[currentFrame][i] + interp*(vertData[nextFrame][i] - vertData[currentFrame][i]);
+}
+
+void md2model::Animate (int animation, float dt)
+{
+	// on the GPU path state.verts is null, so this only moves the frames on - see bindFrames
+	state.animation = animation;
+	AnimateBatch(*frames, &state, 1, dt);
+}
+
+/**
+* For each instance: move its animation on, then decode and blend its two frames' quantized
+* vertices (once per md2 vertex, with md2BlendFrames) and copy the pose out to its mesh vertices.
+* Frame decode and interpolation are folded together, so the kernel only does
+*   pose = a * (1-t)*scaleA + b * t*scaleB + ((1-t)*translateA + t*translateB)
+*/
+void md2model::AnimateBatch(const md2FrameData &frames, md2Instance *instances, int count, float dt)
+{
+	static std::vector<GLfloat> pose;	// xyz0 per md2 vertex, reused between calls
+	pose.resize(frames.numVerts * 4);
+	const unsigned char *frameBytes = (const unsigned char *) frames.frameVerts.data();
+	const GLushort *uniqueVertex = frames.uniqueVertex.data();
+	size_t uniqueCount = frames.uniqueVertex.size();
+
+	for (int n = 0; n < count; ++n) {
+		md2Instance &instance = instances[n];
+		advanceAnimation(instance, dt);
+		if (!instance.verts)
+			continue;
+
+		const md2FrameInfo &fa = frames.frameInfo[instance.currentFrame];
+		const md2FrameInfo &fb = frames.frameInfo[instance.nextFrame];
+		GLfloat t = instance.interp;
+		GLfloat scaleA[4], scaleB[4], offset[4];
+		for (int c = 0; c < 3; ++c) {
+			scaleA[c] = (1.0f - t) * fa.scale[c];
+			scaleB[c] = t * fb.scale[c];
+			offset[c] = (1.0f - t) * fa.translate[c] + t * fb.translate[c];
+		}
+		scaleA[3] = scaleB[3] = offset[3] = 0.0f;
+		md2BlendFrames(frameBytes + instance.currentFrame * frames.numVerts * 4, frameBytes + instance.nextFrame * frames.numVerts * 4,
+			frames.numVerts, scaleA, scaleB, offset, pose.data());
+
+		GLfloat *verts = instance.verts;
+		for (size_t i = 0; i < uniqueCount; ++i, verts += 3)
+			memcpy(verts, &pose[uniqueVertex[i] * 4], 3 * sizeof(GLfloat));
 	}
 }
 
+void md2model::BenchmarkAnimation(const char *filename)
+{
+	std::shared_ptr<md2FrameData> data = LoadFrames(filename);
+	if (!data) {
+		std::cout << "benchmark: nothing loaded from " << filename << std::endl;
+		return;
+	}
+	size_t vertFloats = data->uniqueVertex.size() * 3;
+	const int counts[3] = { 1, 100, 10000 };
+	std::cout << "benchmark " << filename << ": " << data->numVerts << " md2 vertices, " << vertFloats / 3
+		<< " mesh vertices, " << data->numFrames << " frames" << std::endl;
+
+	for (int kernel = MD2_BLEND_SCALAR; kernel <= MD2_BLEND_AVX2; ++kernel) {
+		if (md2SetBlendKernel(kernel) != kernel)
+			continue;	// not supported on this CPU
+		for (int c = 0; c < 3; ++c) {
+			int count = counts[c];
+			std::vector<GLfloat> verts(vertFloats * count);
+			std::vector<md2Instance> instances(count);
+			for (int n = 0; n < count; ++n) {
+				md2Instance instance = { n % 20, 0, 1, (n % 10) * 0.1f, &verts[vertFloats * n] };
+				instances[n] = instance;
+			}
+			// repeat batches for at least a quarter of a second
+			int batches = 0;
+			std::chrono::duration<double> elapsed(0);
+			std::chrono::high_resolution_clock::time_point startTime = std::chrono::high_resolution_clock::now();
+			while (elapsed.count() < 0.25) {
+				AnimateBatch(*data, instances.data(), count, 0.1f);
+				++batches;
+				elapsed = std::chrono::high_resolution_clock::now() - startTime;
+			}
+			double blended = (double) data->numVerts * 3 * count * batches;
+			std::cout << md2BlendKernelName(kernel) << ", " << count << " instances: " << elapsed.count() * 1000.0 / batches
+				<< " ms per batch, " << blended / elapsed.count() / 1e6 << " M floats blended/s" << std::endl;
+		}
+	}
+	md2SetBlendKernel(MD2_BLEND_AUTO);
+}
+
+// handles of the keyframe uniforms, resolved the first time each shader is used (and again by setupShader,
+// as a deleted program's id can be handed out again)
+struct md2ShaderUniforms {
+	GLuint shader;
+	rt3d::uniformHandle keyframed, frameData, frameStart, frameScale, frameTranslate, interp;
+};
+static std::vector<md2ShaderUniforms> shaders;
+
+static const md2ShaderUniforms& resolveShaderUniforms(GLuint shader)
+{
+	size_t i = 0;
+	while (i < shaders.size() && shaders[i].shader != shader)
+		i++;
+	if (i == shaders.size())
+		shaders.push_back(md2ShaderUniforms());
+	md2ShaderUniforms &u = shaders[i];
+	u.shader = shader;
+	u.keyframed = rt3d::uniform(shader, "keyframed");
+	u.frameData = rt3d::uniform(shader, "frameData");
+	u.frameStart = rt3d::uniform(shader, "frameStart");
+	u.frameScale = rt3d::uniform(shader, "frameScale");
+	u.frameTranslate = rt3d::uniform(shader, "frameTranslate");
+	u.interp = rt3d::uniform(shader, "interp");
+	return u;
+}
+
+static const md2ShaderUniforms& shaderUniforms(GLuint shader)
+{
+	for (size_t i = 0; i < shaders.size(); i++)
+		if (shaders[i].shader == shader)
+			return shaders[i];
+	return resolveShaderUniforms(shader);
+}
+
+/**
+* Set up the shader to draw the current pose. Only needed for models read with gpuAnimation:
+* a handful of uniforms instead of decoding, blending and uploading every vertex.
+* Call unbindFrames after drawing, as the shaders are shared with meshes that aren't keyframed.
+*/
+void md2model::bindFrames(GLuint shader)
+{
+	if (!gpuAnimated)
+		return;
+	GLuint numVerts = frames->numVerts;
+	GLint frameStart[2] = { (GLint) (state.currentFrame * numVerts), (GLint) (state.nextFrame * numVerts) };
+	GLfloat scale[6], translate[6];
+	memcpy(scale, frames->frameInfo[state.currentFrame].scale, sizeof(md2vec3));
+	memcpy(scale + 3, frames->frameInfo[state.nextFrame].scale, sizeof(md2vec3));
+	memcpy(translate, frames->frameInfo[state.currentFrame].translate, sizeof(md2vec3));
+	memcpy(translate + 3, frames->frameInfo[state.nextFrame].translate, sizeof(md2vec3));
+
+	glActiveTexture(GL_TEXTURE0 + MD2_FRAME_TEXTURE_UNIT);
+	glBindTexture(GL_TEXTURE_BUFFER, frames->framesTexture);
+	glActiveTexture(GL_TEXTURE0);
+	const md2ShaderUniforms &u = shaderUniforms(shader);
+	rt3d::setUniform1i(u.keyframed, 1);
+	rt3d::setUniform1iv(u.frameStart, 2, frameStart);
+	rt3d::setUniform3fv(u.frameScale, 2, scale);
+	rt3d::setUniform3fv(u.frameTranslate, 2, translate);
+	rt3d::setUniform1f(u.interp, state.interp);
+}
+
+void md2model::unbindFrames(GLuint shader)
+{
+	if (gpuAnimated)
+		rt3d::setUniform1i(shaderUniforms(shader).keyframed, 0);
+}
+
+/**
+* Bounds of the current pose, without decoding it: the union of the boxes the two blended frames are
+* quantized into (a frame spans translate to translate + 255 * scale)
+*/
+void md2model::getBounds(GLfloat boundsMin[3], GLfloat boundsMax[3])
+{
+	const md2FrameInfo &a = frames->frameInfo[state.currentFrame];
+	const md2FrameInfo &b = frames->frameInfo[state.nextFrame];
+	for (int i = 0; i < 3; i++) {
+		boundsMin[i] = std::min(std::min(a.translate[i], a.translate[i] + 255.0f * a.scale[i]),
+			std::min(b.translate[i], b.translate[i] + 255.0f * b.scale[i]));
+		boundsMax[i] = std::max(std::max(a.translate[i], a.translate[i] + 255.0f * a.scale[i]),
+			std::max(b.translate[i], b.translate[i] + 255.0f * b.scale[i]));
+	}
+}
+
+/**
+* Point a shader's frameData sampler at MD2_FRAME_TEXTURE_UNIT. Needed once for each shader that can draw
+* GPU animated models - left on unit 0 it would clash with the 2D sampler there, even when not drawing md2s
+*/
+void md2model::setupShader(GLuint shader)
+{
+	glUseProgram(shader);
+	rt3d::setUniform1i(resolveShaderUniforms(shader).frameData, MD2_FRAME_TEXTURE_UNIT);
+	glUseProgram(0);
+}
@@ -43,6 +43,7 @@
 #include <glm/gtc/type_ptr.hpp>
 #include "rt3d.h"
 #include <vector>
+#include <memory>
 
 // Animation List
 // This contains the standard list of MD2 animations
@@ -70,6 +71,9 @@
 #define MD2_DEATH2	18
 #define MD2_DEATH3	19
 
+// texture unit the GPU animation path binds its frame data to - clear of the units the scene uses
+#define MD2_FRAME_TEXTURE_UNIT	15
+
 
 typedef GLfloat md2vec3[3];
 
@@ -135,6 +139,13 @@ struct md2_frame_t
   struct md2_vertex_t *verts;
 };
 
+/* Per frame decoding: position = scale * v + translate */
+struct md2FrameInfo
+{
+  md2vec3 scale;
+  md2vec3 translate;
+};
+
 /* GL command packet */
 struct md2_glcmd_t
 {
@@ -160,6 +171,38 @@ struct md2_model_t
 /*** An MD2 model ***/
 //struct md2_model_t md2file;
 
+// Everything from an md2 file that doesn't change as it animates. Loaded once per file and shared
+// by every md2model reading that file, see md2model::LoadFrames
+struct md2FrameData
+{
+	int numFrames;
+	GLuint numVerts;						// md2 vertices per frame
+	std::vector<md2_vertex_t> frameVerts;	// quantized vertices of every frame, numFrames * numVerts
+	std::vector<md2FrameInfo> frameInfo;	// how to decode each frame
+	std::vector<GLushort> uniqueVertex;		// md2 vertex used by each unique (vertex, st) mesh vertex
+	std::vector<GLfloat> texCoords;			// per mesh vertex
+	std::vector<GLfloat> normals;
+	std::vector<GLuint> indices;
+	// GPU animation: frameVerts in a buffer texture and one mesh every instance draws.
+	// Created by the first model read with gpuAnimation
+	GLuint framesBuffer;
+	GLuint framesTexture;
+	GLuint gpuMesh;
+	GLuint keyframeIndexBuffer;				// gpuMesh's RT3D_KEYFRAME_INDEX attribute, which rt3d doesn't know about
+	md2FrameData();
+	~md2FrameData();
+};
+
+// Animation state of one copy of a model, for md2model::AnimateBatch
+struct md2Instance
+{
+	int animation;
+	int currentFrame;
+	int nextFrame;
+	float interp;
+	GLfloat *verts;		// receives the pose, uniqueVertex.size() * 3 floats - nullptr to only advance the animation
+};
+
 // md2model class
 class md2model
 {
@@ -168,22 +211,40 @@ public:
 	md2model(const char *filename);
 	~md2model();
 	GLuint ReadMD2Model(const char *filename);
+	// gpuAnimation keeps every frame in GPU memory and blends frames in the vertex shader (see bindFrames)
+	GLuint ReadMD2Model(const char *filename, bool gpuAnimation);
 	void FreeModel();
 	void Animate(int animation, float dt);
 	void Animate(float dt) { Animate(currentAnim, dt); }
 	int setCurrentAnim(int n);
+	void bindFrames(GLuint shader);
+	void unbindFrames(GLuint shader);
+	static void setupShader(GLuint shader);
+	// Conservative model space bounds of the current pose
+	void getBounds(GLfloat boundsMin[3], GLfloat boundsMax[3]);
+
+	// Frame data for filename, read from the file only if no other model is using it
+	static std::shared_ptr<md2FrameData> LoadFrames(const char *filename);
+	// Advance count instances by dt, each in its own animation, and decode their poses
+	static void AnimateBatch(const md2FrameData &frames, md2Instance *instances, int count, float dt);
+	// Blend throughput for 1, 100 and 10000 instances of filename, with each blend kernel the CPU supports
+	static void BenchmarkAnimation(const char *filename);
 private:
+	std::shared_ptr<md2FrameData> ReadFrames(const char *filename);
 	md2_model_t mdl;
+	std::shared_ptr<md2FrameData> frames;
+	md2Instance state;
+	bool gpuAnimated;
 	int currentAnim;
-	int currentFrame;
-	int nextFrame;
-	float interp;
-	std::vector<GLfloat *> vertData;
+	GLuint indexCount;
 	GLuint vertDataSize;
-	GLfloat *animVerts;
+	GLfloat *animVerts;						// current pose of the mesh vertices, for upload
+	GLuint meshVAO;
 public:
 	GLfloat* getAnimVerts() { return animVerts; }
 	GLuint getVertDataSize() { return vertDataSize; }
 	GLuint getVertDataCount() { return vertDataSize/3; }
+	GLuint getIndexCount() { return indexCount; }
 	int getCurrentAnim() {return currentAnim;}
-};
\ No newline at end of file
+	const std::shared_ptr<md2FrameData>& getFrames() { return frames; }
+};
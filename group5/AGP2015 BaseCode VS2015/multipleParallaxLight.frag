@@ -1,4 +1,7 @@
 #version 330 core
+#ifdef LAYERED
+#extension GL_ARB_texture_cube_map_array : require
+#endif
 
 // Authors : Matteo Marcuzzo, Meshal Marakkar
 
@@ -9,20 +12,20 @@ struct Material {
 }; 
 
 
+// std140: each vec3 shares its 16 bytes with the float after it
 struct PointLight {
     vec3 position;
-    
     float constant;
-    float linear;
-    float quadratic;
-	
     vec3 ambient;
+    float linear;
     vec3 diffuse;
+    float quadratic;
     vec3 specular;
 };
 
-uniform int numShotsFired;
+#ifndef NR_POINT_LIGHTS
 #define NR_POINT_LIGHTS 4
+#endif
 float heightScale = 0.1f; //control extent of occlusion
 
 in vec3 FragPos;
@@ -41,8 +44,26 @@ vec2 texStep;
 
 layout(location = 0) out vec4 out_Color;
 
-uniform vec3 viewPos;
-uniform PointLight pointLights[NR_POINT_LIGHTS];
+// binding 0: the camera, shared by every scene program
+layout(std140) uniform Camera {
+    mat4 projection;
+    mat4 view;
+    vec3 viewPos;
+};
+
+// binding 1: every light, written once per frame
+layout(std140) uniform Lights {
+    PointLight pointLights[NR_POINT_LIGHTS];
+};
+
+// binding 2: per-frame constants
+layout(std140) uniform Frame {
+    float far_plane;
+    int numShotsFired;
+    float clusterNear;          // view depth the first cluster slice starts at
+    float clusterSliceScale;    // slices per unit of log depth
+};
+
 uniform Material material;
 
 uniform sampler2D diffuseMap;
@@ -50,46 +71,164 @@ uniform sampler2D heightMap;
 uniform sampler2D normalMap;
 uniform bool parallax;
 
-uniform float far_plane;
-
+// LAYERED shadows are all in one cubemap array, a layer per light, instead of a cubemap each
+#ifdef LAYERED
+uniform samplerCubeArrayShadow depthMaps;
+#define SHADOW_CUBE int
+#define depthCube(i) i
+#define shadowLit(cube, dir, depth) texture(depthMaps, vec4(dir, cube), depth)
+#elif defined(ATLAS)
+// ATLAS shadows are tiles of one 2D depth texture, a tile per light per cube face
+uniform sampler2DShadow shadowAtlas;
+uniform vec4 atlasTiles[6 * NR_POINT_LIGHTS]; // x, y, width and height of each face's tile, as atlas texture coordinates
+#define SHADOW_CUBE int
+#define depthCube(i) i
+#define shadowLit(cube, dir, depth) atlasLit(cube, dir, depth)
+
+// compare depth against light's shadows in direction dir - face and position in it are picked the way a cubemap lookup does it
+float atlasLit(int light, vec3 dir, float depth)
+{
+    vec3 a = abs(dir);
+    int face;
+    vec2 st;
+    if (a.x >= a.y && a.x >= a.z) {
+        face = dir.x > 0.0 ? 0 : 1;
+        st = vec2(dir.x > 0.0 ? -dir.z : dir.z, -dir.y) / a.x;
+    } else if (a.y >= a.z) {
+        face = dir.y > 0.0 ? 2 : 3;
+        st = vec2(dir.x, dir.y > 0.0 ? dir.z : -dir.z) / a.y;
+    } else {
+        face = dir.z > 0.0 ? 4 : 5;
+        st = vec2(dir.z > 0.0 ? dir.x : -dir.x, -dir.y) / a.z;
+    }
+    vec4 tile = atlasTiles[light * 6 + face];
+    // keep half a texel inside the tile, so the neighbouring tiles never get sampled
+    vec2 halfTexel = 0.5 / vec2(textureSize(shadowAtlas, 0));
+    vec2 uv = clamp(tile.xy + (st * 0.5 + 0.5) * tile.zw, tile.xy + halfTexel, tile.xy + tile.zw - halfTexel);
+    return texture(shadowAtlas, vec3(uv, depth));
+}
+#elif defined(VSM)
+// VSM shadows are a cubemap per light of the first two moments of depth, mipmapped, read with plain filtering
 uniform samplerCube depthMap[NR_POINT_LIGHTS];
-
+#define SHADOW_CUBE samplerCube
+#define depthCube(i) depthMap[i]
+#else
+uniform samplerCubeShadow depthMap[NR_POINT_LIGHTS];
+#define SHADOW_CUBE samplerCubeShadow
+#define depthCube(i) depthMap[i]
+#define shadowLit(cube, dir, depth) texture(cube, vec4(dir, depth))
+#endif
+
+#ifdef VSM
+#ifndef VSM_MIN_VARIANCE
+#define VSM_MIN_VARIANCE 0.00002 // half float moments lose the variance of a flat, lit surface
+#endif
+#ifndef VSM_BLEED_REDUCTION
+#define VSM_BLEED_REDUCTION 0.3 // share of the lit bound cut off, against light bleeding where shadows overlap
+#endif
+
+float ShadowCalculation(vec3 fragPos, vec3 lightPosition, SHADOW_CUBE shadowCube)
+{
+    vec3 fragToLight = fragPos - lightPosition;
+    float lightDistance = length(fragToLight);
+    float bias = 0.15;
+    float currentDepth = (lightDistance - bias) / far_plane;
+	float viewDistance = length(viewPos - fragPos);
+	float diskRadius = (1.0 + (viewDistance / far_plane)) / 25.0;
+	//One fetch, from the mip level whose texels are as wide as the PCF kernel would be: a face is 2 units
+	//across at distance 1, so the kernel covers diskRadius / lightDistance of its width in texels
+	float kernelTexels = diskRadius / lightDistance * float(textureSize(shadowCube, 0).x);
+	vec2 moments = textureLod(shadowCube, fragToLight, log2(max(kernelTexels, 1.0))).rg;
+	if(currentDepth <= moments.x)
+		return 0.0;
+	//Chebyshev's inequality bounds how much of the filtered area is nearer the light than this fragment
+	float variance = max(moments.y - moments.x * moments.x, VSM_MIN_VARIANCE);
+	float d = currentDepth - moments.x;
+	float lit = variance / (variance + d * d);
+	lit = clamp((lit - VSM_BLEED_REDUCTION) / (1.0 - VSM_BLEED_REDUCTION), 0.0, 1.0);
+	return 1.0 - lit;
+}
+#else
+// PCF taps, the first PCF_PROBE_SAMPLES of them spread as a tetrahedron
 vec3 sampleOffsetDirections[20] = vec3[]
 (
-   vec3( 1,  1,  1), vec3( 1, -1,  1), vec3(-1, -1,  1), vec3(-1,  1,  1), 
-   vec3( 1,  1, -1), vec3( 1, -1, -1), vec3(-1, -1, -1), vec3(-1,  1, -1),
+   vec3( 1,  1,  1), vec3( 1, -1, -1), vec3(-1,  1, -1), vec3(-1, -1,  1),
+   vec3( 1, -1,  1), vec3(-1,  1,  1), vec3( 1,  1, -1), vec3(-1, -1, -1),
    vec3( 1,  1,  0), vec3( 1, -1,  0), vec3(-1, -1,  0), vec3(-1,  1,  0),
    vec3( 1,  0,  1), vec3(-1,  0,  1), vec3( 1,  0, -1), vec3(-1,  0, -1),
    vec3( 0,  1,  1), vec3( 0, -1,  1), vec3( 0, -1, -1), vec3( 0,  1, -1)
-);   
+);
+#define PCF_SAMPLES 20
+#ifndef PCF_PROBE_SAMPLES
+#define PCF_PROBE_SAMPLES 4 // PCF_SAMPLES always takes the whole kernel
+#endif
 
-float ShadowCalculation(vec3 fragPos, vec3 lightPosition, samplerCube shadowCube)
+float ShadowCalculation(vec3 fragPos, vec3 lightPosition, SHADOW_CUBE shadowCube)
 {
-
     // Get vector between fragment position and light position
     vec3 fragToLight = fragPos - lightPosition;
-    // Use the light to fragment vector to sample from the depth map    
-    float closestDepth = texture(shadowCube, fragToLight).r;
-    // It is currently in linear range between [0,1]. Re-transform back to original value
-    closestDepth *= far_plane;
-    // Now get current linear depth as the length between the fragment and light position
-    float currentDepth = length(fragToLight);
-    // Now test for shadows
-    float shadow = 0.0;
-	float bias = 0.15;
-	int samples = 20;
+    // Current linear depth less the bias, mapped to the [0,1] range the depth map holds
+    float bias = 0.15;
+    float currentDepth = (length(fragToLight) - bias) / far_plane;
 	float viewDistance = length(viewPos - fragPos);
-	float diskRadius = (1.0 + (viewDistance / far_plane)) / 25.0;  
-	for(int i = 0; i < samples; ++i)
-	{
-		float closestDepth = texture(shadowCube, fragToLight + sampleOffsetDirections[i] * diskRadius).r;
-		closestDepth *= far_plane;   // Undo mapping [0;1]
-		if(currentDepth - bias > closestDepth)
-			shadow += 1.0;
-	}
-	shadow /= float(samples);  
+	float diskRadius = (1.0 + (viewDistance / far_plane)) / 25.0;
+	//apply PCF to soften shadows; diskRadius increases the offset radius by the distance to the viewer
+	//Each tap is a hardware depth comparison with bilinear filtering, so it gives how much of that spot is lit.
+	//If the probe taps all agree, the fragment is fully lit or fully in shadow and that's the answer;
+	//only fragments in a penumbra take the rest of the kernel
+	float lit = 0.0;
+	for(int i = 0; i < PCF_PROBE_SAMPLES; ++i)
+		lit += shadowLit(shadowCube, fragToLight + sampleOffsetDirections[i] * diskRadius, currentDepth);
+	if(lit == 0.0 || lit == float(PCF_PROBE_SAMPLES))
+		return 1.0 - lit / float(PCF_PROBE_SAMPLES);
+	for(int i = PCF_PROBE_SAMPLES; i < PCF_SAMPLES; ++i)
+		lit += shadowLit(shadowCube, fragToLight + sampleOffsetDirections[i] * diskRadius, currentDepth);
+	return 1.0 - lit / float(PCF_SAMPLES);
+}
+#endif
+
+// Unshadowed lights on top of the shadowed ones, culled per cluster of the view frustum on the CPU (see rt3dLightClusters.h)
+#ifndef CLUSTERS_X
+#define CLUSTERS_X 16
+#define CLUSTERS_Y 9
+#define CLUSTERS_Z 24
+#endif
+uniform samplerBuffer clusterLights;	// two texels per light: position and radius, then colour
+uniform usamplerBuffer clusterLists;	// offset and count per cluster, then the light indices they point into
+uniform int clusterLightCount;			// every light - CLUSTER_BRUTE_FORCE shades them all, for comparison
+
+// where in clusterLists the lights reaching fragPos's cluster are listed, and how many there are
+uvec2 clusterLightRange(vec3 fragPos)
+{
+#ifdef CLUSTER_BRUTE_FORCE
+	return uvec2(0u, uint(clusterLightCount));
+#else
+	vec4 viewPosition = view * vec4(fragPos, 1.0);
+	vec4 clip = projection * viewPosition;
+	ivec2 tile = clamp(ivec2((clip.xy / clip.w * 0.5 + 0.5) * vec2(CLUSTERS_X, CLUSTERS_Y)), ivec2(0), ivec2(CLUSTERS_X - 1, CLUSTERS_Y - 1));
+	int slice = int(log(max(-viewPosition.z, clusterNear) / clusterNear) * clusterSliceScale);
+	if (slice >= CLUSTERS_Z)
+		return uvec2(0u);
+	int cluster = (slice * CLUSTERS_Y + tile.y) * CLUSTERS_X + tile.x;
+	return uvec2(texelFetch(clusterLists, 2 * cluster).r, texelFetch(clusterLists, 2 * cluster + 1).r);
+#endif
+}
+
+// the light at position n of the range
+int clusterLightIndex(uint n)
+{
+#ifdef CLUSTER_BRUTE_FORCE
+	return int(n);
+#else
+	return int(texelFetch(clusterLists, int(n)).r);
+#endif
+}
 
-    return shadow;
+// falls smoothly to nothing at the light's radius
+float clusterAttenuation(float distance, float radius)
+{
+	float falloff = clamp(1.0 - pow(distance / radius, 4.0), 0.0, 1.0);
+	return falloff * falloff / (1.0 + distance * distance);
 }
 
 // Function prototypes
@@ -127,9 +266,23 @@ void main()
 	// get self-shadowing factor for elements of parallax
     float shadowMultiplier = parallaxSoftShadowMultiplier(toLightInTangentSpace, newTexCoords, parallaxHeight - 0.05);
 
-		shadow = ShadowCalculation(FragPos, pointLights[i].position, depthMap[i]);
+		shadow = ShadowCalculation(FragPos, pointLights[i].position, depthCube(i));
         result += CalcPointLight(pointLights[i], normal, FragPos, viewDir, colour, newTexCoords, shadow, shadowMultiplier);    
 	}
+	// then the unshadowed lights listed for this fragment's cluster - diffuse only, in tangent space like the normal
+	uvec2 range = clusterLightRange(FragPos);
+	for(uint n = range.x; n < range.x + range.y; n++){
+		int light = clusterLightIndex(n);
+		vec4 positionRadius = texelFetch(clusterLights, 2 * light);
+		vec3 toLight = positionRadius.xyz - FragPos;
+		float distance = length(toLight);
+		if(distance >= positionRadius.w)
+			continue;
+		vec3 lightDir = toLight / distance;
+		vec3 tangentLightDir = vec3(dot(lightDir, worldTangent), dot(lightDir, bitangent), dot(lightDir, worldNormal));
+		float diff = max(dot(normal, tangentLightDir), 0.0);
+		result += texelFetch(clusterLights, 2 * light + 1).rgb * clusterAttenuation(distance, positionRadius.w) * diff * colour;
+	}
 
     out_Color = vec4(result, 1.0);
 }
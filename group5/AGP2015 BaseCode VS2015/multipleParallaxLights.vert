@@ -16,10 +16,16 @@ out vec3 worldNormal;
 out vec3 worldTangent;
 out vec3 bitangent;
 
-uniform mat4 projection;
-uniform mat4 view;
+// binding 0: the camera, shared by every scene program
+layout(std140) uniform Camera {
+    mat4 projection;
+    mat4 view;
+    vec3 viewPos;
+};
+
 uniform mat4 model;
-uniform vec3 cameraPos;
+
+invariant gl_Position; // the same depth as the depth pre-pass computes, for the equal depth test after it
 
 out mat3 TBN;
 
@@ -40,6 +46,6 @@ void main()
 	vec3 B = normalize(mat3(model) * Bitangent);
 
     TBN = transpose(mat3(T, B, N));
-	tangentViewPos  = TBN * cameraPos;
+	tangentViewPos  = TBN * viewPos;
     tangentFragPos  = TBN * FragPos;
 } 
\ No newline at end of file
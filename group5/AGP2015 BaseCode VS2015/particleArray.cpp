@@ -29,16 +29,17 @@ particleArray::particleArray(const int n) : numParticles( n ) //intialisation of
 	// Initialise VAO and VBO in constructor, after initialising
 	// the arrays:
 	glGenVertexArrays(1,vao);//Important, we cannot do this, before generating the SDL context
-	glGenBuffers(2, vbo1);
+	glGenBuffers(1, vbo1);
 	glBindVertexArray(vao[0]); // bind VAO 0 as current object
-	// Position data in attribute index 0, 3 floats per vertex
-	glBindBuffer(GL_ARRAY_BUFFER, vbo1[0]); // bind VBO for positions
-	glBufferData(GL_ARRAY_BUFFER, numParticles * 3 *sizeof(GLfloat), positions, GL_DYNAMIC_DRAW);
-	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, 0);
+	// Position data in attribute index 0, 3 floats per vertex - room for a few frames' worth in the stream
+	rt3d::createStreamBuffer(positionStream, numParticles * 3 * sizeof(GLfloat));
+	GLuint offset = rt3d::streamData(positionStream, positions, numParticles * 3 * sizeof(GLfloat));
+	glBindBuffer(GL_ARRAY_BUFFER, positionStream.buffer);
+	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, (const GLvoid *) (size_t) offset);
 
 	glEnableVertexAttribArray(0); // Enable attribute index 0
 	// Colours data in attribute 1, 3 floats per vertex
-	glBindBuffer(GL_ARRAY_BUFFER, vbo1[1]); // bind VBO for colours
+	glBindBuffer(GL_ARRAY_BUFFER, vbo1[0]); // bind VBO for colours
 	glBufferData(GL_ARRAY_BUFFER, numParticles * 3 * sizeof(GLfloat), colours, GL_STATIC_DRAW);
 	glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 0, 0);
 	glEnableVertexAttribArray(1); // Enable attribute index 3
@@ -54,19 +55,21 @@ particleArray::~particleArray(void)
 	delete vel;
 	delete fade;
 	delete life;
+	rt3d::deleteStreamBuffer(positionStream);
 }
 
 void particleArray::draw(void) {
-	glBindVertexArray(vao[0]); // bind VAO 0 as current object
 	// particle data may have been updated - so need to resend to GPU (at the beginning, only positions, not colours, nor velocities)
-	glBindBuffer(GL_ARRAY_BUFFER, vbo1[0]); // bind VBO 0
-	glBufferData(GL_ARRAY_BUFFER, numParticles * 3 *sizeof(GLfloat), positions, GL_DYNAMIC_DRAW);// Position data in attribute index 0, 3 floats per vertex
-	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, 0);
-	glEnableVertexAttribArray(0); // Enable attribute index 0
+	GLuint offset = rt3d::streamData(positionStream, positions, numParticles * 3 * sizeof(GLfloat));
+	glBindVertexArray(vao[0]); // bind VAO 0 as current object
+	glBindBuffer(GL_ARRAY_BUFFER, positionStream.buffer);
+	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, (const GLvoid *) (size_t) offset);// Position data in attribute index 0, 3 floats per vertex
 
 	// Now draw the particles... as easy as this!
 	glDrawArrays(GL_POINTS, 0, numParticles );
 	glBindVertexArray(0);
+	// this region can't be rewritten until the draw above has finished with it
+	rt3d::endStreamFrame(positionStream);
 }
 
 void particleArray::update(GLfloat dt, bool reset) {
@@ -1,5 +1,6 @@
 #pragma once
 #include "rt3d.h"
+#include "rt3dStreamBuffer.h"
 #include <cstdlib>
 #include <ctime>
 #include <glm/glm.hpp>
@@ -13,7 +14,8 @@ private:
 	GLfloat* colours;
 	glm::vec3* vel;
 	GLuint vao[1];
-	GLuint vbo1[2];
+	GLuint vbo1[1];	// colours
+	rt3d::streamBuffer positionStream;	// positions change every frame, so they are streamed
 public:
 	particleArray(const int n);
 	~particleArray();
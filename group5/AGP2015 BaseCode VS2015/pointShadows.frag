@@ -1,4 +1,7 @@
 #version 330 core
+#ifdef LAYERED
+#extension GL_ARB_texture_cube_map_array : require
+#endif
 
 // Based on and adapted from the point shadows and shadow mapping tutorial by http://learnopengl.com/
 // Available: https://learnopengl.com/#!Advanced-Lighting/Shadows/Point-Shadows, http://learnopengl.com/#!Advanced-Lighting/Shadows/Shadow-Mapping
@@ -6,11 +9,29 @@
 
 out vec4 FragColor;
 
+#ifdef DEFERRED
+// DEFERRED lights the G-buffer gbuffer.frag wrote, one pixel at a time, under deferredLighting.vert's full screen triangle
+uniform sampler2D gAlbedo;
+uniform sampler2D gNormal;
+uniform sampler2D gDepth;
+uniform mat4 inverseViewProjection;    // from the G-buffer's depth back to world space
+
+// undoes gbuffer.frag's octEncode
+vec3 octDecode(vec2 e)
+{
+    e = e * 2.0 - 1.0;
+    vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+    float fold = max(-n.z, 0.0);
+    n.xy += vec2(n.x >= 0.0 ? -fold : fold, n.y >= 0.0 ? -fold : fold);
+    return normalize(n);
+}
+#else
 in VS_OUT {
     vec3 FragPos;
     vec3 Normal;
     vec2 TexCoords;
 } fs_in;
+#endif
 
 struct Material {
     sampler2D diffuse;
@@ -19,97 +40,261 @@ struct Material {
 }; 
 
 
+// std140: each vec3 shares its 16 bytes with the float after it
 struct PointLight {
     vec3 position;
-    
     float constant;
-    float linear;
-    float quadratic;
-	
     vec3 ambient;
+    float linear;
     vec3 diffuse;
+    float quadratic;
     vec3 specular;
 };
 
+#ifndef NR_POINT_LIGHTS
 #define NR_POINT_LIGHTS 4
+#endif
+
+// binding 0: the camera, shared by every scene program
+layout(std140) uniform Camera {
+    mat4 projection;
+    mat4 view;
+    vec3 viewPos;
+};
+
+// binding 1: every light, written once per frame
+layout(std140) uniform Lights {
+    PointLight pointLights[NR_POINT_LIGHTS];
+};
+
+// binding 2: per-frame constants
+layout(std140) uniform Frame {
+    float far_plane;
+    int numShotsFired;
+    float clusterNear;          // view depth the first cluster slice starts at
+    float clusterSliceScale;    // slices per unit of log depth
+};
 
-uniform PointLight pointLights[NR_POINT_LIGHTS];
 uniform Material material;
 
 // Function prototype
-vec3 CalcPointLight(PointLight light, vec3 normal, vec3 fragPos, vec3 viewDir, float shadow);
+vec3 CalcPointLight(PointLight light, vec3 normal, vec3 fragPos, vec3 viewDir, vec3 diffuseColour, vec3 specularColour, float shadow);
 
-uniform samplerCube depthMap[NR_POINT_LIGHTS];
+// LAYERED shadows are all in one cubemap array, a layer per light, instead of a cubemap each
+#ifdef LAYERED
+uniform samplerCubeArrayShadow depthMaps;
+#define SHADOW_CUBE int
+#define depthCube(i) i
+#define shadowLit(cube, dir, depth) texture(depthMaps, vec4(dir, cube), depth)
+#elif defined(ATLAS)
+// ATLAS shadows are tiles of one 2D depth texture, a tile per light per cube face
+uniform sampler2DShadow shadowAtlas;
+uniform vec4 atlasTiles[6 * NR_POINT_LIGHTS]; // x, y, width and height of each face's tile, as atlas texture coordinates
+#define SHADOW_CUBE int
+#define depthCube(i) i
+#define shadowLit(cube, dir, depth) atlasLit(cube, dir, depth)
 
+// compare depth against light's shadows in direction dir - face and position in it are picked the way a cubemap lookup does it
+float atlasLit(int light, vec3 dir, float depth)
+{
+    vec3 a = abs(dir);
+    int face;
+    vec2 st;
+    if (a.x >= a.y && a.x >= a.z) {
+        face = dir.x > 0.0 ? 0 : 1;
+        st = vec2(dir.x > 0.0 ? -dir.z : dir.z, -dir.y) / a.x;
+    } else if (a.y >= a.z) {
+        face = dir.y > 0.0 ? 2 : 3;
+        st = vec2(dir.x, dir.y > 0.0 ? dir.z : -dir.z) / a.y;
+    } else {
+        face = dir.z > 0.0 ? 4 : 5;
+        st = vec2(dir.z > 0.0 ? dir.x : -dir.x, -dir.y) / a.z;
+    }
+    vec4 tile = atlasTiles[light * 6 + face];
+    // keep half a texel inside the tile, so the neighbouring tiles never get sampled
+    vec2 halfTexel = 0.5 / vec2(textureSize(shadowAtlas, 0));
+    vec2 uv = clamp(tile.xy + (st * 0.5 + 0.5) * tile.zw, tile.xy + halfTexel, tile.xy + tile.zw - halfTexel);
+    return texture(shadowAtlas, vec3(uv, depth));
+}
+#elif defined(VSM)
+// VSM shadows are a cubemap per light of the first two moments of depth, mipmapped, read with plain filtering
+uniform samplerCube depthMap[NR_POINT_LIGHTS];
+#define SHADOW_CUBE samplerCube
+#define depthCube(i) depthMap[i]
+#else
+uniform samplerCubeShadow depthMap[NR_POINT_LIGHTS];
+#define SHADOW_CUBE samplerCubeShadow
+#define depthCube(i) depthMap[i]
+#define shadowLit(cube, dir, depth) texture(cube, vec4(dir, depth))
+#endif
 
+uniform int currentLight;
 
-uniform vec3 viewPos;
 
-uniform float far_plane;
-uniform int currentLight;
+#ifdef VSM
+#ifndef VSM_MIN_VARIANCE
+#define VSM_MIN_VARIANCE 0.00002 // half float moments lose the variance of a flat, lit surface
+#endif
+#ifndef VSM_BLEED_REDUCTION
+#define VSM_BLEED_REDUCTION 0.3 // share of the lit bound cut off, against light bleeding where shadows overlap
+#endif
 
+float ShadowCalculation(vec3 fragPos, vec3 lightPosition, SHADOW_CUBE shadowCube)
+{
+    vec3 fragToLight = fragPos - lightPosition;
+    float lightDistance = length(fragToLight);
+    float bias = 0.15;
+    float currentDepth = (lightDistance - bias) / far_plane;
+	float viewDistance = length(viewPos - fragPos);
+	float diskRadius = (1.0 + (viewDistance / far_plane)) / 25.0;
+	//One fetch, from the mip level whose texels are as wide as the PCF kernel would be: a face is 2 units
+	//across at distance 1, so the kernel covers diskRadius / lightDistance of its width in texels
+	float kernelTexels = diskRadius / lightDistance * float(textureSize(shadowCube, 0).x);
+	vec2 moments = textureLod(shadowCube, fragToLight, log2(max(kernelTexels, 1.0))).rg;
+	if(currentDepth <= moments.x)
+		return 0.0;
+	//Chebyshev's inequality bounds how much of the filtered area is nearer the light than this fragment
+	float variance = max(moments.y - moments.x * moments.x, VSM_MIN_VARIANCE);
+	float d = currentDepth - moments.x;
+	float lit = variance / (variance + d * d);
+	lit = clamp((lit - VSM_BLEED_REDUCTION) / (1.0 - VSM_BLEED_REDUCTION), 0.0, 1.0);
+	return 1.0 - lit;
+}
+#else
+// PCF taps, the first PCF_PROBE_SAMPLES of them spread as a tetrahedron
 vec3 sampleOffsetDirections[20] = vec3[]
 (
-   vec3( 1,  1,  1), vec3( 1, -1,  1), vec3(-1, -1,  1), vec3(-1,  1,  1), 
-   vec3( 1,  1, -1), vec3( 1, -1, -1), vec3(-1, -1, -1), vec3(-1,  1, -1),
+   vec3( 1,  1,  1), vec3( 1, -1, -1), vec3(-1,  1, -1), vec3(-1, -1,  1),
+   vec3( 1, -1,  1), vec3(-1,  1,  1), vec3( 1,  1, -1), vec3(-1, -1, -1),
    vec3( 1,  1,  0), vec3( 1, -1,  0), vec3(-1, -1,  0), vec3(-1,  1,  0),
    vec3( 1,  0,  1), vec3(-1,  0,  1), vec3( 1,  0, -1), vec3(-1,  0, -1),
    vec3( 0,  1,  1), vec3( 0, -1,  1), vec3( 0, -1, -1), vec3( 0,  1, -1)
-);   
+);
+#define PCF_SAMPLES 20
+#ifndef PCF_PROBE_SAMPLES
+#define PCF_PROBE_SAMPLES 4 // PCF_SAMPLES always takes the whole kernel
+#endif
 
-float ShadowCalculation(vec3 fragPos, vec3 lightPosition, samplerCube shadowCube)
+float ShadowCalculation(vec3 fragPos, vec3 lightPosition, SHADOW_CUBE shadowCube)
 {
-
     // Get vector between fragment position and light position
     vec3 fragToLight = fragPos - lightPosition;
-    // Use the light to fragment vector to sample from the depth map    
-    float closestDepth = texture(shadowCube, fragToLight).r;
-    // It is currently in linear range between [0,1]. Re-transform back to original value
-    closestDepth *= far_plane;
-    // Now get current linear depth as the length between the fragment and light position
-    float currentDepth = length(fragToLight);
-    // Now test for shadows
-    float shadow = 0.0;
-	float bias = 0.15;
-	int samples = 20;
+    // Current linear depth less the bias, mapped to the [0,1] range the depth map holds
+    float bias = 0.15;
+    float currentDepth = (length(fragToLight) - bias) / far_plane;
 	float viewDistance = length(viewPos - fragPos);
 	float diskRadius = (1.0 + (viewDistance / far_plane)) / 25.0;
-	//apply PCF to soften shadows, using sampleOffsetDirections to reduce the number of samples taken
-	//diskRadius is used to increase the offset radius by the distance to the viewer
-	//This makes the shadows softer when far away and sharper when close by
-	for(int i = 0; i < samples; ++i)
-	{
-		float closestDepth = texture(shadowCube, fragToLight + sampleOffsetDirections[i] * diskRadius).r;
-		closestDepth *= far_plane;   // Undo mapping [0;1]
-		if(currentDepth - bias > closestDepth)
-			shadow += 1.0;
-	}
-	shadow /= float(samples);  
+	//apply PCF to soften shadows; diskRadius increases the offset radius by the distance to the viewer
+	//Each tap is a hardware depth comparison with bilinear filtering, so it gives how much of that spot is lit.
+	//If the probe taps all agree, the fragment is fully lit or fully in shadow and that's the answer;
+	//only fragments in a penumbra take the rest of the kernel
+	float lit = 0.0;
+	for(int i = 0; i < PCF_PROBE_SAMPLES; ++i)
+		lit += shadowLit(shadowCube, fragToLight + sampleOffsetDirections[i] * diskRadius, currentDepth);
+	if(lit == 0.0 || lit == float(PCF_PROBE_SAMPLES))
+		return 1.0 - lit / float(PCF_PROBE_SAMPLES);
+	for(int i = PCF_PROBE_SAMPLES; i < PCF_SAMPLES; ++i)
+		lit += shadowLit(shadowCube, fragToLight + sampleOffsetDirections[i] * diskRadius, currentDepth);
+	return 1.0 - lit / float(PCF_SAMPLES);
+}
+#endif
 
-    return shadow;
+// Unshadowed lights on top of the shadowed ones, culled per cluster of the view frustum on the CPU (see rt3dLightClusters.h)
+#ifndef CLUSTERS_X
+#define CLUSTERS_X 16
+#define CLUSTERS_Y 9
+#define CLUSTERS_Z 24
+#endif
+uniform samplerBuffer clusterLights;	// two texels per light: position and radius, then colour
+uniform usamplerBuffer clusterLists;	// offset and count per cluster, then the light indices they point into
+uniform int clusterLightCount;			// every light - CLUSTER_BRUTE_FORCE shades them all, for comparison
+
+// where in clusterLists the lights reaching fragPos's cluster are listed, and how many there are
+uvec2 clusterLightRange(vec3 fragPos)
+{
+#ifdef CLUSTER_BRUTE_FORCE
+	return uvec2(0u, uint(clusterLightCount));
+#else
+	vec4 viewPosition = view * vec4(fragPos, 1.0);
+	vec4 clip = projection * viewPosition;
+	ivec2 tile = clamp(ivec2((clip.xy / clip.w * 0.5 + 0.5) * vec2(CLUSTERS_X, CLUSTERS_Y)), ivec2(0), ivec2(CLUSTERS_X - 1, CLUSTERS_Y - 1));
+	int slice = int(log(max(-viewPosition.z, clusterNear) / clusterNear) * clusterSliceScale);
+	if (slice >= CLUSTERS_Z)
+		return uvec2(0u);
+	int cluster = (slice * CLUSTERS_Y + tile.y) * CLUSTERS_X + tile.x;
+	return uvec2(texelFetch(clusterLists, 2 * cluster).r, texelFetch(clusterLists, 2 * cluster + 1).r);
+#endif
+}
+
+// the light at position n of the range
+int clusterLightIndex(uint n)
+{
+#ifdef CLUSTER_BRUTE_FORCE
+	return int(n);
+#else
+	return int(texelFetch(clusterLists, int(n)).r);
+#endif
+}
+
+// falls smoothly to nothing at the light's radius
+float clusterAttenuation(float distance, float radius)
+{
+	float falloff = clamp(1.0 - pow(distance / radius, 4.0), 0.0, 1.0);
+	return falloff * falloff / (1.0 + distance * distance);
 }
 
 void main()
 {    
+#ifdef DEFERRED
+    ivec2 pixel = ivec2(gl_FragCoord.xy);
+    float depth = texelFetch(gDepth, pixel, 0).r;
+    if (depth == 1.0)
+        discard; // nothing drawn here - leave the sky
+    vec4 world = inverseViewProjection * vec4(vec3(gl_FragCoord.xy / vec2(textureSize(gDepth, 0)), depth) * 2.0 - 1.0, 1.0);
+    vec3 fragPos = world.xyz / world.w;
+    vec3 normal = octDecode(texelFetch(gNormal, pixel, 0).rg);
+    vec3 diffuseColour = texelFetch(gAlbedo, pixel, 0).rgb;
+    vec3 specularColour = diffuseColour; // the scene's specular map is its diffuse map, so the G-buffer doesn't keep it
+    gl_FragDepth = depth; // for what is drawn forward afterwards
+#else
+    vec3 fragPos = fs_in.FragPos;
     vec3 normal = normalize(fs_in.Normal);
-	vec3 viewDir = normalize(viewPos - fs_in.FragPos);
+    vec3 diffuseColour = vec3(texture(material.diffuse, fs_in.TexCoords));
+    vec3 specularColour = vec3(texture(material.specular, fs_in.TexCoords));
+#endif
+	vec3 viewDir = normalize(viewPos - fragPos);
     // Phase 2: Point lights
 	vec3 result;
 	float shadow;
 
 	for(int i = 0; i < NR_POINT_LIGHTS; i++){
 		// need to do shadow calculations for each light, and each light has a separate depthmap
-		shadow = ShadowCalculation(fs_in.FragPos, pointLights[i].position, depthMap[i]);
+		shadow = ShadowCalculation(fragPos, pointLights[i].position, depthCube(i));
 		//result is the sum of all lights and shadows
 		//since shadows are simulated by taking from the diffuse and specular parts of the light, overlapping shadows will nicely be darker
-		result += CalcPointLight(pointLights[i], normal, fs_in.FragPos, viewDir, shadow);   
+		result += CalcPointLight(pointLights[i], normal, fragPos, viewDir, diffuseColour, specularColour, shadow);   
+	}
+	// then the unshadowed lights listed for this fragment's cluster
+	uvec2 range = clusterLightRange(fragPos);
+	for(uint n = range.x; n < range.x + range.y; n++){
+		int light = clusterLightIndex(n);
+		vec4 positionRadius = texelFetch(clusterLights, 2 * light);
+		vec3 toLight = positionRadius.xyz - fragPos;
+		float distance = length(toLight);
+		if(distance >= positionRadius.w)
+			continue;
+		vec3 lightDir = toLight / distance;
+		float diff = max(dot(normal, lightDir), 0.0);
+		float spec = pow(max(dot(viewDir, reflect(-lightDir, normal)), 0.0), material.shininess);
+		result += texelFetch(clusterLights, 2 * light + 1).rgb * clusterAttenuation(distance, positionRadius.w)
+			* (diff * diffuseColour + spec * specularColour);
 	}
 	FragColor = vec4(result, 1.0f);
 }  
 
 
 // Calculates the color when using a point light.
-vec3 CalcPointLight(PointLight light, vec3 normal, vec3 fragPos, vec3 viewDir, float shadow)
+vec3 CalcPointLight(PointLight light, vec3 normal, vec3 fragPos, vec3 viewDir, vec3 diffuseColour, vec3 specularColour, float shadow)
 {
     vec3 lightDir = normalize(light.position - fragPos);
     // Diffuse shading
@@ -121,9 +306,9 @@ vec3 CalcPointLight(PointLight light, vec3 normal, vec3 fragPos, vec3 viewDir, f
     float distance = length(light.position - fragPos);
     float attenuation = 1.0f / (light.constant + light.linear * distance + light.quadratic * (distance * distance));    
     // Combine results
-    vec3 ambient = light.ambient * vec3(texture(material.diffuse, fs_in.TexCoords));
-    vec3 diffuse = light.diffuse * diff * vec3(texture(material.diffuse, fs_in.TexCoords));
-    vec3 specular = light.specular * spec * vec3(texture(material.specular, fs_in.TexCoords));
+    vec3 ambient = light.ambient * diffuseColour;
+    vec3 diffuse = light.diffuse * diff * diffuseColour;
+    vec3 specular = light.specular * spec * specularColour;
     ambient *= attenuation;
     diffuse *= attenuation;
     specular *= attenuation;
@@ -7,6 +7,8 @@
 layout (location = 0) in vec3 position;
 layout (location = 2) in vec3 normal;
 layout (location = 3) in vec2 texCoords;
+layout (location = 6) in uint md2Vertex; // md2 vertex this vertex decodes from, for keyframed models
+layout (location = 8) in mat4 instanceModel; // per instance (locations 8 to 11), for instanced draws
 
 out vec2 TexCoords;
 
@@ -16,14 +18,40 @@ out VS_OUT {
     vec2 TexCoords;
 } vs_out;
 
-uniform mat4 projection;
-uniform mat4 view;
+// binding 0: the camera, shared by every scene program
+layout(std140) uniform Camera {
+    mat4 projection;
+    mat4 view;
+    vec3 viewPos;
+};
+
 uniform mat4 model;
+uniform bool instanced; // take the model matrix from instanceModel rather than model
+
+invariant gl_Position; // the same depth as the depth pre-pass computes, for the equal depth test after it
+
+// md2 models animated on the GPU keep their frames quantized in frameData (xyz, normal index per vertex).
+// Each vertex fetches its md2 vertex from the current and next frame, decodes and blends them.
+uniform bool keyframed;
+uniform usamplerBuffer frameData;
+uniform int frameStart[2];      // first vertex of the current and next frame in frameData
+uniform vec3 frameScale[2];
+uniform vec3 frameTranslate[2];
+uniform float interp;
+
+vec3 keyframePosition()
+{
+    vec3 a = vec3(texelFetch(frameData, frameStart[0] + int(md2Vertex)).xyz) * frameScale[0] + frameTranslate[0];
+    vec3 b = vec3(texelFetch(frameData, frameStart[1] + int(md2Vertex)).xyz) * frameScale[1] + frameTranslate[1];
+    return mix(a, b, interp);
+}
 
 void main()
 {
-    gl_Position = projection * view * model * vec4(position, 1.0f);
-    vs_out.FragPos = vec3(model * vec4(position, 1.0));
-    vs_out.Normal = transpose(inverse(mat3(model))) * normal;
+    vec3 pos = keyframed ? keyframePosition() : position;
+    mat4 modelMatrix = instanced ? instanceModel : model;
+    gl_Position = projection * view * modelMatrix * vec4(pos, 1.0f);
+    vs_out.FragPos = vec3(modelMatrix * vec4(pos, 1.0));
+    vs_out.Normal = transpose(inverse(mat3(modelMatrix))) * normal;
     vs_out.TexCoords = texCoords;
 }  
\ No newline at end of file
@@ -1,5 +1,21 @@
 #include "rt3d.h"
+#include "rt3dUniforms.h"
 #include <map>
+#include <vector>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 using namespace std;
 
@@ -52,6 +68,84 @@ char* loadFile(const char *fname, GLint &fSize) {
 	return memblock;
 }
 
+// mapFile - maps file fname read-only into memory, without copying it
+// Much cheaper than loadFile for large assets that are only scanned once
+// Returns false (and an empty mapping) if the file can't be opened or is empty
+// Remember to call unmapFile once finished with the data
+bool mapFile(const char *fname, mappedFile &file) {
+	file.data = nullptr;
+	file.size = 0;
+	file.fileHandle = nullptr;
+	file.mapHandle = nullptr;
+#ifdef _WIN32
+	HANDLE hFile = CreateFileA(fname, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+		FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (hFile == INVALID_HANDLE_VALUE) {
+		cout << "Unable to open file " << fname << endl;
+		return false;
+	}
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(hFile, &fileSize) || fileSize.QuadPart == 0) {
+		CloseHandle(hFile);
+		return false;
+	}
+	HANDLE hMap = CreateFileMappingA(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (hMap == NULL) {
+		CloseHandle(hFile);
+		cout << "Unable to map file " << fname << endl;
+		return false;
+	}
+	const void *view = MapViewOfFile(hMap, FILE_MAP_READ, 0, 0, 0);
+	if (view == NULL) {
+		CloseHandle(hMap);
+		CloseHandle(hFile);
+		cout << "Unable to map file " << fname << endl;
+		return false;
+	}
+	file.data = (const char *) view;
+	file.size = (size_t) fileSize.QuadPart;
+	file.fileHandle = hFile;
+	file.mapHandle = hMap;
+#else
+	int fd = open(fname, O_RDONLY);
+	if (fd < 0) {
+		cout << "Unable to open file " << fname << endl;
+		return false;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size == 0) {
+		close(fd);
+		return false;
+	}
+	void *view = mmap(nullptr, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd); // the mapping keeps its own reference to the file
+	if (view == MAP_FAILED) {
+		cout << "Unable to map file " << fname << endl;
+		return false;
+	}
+	madvise(view, (size_t) st.st_size, MADV_SEQUENTIAL);
+	file.data = (const char *) view;
+	file.size = (size_t) st.st_size;
+#endif
+	return true;
+}
+
+void unmapFile(mappedFile &file) {
+	if (file.data == nullptr)
+		return;
+#ifdef _WIN32
+	UnmapViewOfFile(file.data);
+	CloseHandle((HANDLE) file.mapHandle);
+	CloseHandle((HANDLE) file.fileHandle);
+#else
+	munmap((void *) file.data, file.size);
+#endif
+	file.data = nullptr;
+	file.size = 0;
+	file.fileHandle = nullptr;
+	file.mapHandle = nullptr;
+}
+
 // printShaderError
 // Display (hopefully) useful error messages if shader fails to compile or link
 void printShaderError(const GLint shader) {
@@ -77,59 +171,54 @@ void printShaderError(const GLint shader) {
 	// should additionally check for OpenGL errors here
 }
 
-GLuint initShaders(const char *vertFile, const char *fragFile, const char *geomFile) {
-	GLuint p, f, v, g;
-
-	char *vs, *fs, *gs;
-
-	v = glCreateShader(GL_VERTEX_SHADER);
-	f = glCreateShader(GL_FRAGMENT_SHADER);
-	g = glCreateShader(GL_GEOMETRY_SHADER);
-
-	// load shaders & get length of each
-	GLint vlen;
-	GLint flen;
-	GLint glen;
-	vs = loadFile(vertFile, vlen);
-	fs = loadFile(fragFile, flen);
-	gs = loadFile(geomFile, glen);
-
-	const char * vv = vs;
-	const char * ff = fs;
-	const char * gg = gs;
-
-	glShaderSource(v, 1, &vv, &vlen);
-	glShaderSource(f, 1, &ff, &flen);
-	glShaderSource(g, 1, &gg, &glen);
-
-	GLint compiled;
-
-	glCompileShader(v);
-	glGetShaderiv(v, GL_COMPILE_STATUS, &compiled);
-	if (!compiled) {
-		cout << "Vertex shader not compiled." << endl;
-		rt3d::printShaderError(v);
-	}
-
-	glCompileShader(f);
-	glGetShaderiv(f, GL_COMPILE_STATUS, &compiled);
-	if (!compiled) {
-		cout << "Fragment shader not compiled." << endl;
-		rt3d::printShaderError(f);
+// Load and compile one shader stage. defines, if any, go in right after the #version line,
+// followed by a #line so the compiler's line numbers still match the file.
+static GLuint compileShader(const GLenum type, const char *fname, const char *defines, const char *stageName) {
+	GLuint shader = glCreateShader(type);
+	GLint length;
+	char *source = loadFile(fname, length);
+
+	const char *pieces[4] = { source, "", "", "" };
+	GLint lengths[4] = { length, 0, 0, 0 };
+	string lineDirective;
+	if (defines && source) {
+		const char version[] = "#version";
+		const char *end = source + length;
+		const char *split = search((const char*) source, end, version, version + sizeof(version) - 1);
+		if (split != end)
+			split = find(split, end, '\n');
+		if (split != end) {
+			split++; // keep the #version line (and its newline) first
+			lineDirective = "\n#line " + to_string(count((const char*) source, split, '\n') + 1) + "\n";
+			lengths[0] = (GLint) (split - source);
+			pieces[1] = defines;
+			lengths[1] = (GLint) strlen(defines);
+			pieces[2] = lineDirective.c_str();
+			lengths[2] = (GLint) lineDirective.size();
+			pieces[3] = split;
+			lengths[3] = (GLint) (end - split);
+		}
 	}
+	glShaderSource(shader, 4, pieces, lengths);
 
-	glCompileShader(g);
-	glGetShaderiv(g, GL_COMPILE_STATUS, &compiled);
+	GLint compiled;
+	glCompileShader(shader);
+	glGetShaderiv(shader, GL_COMPILE_STATUS, &compiled);
 	if (!compiled) {
-		cout << "Geometry shader not compiled." << endl;
-		rt3d::printShaderError(g);
+		cout << stageName << " shader not compiled." << endl;
+		rt3d::printShaderError(shader);
 	}
+	delete[] source; // dont forget to free allocated memory - we allocated this in the loadFile function...
+	return shader;
+}
 
-	p = glCreateProgram();
+GLuint initShaders(const char *vertFile, const char *fragFile, const char *geomFile, const char *defines) {
+	GLuint p = glCreateProgram();
 
-	glAttachShader(p, v);
-	glAttachShader(p, f);
-	glAttachShader(p, g);
+	glAttachShader(p, compileShader(GL_VERTEX_SHADER, vertFile, defines, "Vertex"));
+	glAttachShader(p, compileShader(GL_FRAGMENT_SHADER, fragFile, defines, "Fragment"));
+	if (geomFile)
+		glAttachShader(p, compileShader(GL_GEOMETRY_SHADER, geomFile, defines, "Geometry"));
 
 	glBindAttribLocation(p, RT3D_VERTEX, "in_Position");
 	glBindAttribLocation(p, RT3D_COLOUR, "in_Color");
@@ -137,69 +226,18 @@ GLuint initShaders(const char *vertFile, const char *fragFile, const char *geomF
 	glBindAttribLocation(p, RT3D_TEXCOORD, "in_TexCoord");
 
 	glLinkProgram(p);
+	reflectUniforms(p);
 	glUseProgram(p);
 
-	delete[] vs; // dont forget to free allocated memory
-	delete[] fs; // we allocated this in the loadFile function...
-	delete[] gs;
-
 	return p;
 }
 
+GLuint initShaders(const char *vertFile, const char *fragFile, const char *geomFile) {
+	return initShaders(vertFile, fragFile, geomFile, nullptr);
+}
 
 GLuint initShaders(const char *vertFile, const char *fragFile) {
-	GLuint p, f, v;
-
-	char *vs,*fs;
-
-	v = glCreateShader(GL_VERTEX_SHADER);
-	f = glCreateShader(GL_FRAGMENT_SHADER);	
-
-	// load shaders & get length of each
-	GLint vlen;
-	GLint flen;
-	vs = loadFile(vertFile,vlen);
-	fs = loadFile(fragFile,flen);
-	
-	const char * vv = vs;
-	const char * ff = fs;
-
-	glShaderSource(v, 1, &vv,&vlen);
-	glShaderSource(f, 1, &ff,&flen);
-	
-	GLint compiled;
-
-	glCompileShader(v);
-	glGetShaderiv(v, GL_COMPILE_STATUS, &compiled);
-	if (!compiled) {
-		cout << "Vertex shader not compiled." << endl;
-		rt3d::printShaderError(v);
-	} 
-
-	glCompileShader(f);
-	glGetShaderiv(f, GL_COMPILE_STATUS, &compiled);
-	if (!compiled) {
-		cout << "Fragment shader not compiled." << endl;
-		rt3d::printShaderError(f);
-	} 
-	
-	p = glCreateProgram();
-		
-	glAttachShader(p,v);
-	glAttachShader(p,f);
-
-	glBindAttribLocation(p,RT3D_VERTEX,"in_Position");
-	glBindAttribLocation(p,RT3D_COLOUR,"in_Color");
-	glBindAttribLocation(p,RT3D_NORMAL,"in_Normal");
-	glBindAttribLocation(p,RT3D_TEXCOORD,"in_TexCoord");
-
-	glLinkProgram(p);
-	glUseProgram(p);
-
-	delete [] vs; // dont forget to free allocated memory
-	delete [] fs; // we allocated this in the loadFile function...
-
-	return p;
+	return initShaders(vertFile, fragFile, nullptr, nullptr);
 }
 
 GLuint createMesh(const GLuint numVerts, const GLfloat* vertices, const GLfloat* colours, 
@@ -209,8 +247,10 @@ GLuint createMesh(const GLuint numVerts, const GLfloat* vertices, const GLfloat*
 	glGenVertexArrays(1, &VAO);
 	glBindVertexArray(VAO);
 
-	GLuint *pMeshBuffers = new GLuint[5];
-
+	// one slot per attribute (RT3D_VERTEX..RT3D_TANGENT), 0 where the mesh has no buffer of its own
+	GLuint *pMeshBuffers = new GLuint[6];
+	for (int i = 0; i < 6; i++)
+		pMeshBuffers[i] = 0;
 
 	if (vertices == nullptr) {
 		// cant create a mesh without vertices... oops
@@ -288,80 +328,499 @@ GLuint createColourMesh(const GLuint numVerts, const GLfloat* vertices, const GL
 	return createMesh(numVerts, vertices, colours, nullptr, nullptr);
 }
 
+// number of floats each attribute takes in an interleaved vertex
+static const GLuint interleavedSizes[6] = { 3, 3, 3, 2, 0, 4 };
+
+// index type of each VAO drawn with 16 bit indices - anything not in here uses GL_UNSIGNED_INT
+static map<GLuint, GLenum> indexTypeMap;
+// the instance buffer each mesh's RT3D_INSTANCE_MATRIX attributes read from
+static map<GLuint, GLuint> instanceBufferMap;
+
+GLuint attributeSize(const GLuint attribute) {
+	return attribute < 6 ? interleavedSizes[attribute] : 0;
+}
+
+GLuint interleavedStride(const GLuint attributes) {
+	GLuint stride = 0;
+	for (GLuint i = 0; i < 6; i++)
+		if (attributes & (1 << i))
+			stride += interleavedSizes[i];
+	return stride * sizeof(GLfloat);
+}
+
+// float to IEEE half, round to nearest even, overflow goes to infinity
+static GLushort floatToHalf(const GLfloat value) {
+	GLuint f;
+	memcpy(&f, &value, sizeof(f));
+	GLuint sign = (f >> 16) & 0x8000;
+	GLuint absf = f & 0x7FFFFFFF;
+	if (absf >= 0x7F800000)		// inf or nan
+		return (GLushort) (sign | 0x7C00 | (absf > 0x7F800000 ? 0x200 : 0));
+	if (absf >= 0x477FF000)		// too big once rounded
+		return (GLushort) (sign | 0x7C00);
+	if (absf < 0x38800000) {	// denormal half (or zero)
+		if (absf < 0x33000000)
+			return (GLushort) sign;
+		GLuint mantissa = (absf & 0x007FFFFF) | 0x00800000;
+		GLuint shift = 126 - (absf >> 23);
+		GLuint half = mantissa >> shift;
+		GLuint rest = mantissa & ((1u << shift) - 1);
+		GLuint halfway = 1u << (shift - 1);
+		if (rest > halfway || (rest == halfway && (half & 1)))
+			half++;
+		return (GLushort) (sign | half);
+	}
+	GLuint half = (absf - 0x38000000) >> 13;
+	GLuint rest = absf & 0x1FFF;
+	if (rest > 0x1000 || (rest == 0x1000 && (half & 1)))
+		half++;
+	return (GLushort) (sign | half);
+}
+
+static GLint snorm(const GLfloat value, const GLint maxValue) {
+	GLfloat v = value < -1.0f ? -1.0f : (value > 1.0f ? 1.0f : value);
+	return (GLint) floorf(v * maxValue + 0.5f);
+}
+
+// GL_INT_2_10_10_10_REV: x in the low bits, w in the top two
+// w only needs to carry a sign (tangent handedness), so -1 is stored as -2 which reads back as -1.0 under either snorm rule
+static GLuint packSnorm1010102(const GLfloat x, const GLfloat y, const GLfloat z, const GLfloat w) {
+	GLint iw = w < 0.0f ? -2 : (w > 0.0f ? 1 : 0);
+	return (GLuint) (snorm(x, 511) & 0x3FF) | ((GLuint) (snorm(y, 511) & 0x3FF) << 10)
+		| ((GLuint) (snorm(z, 511) & 0x3FF) << 20) | ((GLuint) (iw & 0x3) << 30);
+}
+
+// IEEE half to float
+static GLfloat halfToFloat(const GLushort half) {
+	GLuint exponent = (half >> 10) & 0x1F, mantissa = half & 0x3FF;
+	GLfloat value;
+	if (exponent == 0)			// denormal (or zero)
+		value = ldexpf((GLfloat) mantissa, -24);
+	else if (exponent == 31)	// inf or nan
+		value = mantissa ? NAN : INFINITY;
+	else
+		value = ldexpf((GLfloat) (mantissa | 0x400), (int) exponent - 25);
+	return (half & 0x8000) ? -value : value;
+}
+
+static GLuint attributeBytes(const vertexAttribute &a) {
+	switch (a.type) {
+	case GL_HALF_FLOAT:
+	case GL_UNSIGNED_SHORT:
+		return a.components * 2;
+	case GL_INT_2_10_10_10_REV:
+		return 4;
+	default:
+		return a.components * sizeof(GLfloat);
+	}
+}
+
+static vertexAttribute choosePacking(const GLuint attribute, const GLuint format, const GLuint numVerts,
+	const GLfloat *src, const GLuint srcStride) {
+	vertexAttribute a = { GL_FLOAT, (GLint) interleavedSizes[attribute], GL_FALSE, 0 };
+	if (attribute == RT3D_VERTEX && (format & RT3D_FORMAT_HALF_POSITION)) {
+		vertexAttribute half = { GL_HALF_FLOAT, 4, GL_FALSE, 0 };	// w padding keeps the vertex 4 byte aligned
+		a = half;
+	}
+	else if ((attribute == RT3D_NORMAL || attribute == RT3D_TANGENT) && (format & RT3D_FORMAT_PACKED_NORMAL)) {
+		vertexAttribute packed = { GL_INT_2_10_10_10_REV, 4, GL_TRUE, 0 };
+		a = packed;
+	}
+	else if (attribute == RT3D_TEXCOORD && (format & RT3D_FORMAT_SHORT_TEXCOORD)) {
+		// unorm16 only covers 0..1, so tiled UVs fall back to half floats
+		bool inRange = true;
+		for (GLuint v = 0; v < numVerts && inRange; v++)
+			for (int c = 0; c < 2; c++)
+				if (src[v * srcStride + c] < 0.0f || src[v * srcStride + c] > 1.0f)
+					inRange = false;
+		vertexAttribute unorm = { GL_UNSIGNED_SHORT, 2, GL_TRUE, 0 };
+		vertexAttribute half = { GL_HALF_FLOAT, 2, GL_FALSE, 0 };
+		a = inRange ? unorm : half;
+	}
+	return a;
+}
+
+// how the attributes of numVerts vertices (each source with its own stride in floats) are stored in format
+static void chooseLayout(const GLuint numVerts, const GLfloat *const src[6], const GLuint srcStride[6], const GLuint format,
+	vertexLayout &layout) {
+	layout.stride = 0;
+	for (GLuint i = 0; i < 6; i++) {
+		vertexAttribute none = { GL_FLOAT, 0, GL_FALSE, 0 };
+		layout.attributes[i] = none;
+		if (src[i] == nullptr || interleavedSizes[i] == 0)
+			continue;
+		layout.attributes[i] = choosePacking(i, format, numVerts, src[i], srcStride[i]);
+		layout.attributes[i].offset = layout.stride;
+		layout.stride += attributeBytes(layout.attributes[i]);
+	}
+}
+
+// true if layout is plain interleaved floats, i.e. the vertices are stored just as they were given
+static bool floatLayout(const vertexLayout &layout) {
+	for (GLuint i = 0; i < 6; i++)
+		if (layout.attributes[i].components && layout.attributes[i].type != GL_FLOAT)
+			return false;
+	return true;
+}
+
+static void packAttribute(unsigned char *dst, const vertexAttribute &a, const GLfloat *src, const GLuint srcComponents) {
+	switch (a.type) {
+	case GL_HALF_FLOAT: {
+		GLushort h[4];
+		for (GLint c = 0; c < a.components; c++)
+			h[c] = floatToHalf(c < (GLint) srcComponents ? src[c] : 1.0f);
+		memcpy(dst, h, attributeBytes(a));
+		break;
+	}
+	case GL_INT_2_10_10_10_REV: {
+		GLuint p = packSnorm1010102(src[0], src[1], src[2], srcComponents > 3 ? src[3] : 0.0f);
+		memcpy(dst, &p, 4);
+		break;
+	}
+	case GL_UNSIGNED_SHORT: {
+		GLushort s[2];
+		for (int c = 0; c < 2; c++)
+			s[c] = (GLushort) floorf(src[c] * 65535.0f + 0.5f);
+		memcpy(dst, s, 4);
+		break;
+	}
+	default:
+		memcpy(dst, src, attributeBytes(a));
+	}
+}
+
+// packAttribute backwards: dstComponents floats from one stored attribute
+static void unpackAttribute(GLfloat *dst, const vertexAttribute &a, const unsigned char *src, const GLuint dstComponents) {
+	switch (a.type) {
+	case GL_HALF_FLOAT: {
+		GLushort h[4];
+		memcpy(h, src, attributeBytes(a));
+		for (GLuint c = 0; c < dstComponents; c++)
+			dst[c] = halfToFloat(h[c]);
+		break;
+	}
+	case GL_INT_2_10_10_10_REV: {
+		GLuint p;
+		memcpy(&p, src, 4);
+		for (GLuint c = 0; c < 3 && c < dstComponents; c++) {
+			GLint value = (GLint) (p << (22 - 10 * c)) >> 22;	// sign extend the 10 bits
+			dst[c] = std::max(value / 511.0f, -1.0f);
+		}
+		if (dstComponents > 3) {
+			GLint w = (GLint) p >> 30;
+			dst[3] = w < 0 ? -1.0f : (w > 0 ? 1.0f : 0.0f);
+		}
+		break;
+	}
+	case GL_UNSIGNED_SHORT: {
+		GLushort s[2];
+		memcpy(s, src, 4);
+		for (int c = 0; c < 2; c++)
+			dst[c] = s[c] / 65535.0f;
+		break;
+	}
+	default:
+		memcpy(dst, src, dstComponents * sizeof(GLfloat));
+	}
+}
+
+static void packVertices(const GLuint numVerts, const GLfloat *const src[6], const GLuint srcStride[6], const vertexLayout &layout,
+	vector<unsigned char> &packed) {
+	packed.assign((size_t) numVerts * layout.stride, 0);
+	for (GLuint i = 0; i < 6; i++) {
+		if (layout.attributes[i].components == 0)
+			continue;
+		unsigned char *dst = packed.data() + layout.attributes[i].offset;
+		for (GLuint v = 0; v < numVerts; v++, dst += layout.stride)
+			packAttribute(dst, layout.attributes[i], src[i] + (size_t) v * srcStride[i], interleavedSizes[i]);
+	}
+}
+
+// the attributes of interleaved float vertexData, as separate sources
+static void interleavedSources(const GLfloat *vertexData, const GLuint attributes, const GLfloat *src[6], GLuint srcStride[6]) {
+	GLuint stride = interleavedStride(attributes) / sizeof(GLfloat);
+	GLuint offset = 0;
+	for (GLuint i = 0; i < 6; i++) {
+		src[i] = nullptr;
+		srcStride[i] = stride;
+		if (attributes & (1 << i)) {
+			src[i] = vertexData + offset;
+			offset += interleavedSizes[i];
+		}
+	}
+}
+
+GLuint createLaidOutMesh(const GLuint numVerts, const GLvoid *vertexData, const vertexLayout &layout,
+	const GLuint indexCount, const GLvoid *indices, const GLenum indexType) {
+	if (vertexData == nullptr || layout.attributes[RT3D_VERTEX].components == 0) {
+		// cant create a mesh without vertices... oops
+		exitFatalError("Attempt to create a mesh with no vertices");
+	}
+
+	GLuint VAO;
+	glGenVertexArrays(1, &VAO);
+	glBindVertexArray(VAO);
+
+	GLuint *pMeshBuffers = new GLuint[6];
+	for (int i = 0; i < 6; i++)
+		pMeshBuffers[i] = 0;
+
+	// one buffer, one upload, for all of the vertex data
+	GLuint VBO;
+	glGenBuffers(1, &VBO);
+	glBindBuffer(GL_ARRAY_BUFFER, VBO);
+	glBufferData(GL_ARRAY_BUFFER, (size_t) numVerts * layout.stride, vertexData, GL_STATIC_DRAW);
+
+	for (GLuint i = 0; i < 6; i++) {
+		const vertexAttribute &a = layout.attributes[i];
+		if (a.components == 0)
+			continue;
+		pMeshBuffers[i] = VBO;	// every attribute lives in the one buffer
+		glVertexAttribPointer(i, a.components, a.type, a.normalized, layout.stride, (const GLvoid *) (size_t) a.offset);
+		glEnableVertexAttribArray(i);
+	}
+
+	if (indices != nullptr && indexCount > 0) {
+		glGenBuffers(1, &VBO);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, VBO);
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, indexCount * (indexType == GL_UNSIGNED_SHORT ? sizeof(GLushort) : sizeof(GLuint)),
+			indices, GL_STATIC_DRAW);
+		if (indexType == GL_UNSIGNED_SHORT)
+			indexTypeMap[VAO] = GL_UNSIGNED_SHORT;
+		pMeshBuffers[RT3D_INDEX] = VBO;
+	}
+	glBindVertexArray(0);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+
+	vertexArrayMap.insert( pair<GLuint, GLuint *>(VAO, pMeshBuffers) );
+
+	return VAO;
+}
+
+// createLaidOutMesh, with the indices made 16 bit when format allows and numVerts fits
+static GLuint createMeshWithIndices(const GLuint numVerts, const GLvoid *vertexData, const vertexLayout &layout,
+	const GLuint indexCount, const GLuint *indices, const GLuint format) {
+	if (indices != nullptr && indexCount > 0 && (format & RT3D_FORMAT_SHORT_INDEX) && numVerts <= 0x10000) {
+		vector<GLushort> shortIndices(indices, indices + indexCount);
+		return createLaidOutMesh(numVerts, vertexData, layout, indexCount, shortIndices.data(), GL_UNSIGNED_SHORT);
+	}
+	return createLaidOutMesh(numVerts, vertexData, layout, indexCount, (const GLvoid *) indices, GL_UNSIGNED_INT);
+}
+
+void layOutVertices(const GLuint numVerts, const GLfloat* vertexData, const GLuint attributes, const GLuint format,
+	vertexLayout &layout, vector<unsigned char> &laidOut) {
+	const GLfloat *src[6];
+	GLuint srcStride[6];
+	interleavedSources(vertexData, attributes, src, srcStride);
+	chooseLayout(numVerts, src, srcStride, format, layout);
+	packVertices(numVerts, src, srcStride, layout, laidOut);
+}
+
+void unpackVertices(const GLuint numVerts, const GLvoid *vertexData, const vertexLayout &layout, vector<GLfloat> &vertices) {
+	GLuint floats = 0;
+	for (GLuint i = 0; i < 6; i++)
+		if (layout.attributes[i].components)
+			floats += interleavedSizes[i];
+	vertices.assign((size_t) numVerts * floats, 0.0f);
+	const unsigned char *bytes = (const unsigned char *) vertexData;
+	for (GLuint v = 0; v < numVerts; v++) {
+		GLfloat *dst = &vertices[(size_t) v * floats];
+		for (GLuint i = 0; i < 6; i++) {
+			if (layout.attributes[i].components == 0)
+				continue;
+			unpackAttribute(dst, layout.attributes[i], bytes + (size_t) v * layout.stride + layout.attributes[i].offset, interleavedSizes[i]);
+			dst += interleavedSizes[i];
+		}
+	}
+}
+
+GLuint createMesh(const GLuint numVerts, const GLfloat* vertices, const GLfloat* colours, const GLfloat* normals,
+	const GLfloat* texcoords, const GLfloat* tangents, const GLuint indexCount, const GLuint* indices, const GLuint format) {
+	if (vertices == nullptr) {
+		// cant create a mesh without vertices... oops
+		exitFatalError("Attempt to create a mesh with no vertices");
+	}
+	const GLfloat *src[6] = { vertices, colours, normals, texcoords, nullptr, tangents };
+	GLuint srcStride[6];
+	for (int i = 0; i < 6; i++)
+		srcStride[i] = interleavedSizes[i];
+	vertexLayout layout;
+	chooseLayout(numVerts, src, srcStride, format, layout);
+	vector<unsigned char> vertexData;
+	packVertices(numVerts, src, srcStride, layout, vertexData);
+	return createMeshWithIndices(numVerts, vertexData.data(), layout, indexCount, indices, format);
+}
+
+GLuint createInterleavedMesh(const GLuint numVerts, const GLfloat* vertexData, const GLuint attributes,
+	const GLuint indexCount, const GLuint* indices, const GLuint format) {
+	if (vertexData == nullptr || !(attributes & (1 << RT3D_VERTEX))) {
+		// cant create a mesh without vertices... oops
+		exitFatalError("Attempt to create a mesh with no vertices");
+	}
+	const GLfloat *src[6];
+	GLuint srcStride[6];
+	interleavedSources(vertexData, attributes, src, srcStride);
+	vertexLayout layout;
+	chooseLayout(numVerts, src, srcStride, format, layout);
+	if (floatLayout(layout)) // nothing to pack: the data is already laid out, so it goes up as it is
+		return createMeshWithIndices(numVerts, (const GLvoid *) vertexData, layout, indexCount, indices, format);
+	vector<unsigned char> packed;
+	packVertices(numVerts, src, srcStride, layout, packed);
+	return createMeshWithIndices(numVerts, packed.data(), layout, indexCount, indices, format);
+}
+
+GLuint createInterleavedMesh(const GLuint numVerts, const GLfloat* vertexData, const GLuint attributes,
+	const GLuint indexCount, const GLuint* indices) {
+	return createInterleavedMesh(numVerts, vertexData, attributes, indexCount, indices, RT3D_FORMAT_FLOAT);
+}
+
+void deleteMesh(const GLuint mesh) {
+	map<GLuint, GLuint *>::iterator buffers = vertexArrayMap.find(mesh);
+	if (buffers != vertexArrayMap.end()) {
+		GLuint *pMeshBuffers = buffers->second;
+		// interleaved meshes share one buffer between their attributes, so only delete each buffer once
+		for (GLuint i = 0; i < 6; i++) {
+			bool seen = false;
+			for (GLuint j = 0; j < i; j++)
+				seen = seen || pMeshBuffers[j] == pMeshBuffers[i];
+			if (pMeshBuffers[i] != 0 && !seen)
+				glDeleteBuffers(1, &pMeshBuffers[i]);
+		}
+		delete[] pMeshBuffers;
+		vertexArrayMap.erase(buffers);
+	}
+	indexTypeMap.erase(mesh);
+	instanceBufferMap.erase(mesh);
+	glDeleteVertexArrays(1, &mesh);
+}
+
+// these look the uniform up by name each call - code that sets uniforms every frame
+// should resolve rt3d::uniform handles once instead
 void setUniformMatrix4fv(const GLuint program, const char* uniformName, const GLfloat *data) {
-	int uniformIndex = glGetUniformLocation(program, uniformName);
-	glUniformMatrix4fv(uniformIndex, 1, GL_FALSE, data); 
+	setUniformMatrix4fv(uniform(program, uniformName), data);
 }
 
 
 void setLightPos(const GLuint program, const GLfloat *lightPos) {
-	int uniformIndex = glGetUniformLocation(program, "lightPosition");
-	glUniform4fv(uniformIndex, 1, lightPos);
+	setUniform4fv(uniform(program, "lightPosition"), 1, lightPos);
 }
 
 void setProjection(const GLuint program, const GLfloat *data) {
-	int uniformIndex = glGetUniformLocation(program, "projection");
-	glUniformMatrix4fv(uniformIndex, 1, GL_FALSE, data); 
+	setUniformMatrix4fv(uniform(program, "projection"), data);
 }
 
 void setLight(const GLuint program, const lightStruct light) {
 	// pass in light data to shader
-	int uniformIndex = glGetUniformLocation(program, "light.ambient");
-	glUniform4fv(uniformIndex, 1, light.ambient);
-	uniformIndex = glGetUniformLocation(program, "light.diffuse");
-	glUniform4fv(uniformIndex, 1, light.diffuse);
-	uniformIndex = glGetUniformLocation(program, "light.specular");
-	glUniform4fv(uniformIndex, 1, light.specular);
-	uniformIndex = glGetUniformLocation(program, "lightPosition");
-	glUniform4fv(uniformIndex, 1, light.position);
+	setUniform4fv(uniform(program, "light.ambient"), 1, light.ambient);
+	setUniform4fv(uniform(program, "light.diffuse"), 1, light.diffuse);
+	setUniform4fv(uniform(program, "light.specular"), 1, light.specular);
+	setUniform4fv(uniform(program, "lightPosition"), 1, light.position);
 }
 
 
 void setMaterial(const GLuint program, const materialStruct material) {
 	// pass in material data to shader 
-	int uniformIndex = glGetUniformLocation(program, "material.ambient");
-	glUniform4fv(uniformIndex, 1, material.ambient);
-	uniformIndex = glGetUniformLocation(program, "material.diffuse");
-	glUniform4fv(uniformIndex, 1, material.diffuse);
-	uniformIndex = glGetUniformLocation(program, "material.specular");
-	glUniform4fv(uniformIndex, 1, material.specular);
-	uniformIndex = glGetUniformLocation(program, "material.shininess");
-	glUniform1f(uniformIndex, material.shininess);
+	setUniform4fv(uniform(program, "material.ambient"), 1, material.ambient);
+	setUniform4fv(uniform(program, "material.diffuse"), 1, material.diffuse);
+	setUniform4fv(uniform(program, "material.specular"), 1, material.specular);
+	setUniform1f(uniform(program, "material.shininess"), material.shininess);
 }
 
+static GLuint drawCalls = 0;
+
 void drawMesh(const GLuint mesh, const GLuint numVerts, const GLuint primitive) {
 	glBindVertexArray(mesh);	// Bind mesh VAO
 	glDrawArrays(primitive, 0, numVerts);	// draw first vertex array object
+	drawCalls++;
 	glBindVertexArray(0);
 }
 
 
 void drawIndexedMesh(const GLuint mesh, const GLuint indexCount, const GLuint primitive) {
 	glBindVertexArray(mesh);	// Bind mesh VAO
-	glDrawElements(primitive, indexCount,  GL_UNSIGNED_INT, 0);	// draw VAO 
+	map<GLuint, GLenum>::const_iterator type = indexTypeMap.find(mesh);
+	glDrawElements(primitive, indexCount, type == indexTypeMap.end() ? GL_UNSIGNED_INT : type->second, 0);	// draw VAO 
+	drawCalls++;
 	glBindVertexArray(0);
 }
 
+void drawBoundIndexedMesh(const GLuint mesh, const GLuint indexCount, const GLuint primitive) {
+	map<GLuint, GLenum>::const_iterator type = indexTypeMap.find(mesh);
+	glDrawElements(primitive, indexCount, type == indexTypeMap.end() ? GL_UNSIGNED_INT : type->second, 0);
+	drawCalls++;
+}
+
+GLuint createInstanceBuffer(const GLuint maxInstances) {
+	GLuint buffer;
+	glGenBuffers(1, &buffer);
+	glBindBuffer(GL_ARRAY_BUFFER, buffer);
+	glBufferData(GL_ARRAY_BUFFER, maxInstances * 16 * sizeof(GLfloat), nullptr, GL_STREAM_DRAW);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	return buffer;
+}
+
+void updateInstanceBuffer(const GLuint buffer, const GLfloat *matrices, const GLuint count) {
+	glBindBuffer(GL_ARRAY_BUFFER, buffer);
+	glBufferData(GL_ARRAY_BUFFER, count * 16 * sizeof(GLfloat), matrices, GL_STREAM_DRAW);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+void drawBoundIndexedMeshInstanced(const GLuint mesh, const GLuint indexCount, const GLuint primitive, const GLuint instanceBuffer,
+	const GLuint instances) {
+	// point the bound VAO's matrix attributes at instanceBuffer, unless they already are - each column is a vec4,
+	// stepping once per instance
+	map<GLuint, GLuint>::iterator attached = instanceBufferMap.find(mesh);
+	if (attached == instanceBufferMap.end() || attached->second != instanceBuffer) {
+		glBindBuffer(GL_ARRAY_BUFFER, instanceBuffer);
+		for (GLuint column = 0; column < 4; column++) {
+			glVertexAttribPointer(RT3D_INSTANCE_MATRIX + column, 4, GL_FLOAT, GL_FALSE, 16 * sizeof(GLfloat),
+				(const GLvoid *) (column * 4 * sizeof(GLfloat)));
+			glVertexAttribDivisor(RT3D_INSTANCE_MATRIX + column, 1);
+			glEnableVertexAttribArray(RT3D_INSTANCE_MATRIX + column);
+		}
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		instanceBufferMap[mesh] = instanceBuffer;
+	}
+	map<GLuint, GLenum>::const_iterator type = indexTypeMap.find(mesh);
+	glDrawElementsInstanced(primitive, indexCount, type == indexTypeMap.end() ? GL_UNSIGNED_INT : type->second, 0, instances);
+	drawCalls++;
+}
+
+void drawIndexedMeshInstanced(const GLuint mesh, const GLuint indexCount, const GLuint primitive, const GLuint instanceBuffer,
+	const GLuint instances) {
+	glBindVertexArray(mesh);
+	drawBoundIndexedMeshInstanced(mesh, indexCount, primitive, instanceBuffer, instances);
+	glBindVertexArray(0);
+}
+
+GLuint getDrawCalls() {
+	return drawCalls;
+}
+
+void resetDrawCalls() {
+	drawCalls = 0;
+}
+
 
 void updateMesh(const GLuint mesh, const unsigned int bufferType, const GLfloat *data, const GLuint size) {
 	GLuint * pMeshBuffers = vertexArrayMap[mesh];
 	glBindVertexArray(mesh);
 
-	// Delete the old buffer data
-	glDeleteBuffers(1, &pMeshBuffers[bufferType]);
-
-	// generate and set up the VBOs for the new data
-	GLuint VBO;
-	glGenBuffers(1, &VBO);
-		// VBO for the data
-	glBindBuffer(GL_ARRAY_BUFFER, VBO);
-	glBufferData(GL_ARRAY_BUFFER, size*sizeof(GLfloat), data, GL_STATIC_DRAW);
-	glVertexAttribPointer((GLuint)bufferType, 3, GL_FLOAT, GL_FALSE, 0, 0); 
+	// Re-specify the attribute's own buffer in place - the driver orphans the old storage if it is still in use,
+	// so there is no stall and no buffer object churn. An attribute that shares an interleaved buffer is split out into its own buffer on first update.
+	bool shared = false;
+	for (GLuint i = 0; i < 6; i++)
+		if (i != bufferType && pMeshBuffers[i] == pMeshBuffers[bufferType])
+			shared = true;
+	if (pMeshBuffers[bufferType] == 0 || shared)
+		glGenBuffers(1, &pMeshBuffers[bufferType]);
+	glBindBuffer(GL_ARRAY_BUFFER, pMeshBuffers[bufferType]);
+	glBufferData(GL_ARRAY_BUFFER, size*sizeof(GLfloat), data, GL_STREAM_DRAW);
+	glVertexAttribPointer((GLuint)bufferType, attributeSize(bufferType), GL_FLOAT, GL_FALSE, 0, 0);
 	glEnableVertexAttribArray(bufferType);
-	pMeshBuffers[RT3D_VERTEX] = VBO;
 
 	glBindVertexArray(0);
-
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
 }
 
 } // namespace rt3d
\ No newline at end of file
@@ -6,12 +6,24 @@
 #include <iostream>
 #include <fstream>
 #include <string>
+#include <vector>
 
 #define RT3D_VERTEX		0
 #define RT3D_COLOUR		1
 #define RT3D_NORMAL		2
 #define RT3D_TEXCOORD   3
 #define RT3D_INDEX		4
+#define RT3D_TANGENT	5
+#define RT3D_KEYFRAME_INDEX	6	// integer vertex index into a keyframed mesh's frame data
+#define RT3D_INSTANCE_MATRIX	8	// per instance model matrix, one column in each of attributes 8 to 11
+
+// vertex formats for the interleaved createMesh/createInterleavedMesh - flags can be combined
+#define RT3D_FORMAT_FLOAT			0x00	// plain floats, 32 bit indices
+#define RT3D_FORMAT_HALF_POSITION	0x01	// positions as 4 half floats (w = 1)
+#define RT3D_FORMAT_PACKED_NORMAL	0x02	// normals and tangents as signed normalized 10_10_10_2
+#define RT3D_FORMAT_SHORT_TEXCOORD	0x04	// texcoords as normalized unsigned shorts (half floats if outside 0..1)
+#define RT3D_FORMAT_SHORT_INDEX		0x08	// 16 bit indices whenever the vertex count fits
+#define RT3D_FORMAT_PACKED			0x0F
 
 namespace rt3d {
 
@@ -29,11 +41,25 @@ namespace rt3d {
 		GLfloat shininess;
 	};
 
+	// read-only view of a whole file mapped into memory by mapFile
+	// data is not null terminated, so always scan using size
+	struct mappedFile {
+		const char *data;
+		size_t size;
+		void *fileHandle;	// platform specific handles, only used by unmapFile
+		void *mapHandle;
+	};
+
 	void exitFatalError(const char *message);
 	char* loadFile(const char *fname, GLint &fSize);
+	bool mapFile(const char *fname, mappedFile &file);
+	void unmapFile(mappedFile &file);
 	void printShaderError(const GLint shader);
 	GLuint initShaders(const char *vertFile, const char *fragFile, const char *geomFile);
 	GLuint initShaders(const char *vertFile, const char *fragFile);
+	// geomFile may be nullptr; defines (e.g. "#define NR_POINT_LIGHTS 8\n"), if not nullptr, are added to
+	// every stage right after its #version line
+	GLuint initShaders(const char *vertFile, const char *fragFile, const char *geomFile, const char *defines);
 	// Some methods for creating meshes
 	// ... including one for dealing with indexed meshes
 	GLuint createMesh(const GLuint numVerts, const GLfloat* vertices, const GLfloat* colours, const GLfloat* normals,
@@ -43,6 +69,43 @@ namespace rt3d {
 		const GLfloat* texcoords);
 	GLuint createMesh(const GLuint numVerts, const GLfloat* vertices);
 	GLuint createColourMesh(const GLuint numVerts, const GLfloat* vertices, const GLfloat* colours);
+	// Create a mesh from one interleaved vertex buffer (and an optional index buffer)
+	// attributes is a mask of (1 << RT3D_VERTEX) | (1 << RT3D_NORMAL) etc; attributes present are interleaved
+	// in the order vertex (3 floats), colour (3), normal (3), texcoord (2), tangent (4)
+	GLuint createInterleavedMesh(const GLuint numVerts, const GLfloat* vertexData, const GLuint attributes,
+		const GLuint indexCount, const GLuint* indices);
+	// as above, but attributes are stored in the given RT3D_FORMAT_ layout (with no packing to do, vertexData is uploaded as it is)
+	GLuint createInterleavedMesh(const GLuint numVerts, const GLfloat* vertexData, const GLuint attributes,
+		const GLuint indexCount, const GLuint* indices, const GLuint format);
+	// Create a mesh with all of its attributes interleaved in one buffer, stored in the given RT3D_FORMAT_ layout
+	// any attribute but vertices can be nullptr; drawIndexedMesh picks up 16 bit indices by itself
+	GLuint createMesh(const GLuint numVerts, const GLfloat* vertices, const GLfloat* colours, const GLfloat* normals,
+		const GLfloat* texcoords, const GLfloat* tangents, const GLuint indexCount, const GLuint* indices, const GLuint format);
+	// delete a mesh made by any of the above, and its buffers
+	void deleteMesh(const GLuint mesh);
+	// Where and how each attribute sits in a mesh's one vertex buffer - what glVertexAttribPointer is given
+	struct vertexAttribute {
+		GLenum type;
+		GLint components;		// 0 for an attribute the mesh doesn't have
+		GLboolean normalized;
+		GLuint offset;			// bytes into the vertex
+	};
+	struct vertexLayout {
+		vertexAttribute attributes[6];	// by RT3D_VERTEX etc
+		GLuint stride;
+	};
+	// Lay interleaved float vertices (as createInterleavedMesh takes them) out in the given RT3D_FORMAT_ layout, for
+	// createLaidOutMesh - so data can be stored already packed, e.g. in a mesh cache
+	void layOutVertices(const GLuint numVerts, const GLfloat* vertexData, const GLuint attributes, const GLuint format,
+		vertexLayout &layout, std::vector<unsigned char> &laidOut);
+	// Create a mesh from vertex data already in layout: one upload, no work per vertex. indexType is GL_UNSIGNED_SHORT or GL_UNSIGNED_INT
+	GLuint createLaidOutMesh(const GLuint numVerts, const GLvoid *vertexData, const vertexLayout &layout,
+		const GLuint indexCount, const GLvoid *indices, const GLenum indexType);
+	// laid out vertices back as interleaved floats, in createInterleavedMesh's order (packed attributes lose what packing lost)
+	void unpackVertices(const GLuint numVerts, const GLvoid *vertexData, const vertexLayout &layout, std::vector<GLfloat> &vertices);
+	GLuint interleavedStride(const GLuint attributes);
+	// number of floats in one RT3D_VERTEX, RT3D_NORMAL etc attribute
+	GLuint attributeSize(const GLuint attribute);
 
 	void setUniformMatrix4fv(const GLuint program, const char* uniformName, const GLfloat *data);
 	
@@ -52,6 +115,22 @@ namespace rt3d {
 
 	void drawMesh(const GLuint mesh, const GLuint numVerts, const GLuint primitive); 
 	void drawIndexedMesh(const GLuint mesh, const GLuint indexCount, const GLuint primitive);
+	// as drawIndexedMesh, with mesh's VAO already bound by the caller - and left bound
+	void drawBoundIndexedMesh(const GLuint mesh, const GLuint indexCount, const GLuint primitive);
+	// Instancing: a buffer of model matrices, with room for maxInstances to start with, fed to RT3D_INSTANCE_MATRIX
+	// one matrix per instance
+	GLuint createInstanceBuffer(const GLuint maxInstances);
+	// replace the matrices with count new ones (16 floats each, column major); the old storage is orphaned, not waited for
+	void updateInstanceBuffer(const GLuint buffer, const GLfloat *matrices, const GLuint count);
+	// draw instances copies of mesh, instance i with matrix i of instanceBuffer
+	void drawIndexedMeshInstanced(const GLuint mesh, const GLuint indexCount, const GLuint primitive, const GLuint instanceBuffer,
+		const GLuint instances);
+	// as above, with mesh's VAO already bound by the caller - and left bound
+	void drawBoundIndexedMeshInstanced(const GLuint mesh, const GLuint indexCount, const GLuint primitive, const GLuint instanceBuffer,
+		const GLuint instances);
+	// draw calls made through drawMesh, drawIndexedMesh and the other draw functions since the last resetDrawCalls
+	GLuint getDrawCalls();
+	void resetDrawCalls();
 
 	void updateMesh(const GLuint mesh, const unsigned int bufferType, const GLfloat *data, const GLuint size);
 }
@@ -0,0 +1,170 @@
+#include "rt3dLightClusters.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#if defined(_M_X64) || defined(__x86_64__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2) || defined(__SSE2__)
+#define RT3D_CLUSTERS_SSE2
+#include <emmintrin.h>
+#endif
+
+#define SLICE_CLUSTERS (RT3D_CLUSTERS_X * RT3D_CLUSTERS_Y)
+static_assert(SLICE_CLUSTERS % 4 == 0, "a slice's clusters are tested four at a time");
+static_assert(sizeof(rt3d::clusterLight) == 8 * sizeof(GLfloat), "a cluster light must be exactly two RGBA32F texels");
+
+using namespace std;
+
+namespace rt3d {
+
+GLfloat clusterSliceScale(const clusterGrid &grid) {
+	return RT3D_CLUSTERS_Z / log(grid.farPlane / grid.nearPlane);
+}
+
+void createClusterGrid(clusterGrid &grid, const GLfloat nearPlane, const GLfloat farPlane) {
+	grid.nearPlane = nearPlane;
+	grid.farPlane = farPlane;
+	memset(grid.projection, 0, sizeof(grid.projection)); // no projection - the boxes are built on first use
+	for (int axis = 0; axis < 3; axis++) {
+		grid.boxMin[axis].assign(RT3D_CLUSTER_COUNT, 0.0f);
+		grid.boxMax[axis].assign(RT3D_CLUSTER_COUNT, 0.0f);
+	}
+	grid.lists.assign(2 * RT3D_CLUSTER_COUNT, 0);
+	grid.lightCount = grid.listedLights = grid.droppedLights = 0;
+
+	GLuint buffers[2], textures[2];
+	glGenBuffers(2, buffers);
+	glGenTextures(2, textures);
+	grid.lightBuffer = buffers[0];
+	grid.listBuffer = buffers[1];
+	grid.lightTexture = textures[0];
+	grid.listTexture = textures[1];
+	glBindTexture(GL_TEXTURE_BUFFER, grid.lightTexture);
+	glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, grid.lightBuffer);
+	glBindTexture(GL_TEXTURE_BUFFER, grid.listTexture);
+	glTexBuffer(GL_TEXTURE_BUFFER, GL_R32UI, grid.listBuffer);
+	glBindTexture(GL_TEXTURE_BUFFER, 0);
+	uploadClusters(grid, nullptr);
+}
+
+// view space box around each cluster's piece of the frustum
+static void buildClusterBoxes(clusterGrid &grid, const glm::mat4 &projection) {
+	const glm::mat4 inverse = glm::inverse(projection);
+	const float depthRatio = grid.farPlane / grid.nearPlane;
+	for (int z = 0; z < RT3D_CLUSTERS_Z; z++) {
+		const float depths[2] = { grid.nearPlane * pow(depthRatio, float(z) / RT3D_CLUSTERS_Z),
+			grid.nearPlane * pow(depthRatio, float(z + 1) / RT3D_CLUSTERS_Z) };
+		for (int y = 0; y < RT3D_CLUSTERS_Y; y++) {
+			for (int x = 0; x < RT3D_CLUSTERS_X; x++) {
+				const int cluster = (z * RT3D_CLUSTERS_Y + y) * RT3D_CLUSTERS_X + x;
+				for (int corner = 0; corner < 8; corner++) {
+					// the ray through this corner of the tile, scaled to view depth 1, then out to the slice's near or far depth
+					glm::vec4 ndc(2.0f * (x + (corner & 1)) / RT3D_CLUSTERS_X - 1.0f, 2.0f * (y + ((corner >> 1) & 1)) / RT3D_CLUSTERS_Y - 1.0f, -1.0f, 1.0f);
+					glm::vec4 p = inverse * ndc;
+					glm::vec3 point = glm::vec3(p) / -p.z * depths[corner >> 2];
+					for (int axis = 0; axis < 3; axis++) {
+						grid.boxMin[axis][cluster] = corner ? min(grid.boxMin[axis][cluster], point[axis]) : point[axis];
+						grid.boxMax[axis][cluster] = corner ? max(grid.boxMax[axis][cluster], point[axis]) : point[axis];
+					}
+				}
+			}
+		}
+	}
+	memcpy(grid.projection, &projection[0][0], sizeof(grid.projection));
+}
+
+// add a hit for every cluster of the slice starting at cluster first that the sphere (view space centre c, radius r) reaches
+static void binSlice(clusterGrid &grid, const GLuint first, const glm::vec3 &c, const float r, const GLuint light) {
+	const float *lo[3] = { &grid.boxMin[0][first], &grid.boxMin[1][first], &grid.boxMin[2][first] };
+	const float *hi[3] = { &grid.boxMax[0][first], &grid.boxMax[1][first], &grid.boxMax[2][first] };
+#ifdef RT3D_CLUSTERS_SSE2
+	const __m128 centre[3] = { _mm_set1_ps(c.x), _mm_set1_ps(c.y), _mm_set1_ps(c.z) };
+	const __m128 radius2 = _mm_set1_ps(r * r);
+	const __m128 zero = _mm_setzero_ps();
+	for (GLuint i = 0; i < SLICE_CLUSTERS; i += 4) {
+		// squared distance from the centre to each box: per axis, how far the centre is outside it
+		__m128 distance2 = zero;
+		for (int axis = 0; axis < 3; axis++) {
+			__m128 below = _mm_sub_ps(_mm_loadu_ps(lo[axis] + i), centre[axis]);
+			__m128 above = _mm_sub_ps(centre[axis], _mm_loadu_ps(hi[axis] + i));
+			__m128 outside = _mm_max_ps(_mm_max_ps(below, above), zero);
+			distance2 = _mm_add_ps(distance2, _mm_mul_ps(outside, outside));
+		}
+		int reached = _mm_movemask_ps(_mm_cmple_ps(distance2, radius2));
+		for (GLuint lane = 0; reached; lane++, reached >>= 1) {
+			if (reached & 1) {
+				grid.hits.push_back(first + i + lane);
+				grid.hits.push_back(light);
+			}
+		}
+	}
+#else
+	for (GLuint i = 0; i < SLICE_CLUSTERS; i++) {
+		float distance2 = 0.0f;
+		for (int axis = 0; axis < 3; axis++) {
+			float outside = max(max(lo[axis][i] - c[axis], c[axis] - hi[axis][i]), 0.0f);
+			distance2 += outside * outside;
+		}
+		if (distance2 <= r * r) {
+			grid.hits.push_back(first + i);
+			grid.hits.push_back(light);
+		}
+	}
+#endif
+}
+
+void binClusterLights(clusterGrid &grid, const clusterLight *lights, const GLuint count, const glm::mat4 &view, const glm::mat4 &projection) {
+	if (memcmp(grid.projection, &projection[0][0], sizeof(grid.projection)) != 0)
+		buildClusterBoxes(grid, projection);
+	grid.lightCount = min(count, (GLuint) RT3D_CLUSTER_MAX_LIGHTS);
+	grid.hits.clear();
+	const float sliceScale = clusterSliceScale(grid);
+	for (GLuint light = 0; light < grid.lightCount; light++) {
+		const glm::vec3 c = glm::vec3(view * glm::vec4(lights[light].position, 1.0f));
+		const float r = lights[light].radius;
+		const float depth = -c.z;
+		if (depth + r < grid.nearPlane || depth - r > grid.farPlane)
+			continue;
+		// only the slices the sphere's depth range spans can be reached
+		int first = (int) (log(max(depth - r, grid.nearPlane) / grid.nearPlane) * sliceScale);
+		int last = (int) (log(min(depth + r, grid.farPlane) / grid.nearPlane) * sliceScale);
+		first = max(first, 0);
+		last = min(last, RT3D_CLUSTERS_Z - 1);
+		for (int z = first; z <= last; z++)
+			binSlice(grid, z * SLICE_CLUSTERS, c, r, light);
+	}
+
+	// count each cluster's lights, give each cluster its run of the index list, then fill the runs in
+	vector<GLuint> &lists = grid.lists;
+	lists.assign(2 * RT3D_CLUSTER_COUNT, 0);
+	for (size_t h = 0; h < grid.hits.size(); h += 2)
+		lists[2 * grid.hits[h] + 1]++;
+	GLuint offset = 2 * RT3D_CLUSTER_COUNT;
+	const GLuint end = offset + RT3D_CLUSTER_MAX_INDICES;
+	grid.droppedLights = 0;
+	for (GLuint cluster = 0; cluster < RT3D_CLUSTER_COUNT; cluster++) {
+		GLuint fits = min(lists[2 * cluster + 1], end - offset);
+		grid.droppedLights += lists[2 * cluster + 1] - fits;
+		lists[2 * cluster] = offset;
+		lists[2 * cluster + 1] = fits;
+		offset += fits;
+	}
+	grid.listedLights = offset - 2 * RT3D_CLUSTER_COUNT;
+	lists.resize(offset);
+	vector<GLuint> filled(RT3D_CLUSTER_COUNT, 0);
+	for (size_t h = 0; h < grid.hits.size(); h += 2) {
+		GLuint cluster = grid.hits[h];
+		if (filled[cluster] < lists[2 * cluster + 1])
+			lists[lists[2 * cluster] + filled[cluster]++] = grid.hits[h + 1];
+	}
+}
+
+void uploadClusters(const clusterGrid &grid, const clusterLight *lights) {
+	// new storage every frame, as updateUniformBuffer does, so draws still reading the old lists don't stall us
+	glBindBuffer(GL_TEXTURE_BUFFER, grid.lightBuffer);
+	glBufferData(GL_TEXTURE_BUFFER, grid.lightCount * sizeof(clusterLight), lights, GL_STREAM_DRAW);
+	glBindBuffer(GL_TEXTURE_BUFFER, grid.listBuffer);
+	glBufferData(GL_TEXTURE_BUFFER, grid.lists.size() * sizeof(GLuint), grid.lists.data(), GL_STREAM_DRAW);
+	glBindBuffer(GL_TEXTURE_BUFFER, 0);
+}
+
+}
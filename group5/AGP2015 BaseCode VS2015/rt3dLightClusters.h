@@ -0,0 +1,66 @@
+// rt3dLightClusters.h
+// Clustered culling of point lights, for forward shading with many lights
+//
+// The view frustum is cut into RT3D_CLUSTERS_X x RT3D_CLUSTERS_Y tiles across the screen and RT3D_CLUSTERS_Z
+// slices in depth, spaced exponentially so clusters stay about as deep as they are wide. Every frame each light's
+// sphere of influence is tested against the clusters of the slices it spans (with SSE2, four clusters at a time),
+// and every cluster gets a list of the lights that reach it. A fragment shader finds its cluster from its view
+// space position and shades only the lights on that list.
+//
+// Both go to the GPU as buffer textures: the lights as two RGBA32F texels each (position and radius, then colour),
+// the lists as one R32UI buffer - an offset and a count per cluster, then the light indices they point into.
+//
+// Limitations:
+// Clusters are tested as view space boxes around their piece of the frustum, so a light can be listed for a cluster
+// it only just misses (never left off one it reaches). The lists hold at most RT3D_CLUSTER_MAX_INDICES indices in
+// all, to stay within the smallest GL_MAX_TEXTURE_BUFFER_SIZE GL allows; past that, lights are left off and counted.
+#ifndef RT3D_LIGHT_CLUSTERS
+#define RT3D_LIGHT_CLUSTERS
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+#include <vector>
+
+#define RT3D_CLUSTERS_X 16
+#define RT3D_CLUSTERS_Y 9
+#define RT3D_CLUSTERS_Z 24
+#define RT3D_CLUSTER_COUNT (RT3D_CLUSTERS_X * RT3D_CLUSTERS_Y * RT3D_CLUSTERS_Z)
+#define RT3D_CLUSTER_MAX_INDICES (65536 - 2 * RT3D_CLUSTER_COUNT)
+#define RT3D_CLUSTER_MAX_LIGHTS 1024
+
+namespace rt3d {
+
+	// an unshadowed point light, lighting nothing beyond radius - laid out as its two texels
+	struct clusterLight {
+		glm::vec3 position;	// world space
+		GLfloat radius;
+		glm::vec3 colour;
+		GLfloat pad;
+	};
+
+	struct clusterGrid {
+		GLfloat nearPlane, farPlane;	// view depths the slices cover
+		GLfloat projection[16];			// the boxes were built for
+		// each cluster's view space box, cluster (z * RT3D_CLUSTERS_Y + y) * RT3D_CLUSTERS_X + x
+		std::vector<GLfloat> boxMin[3], boxMax[3];
+		std::vector<GLuint> hits;		// cluster and light pairs found by the last binClusterLights
+		std::vector<GLuint> lists;		// offset and count per cluster, then the light indices
+		GLuint lightCount;				// lights binned
+		GLuint listedLights;			// light indices in the lists
+		GLuint droppedLights;			// and left off them, for want of room
+		GLuint lightBuffer, lightTexture, listBuffer, listTexture;
+	};
+
+	// an empty grid over view depths nearPlane to farPlane, and its buffer textures
+	void createClusterGrid(clusterGrid &grid, const GLfloat nearPlane, const GLfloat farPlane);
+	// List, for every cluster of the camera given by view and projection, which of count lights reach it.
+	// Lights past RT3D_CLUSTER_MAX_LIGHTS are ignored. Does not need a GL context.
+	void binClusterLights(clusterGrid &grid, const clusterLight *lights, const GLuint count, const glm::mat4 &view, const glm::mat4 &projection);
+	// write the lights binClusterLights was given, and the lists it made, to the grid's buffer textures
+	void uploadClusters(const clusterGrid &grid, const clusterLight *lights);
+	// slices per unit of log depth - view depth d is in slice floor(log(d / nearPlane) * clusterSliceScale(grid))
+	GLfloat clusterSliceScale(const clusterGrid &grid);
+
+}
+
+#endif
@@ -0,0 +1,369 @@
+// rt3dMeshCache.cpp
+// Binary mesh cache (.rt3dmesh) for OBJ models - see rt3dMeshCache.h
+#include "rt3dMeshCache.h"
+#include "rt3d.h"
+#include "rt3dObjLoader.h"
+#include <glm/glm.hpp>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <cstdio>
+#include <cstddef>
+#include <cstring>
+#include <cstdint>
+#include <iostream>
+
+namespace rt3d {
+
+	// File layout: this header, then the vertex data at vertexOffset, laid out as layout says, then the indices at indexOffset
+	struct meshCacheHeader {
+		char magic[4];				// "R3DM"
+		uint32_t version;
+		uint32_t attributes;		// mask of (1 << RT3D_VERTEX) etc
+		uint32_t format;			// RT3D_FORMAT_ layout the vertices and indices were stored in
+		uint32_t stride;			// bytes per vertex
+		uint32_t layout[6][4];		// each attribute's vertexAttribute: type, components, normalized, offset
+		uint32_t indexType;			// GL_UNSIGNED_SHORT or GL_UNSIGNED_INT
+		uint32_t vertexCount;
+		uint32_t indexCount;
+		uint64_t sourceSize;		// size, timestamp and hash of the file the cache was built from
+		int64_t sourceTime;
+		uint64_t sourceHash;
+		float boundsMin[3];
+		float boundsMax[3];
+		uint32_t vertexOffset;
+		uint32_t indexOffset;
+	};
+
+	static const char meshCacheMagic[4] = { 'R', '3', 'D', 'M' };
+
+	static bool sourceStats(const char *fname, uint64_t &size, int64_t &time) {
+		struct stat st;
+		if (stat(fname, &st) != 0)
+			return false;
+		size = (uint64_t) st.st_size;
+		time = (int64_t) st.st_mtime;
+		return true;
+	}
+
+	// 64 bit FNV-1a hash of the whole file
+	static bool hashFile(const char *fname, uint64_t &hash) {
+		mappedFile file;
+		if (!mapFile(fname, file))
+			return false;
+		const unsigned char *p = (const unsigned char *) file.data;
+		uint64_t h = 14695981039346656037ULL;
+		for (size_t i = 0; i < file.size; i++) {
+			h ^= p[i];
+			h *= 1099511628211ULL;
+		}
+		unmapFile(file);
+		hash = h;
+		return true;
+	}
+
+	void calculateTangents(std::vector<GLfloat> &tangents, const std::vector<GLfloat> &verts, const std::vector<GLfloat> &normals,
+		const std::vector<GLfloat> &tex_coords, const std::vector<GLuint> &indices) {
+
+		// Code taken from http://www.terathon.com/code/tangent.html and modified slightly to use vectors instead of arrays
+		// Lengyel, Eric. "Computing Tangent Space Basis Vectors for an Arbitrary Mesh". Terathon Software 3D Graphics Library, 2001.
+
+		// This is a little messy because my vectors are of type GLfloat:
+		// should have made them glm::vec2 and glm::vec3 - life, would be much easier!
+
+		std::vector<glm::vec3> tan1(verts.size() / 3, glm::vec3(0.0f));
+		std::vector<glm::vec3> tan2(verts.size() / 3, glm::vec3(0.0f));
+		for (size_t c = 0; c < indices.size(); c += 3)
+		{
+			int i1 = indices[c];
+			int i2 = indices[c + 1];
+			int i3 = indices[c + 2];
+
+			glm::vec3 v1(verts[i1 * 3], verts[i1 * 3 + 1], verts[i1 * 3 + 2]);
+			glm::vec3 v2(verts[i2 * 3], verts[i2 * 3 + 1], verts[i2 * 3 + 2]);
+			glm::vec3 v3(verts[i3 * 3], verts[i3 * 3 + 1], verts[i3 * 3 + 2]);
+
+			glm::vec2 w1(tex_coords[i1 * 2], tex_coords[i1 * 2 + 1]);
+			glm::vec2 w2(tex_coords[i2 * 2], tex_coords[i2 * 2 + 1]);
+			glm::vec2 w3(tex_coords[i3 * 2], tex_coords[i3 * 2 + 1]);
+
+			float x1 = v2.x - v1.x;
+			float x2 = v3.x - v1.x;
+			float y1 = v2.y - v1.y;
+			float y2 = v3.y - v1.y;
+			float z1 = v2.z - v1.z;
+			float z2 = v3.z - v1.z;
+
+			float s1 = w2.x - w1.x;
+			float s2 = w3.x - w1.x;
+			float t1 = w2.y - w1.y;
+			float t2 = w3.y - w1.y;
+
+			float r = 1.0F / (s1 * t2 - s2 * t1);
+			glm::vec3 sdir((t2 * x1 - t1 * x2) * r, (t2 * y1 - t1 * y2) * r,
+				(t2 * z1 - t1 * z2) * r);
+			glm::vec3 tdir((s1 * x2 - s2 * x1) * r, (s1 * y2 - s2 * y1) * r,
+				(s1 * z2 - s2 * z1) * r);
+
+			tan1[i1] += sdir;
+			tan1[i2] += sdir;
+			tan1[i3] += sdir;
+
+			tan2[i1] += tdir;
+			tan2[i2] += tdir;
+			tan2[i3] += tdir;
+		}
+
+		for (size_t a = 0; a < verts.size(); a += 3)
+		{
+			glm::vec3 n(normals[a], normals[a + 1], normals[a + 2]);
+			glm::vec3 t = tan1[a / 3];
+
+			glm::vec3 tangent;
+			tangent = (t - n * glm::normalize(glm::dot(n, t)));
+
+			// handedness
+			GLfloat w = (glm::dot(glm::cross(n, t), tan2[a / 3]) < 0.0f) ? -1.0f : 1.0f;
+
+			tangents.push_back(tangent.x);
+			tangents.push_back(tangent.y);
+			tangents.push_back(tangent.z);
+			tangents.push_back(w);
+		}
+	}
+
+	std::string meshCacheName(const char *objFile) {
+		std::string name(objFile);
+		size_t dot = name.rfind('.');
+		size_t slash = name.find_last_of("/\\");
+		if (dot != std::string::npos && (slash == std::string::npos || dot > slash))
+			name.erase(dot);
+		return name + ".rt3dmesh";
+	}
+
+	static GLuint indexSize(const meshCacheHeader *header) {
+		return header->indexType == GL_UNSIGNED_SHORT ? sizeof(GLushort) : sizeof(GLuint);
+	}
+
+	// Parse objFile and build the complete cache file contents in memory, stored in format
+	static bool buildMeshCache(const char *objFile, std::vector<char> &blob, const GLuint format) {
+		std::vector<GLfloat> verts;
+		std::vector<GLfloat> norms;
+		std::vector<GLfloat> tex_coords;
+		std::vector<GLuint> indices;
+		loadObj(objFile, verts, norms, tex_coords, indices, 0);
+		if (verts.empty())
+			return false;
+
+		GLuint vertexCount = GLuint(verts.size() / 3);
+		bool hasNormals = norms.size() == verts.size();
+		bool hasTexcoords = tex_coords.size() / 2 == vertexCount;
+		// tangents need both normals and texture coordinates
+		std::vector<GLfloat> tangents;
+		if (hasNormals && hasTexcoords && !indices.empty())
+			calculateTangents(tangents, verts, norms, tex_coords, indices);
+
+		meshCacheHeader header;
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, meshCacheMagic, 4);
+		header.version = RT3D_MESH_CACHE_VERSION;
+		header.attributes = (1 << RT3D_VERTEX);
+		if (hasNormals) header.attributes |= (1 << RT3D_NORMAL);
+		if (hasTexcoords) header.attributes |= (1 << RT3D_TEXCOORD);
+		if (!tangents.empty()) header.attributes |= (1 << RT3D_TANGENT);
+		header.format = format;
+		header.vertexCount = vertexCount;
+		header.indexCount = GLuint(indices.size());
+		if (!sourceStats(objFile, header.sourceSize, header.sourceTime) || !hashFile(objFile, header.sourceHash))
+			return false;
+
+		for (int c = 0; c < 3; c++) {
+			header.boundsMin[c] = verts[c];
+			header.boundsMax[c] = verts[c];
+		}
+		for (size_t v = 0; v < verts.size(); v += 3)
+			for (int c = 0; c < 3; c++) {
+				if (verts[v + c] < header.boundsMin[c]) header.boundsMin[c] = verts[v + c];
+				if (verts[v + c] > header.boundsMax[c]) header.boundsMax[c] = verts[v + c];
+			}
+
+		// interleave in the order createInterleavedMesh expects, then store that as format lays it out, so loading
+		// is just the upload
+		std::vector<GLfloat> interleaved;
+		interleaved.reserve(vertexCount * interleavedStride(header.attributes) / sizeof(GLfloat));
+		for (GLuint v = 0; v < vertexCount; v++) {
+			interleaved.insert(interleaved.end(), &verts[v * 3], &verts[v * 3] + 3);
+			if (hasNormals)
+				interleaved.insert(interleaved.end(), &norms[v * 3], &norms[v * 3] + 3);
+			if (hasTexcoords)
+				interleaved.insert(interleaved.end(), &tex_coords[v * 2], &tex_coords[v * 2] + 2);
+			if (!tangents.empty())
+				interleaved.insert(interleaved.end(), &tangents[v * 4], &tangents[v * 4] + 4);
+		}
+		vertexLayout layout;
+		std::vector<unsigned char> vertexData;
+		layOutVertices(vertexCount, interleaved.data(), header.attributes, format, layout, vertexData);
+		header.stride = layout.stride;
+		for (int a = 0; a < 6; a++) {
+			header.layout[a][0] = layout.attributes[a].type;
+			header.layout[a][1] = (uint32_t) layout.attributes[a].components;
+			header.layout[a][2] = layout.attributes[a].normalized;
+			header.layout[a][3] = layout.attributes[a].offset;
+		}
+		header.indexType = (format & RT3D_FORMAT_SHORT_INDEX) && vertexCount <= 0x10000 ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
+		header.vertexOffset = (sizeof(meshCacheHeader) + 15) & ~15u;
+		header.indexOffset = (header.vertexOffset + (uint32_t) vertexData.size() + 3) & ~3u;
+
+		blob.assign(header.indexOffset + indices.size() * indexSize(&header), 0);
+		memcpy(blob.data(), &header, sizeof(header));
+		memcpy(blob.data() + header.vertexOffset, vertexData.data(), vertexData.size());
+		if (header.indexType == GL_UNSIGNED_SHORT) {
+			std::vector<GLushort> shortIndices(indices.begin(), indices.end());
+			memcpy(blob.data() + header.indexOffset, shortIndices.data(), shortIndices.size() * sizeof(GLushort));
+		}
+		else if (!indices.empty())
+			memcpy(blob.data() + header.indexOffset, indices.data(), indices.size() * sizeof(GLuint));
+		return true;
+	}
+
+	static bool writeBlob(const char *cacheFile, const std::vector<char> &blob) {
+		FILE *fp = fopen(cacheFile, "wb");
+		if (!fp)
+			return false;
+		bool ok = fwrite(blob.data(), 1, blob.size(), fp) == blob.size();
+		ok = (fclose(fp) == 0) && ok;
+		if (!ok)
+			remove(cacheFile); // don't leave a truncated cache behind
+		return ok;
+	}
+
+	bool bakeMesh(const char *objFile, const char *cacheFile, const GLuint format) {
+		std::vector<char> blob;
+		if (!buildMeshCache(objFile, blob, format)) {
+			std::cout << "Unable to bake " << objFile << std::endl;
+			return false;
+		}
+		if (!writeBlob(cacheFile, blob)) {
+			std::cout << "Unable to write " << cacheFile << std::endl;
+			return false;
+		}
+		std::cout << "baked " << objFile << " to " << cacheFile << " (" << blob.size() << " bytes)" << std::endl;
+		return true;
+	}
+
+	// true if data is a complete cache of the current version that still matches objFile. The source is only hashed
+	// when its timestamp has changed; restamp is set if the hash still matched, so the cache can take the new one.
+	static bool validCache(const char *data, size_t size, const char *objFile, const GLuint format, bool &restamp) {
+		restamp = false;
+		if (size < sizeof(meshCacheHeader))
+			return false;
+		const meshCacheHeader *header = (const meshCacheHeader *) data;
+		if (memcmp(header->magic, meshCacheMagic, 4) != 0 || header->version != RT3D_MESH_CACHE_VERSION
+			|| header->format != format)
+			return false;
+		if (header->stride == 0 || header->layout[RT3D_VERTEX][1] == 0 || header->vertexOffset < sizeof(meshCacheHeader)
+			|| header->indexOffset < header->vertexOffset
+			|| (uint64_t) header->indexOffset - header->vertexOffset < (uint64_t) header->vertexCount * header->stride
+			|| (uint64_t) header->indexOffset + (uint64_t) header->indexCount * indexSize(header) > size)
+			return false;
+		for (int a = 0; a < 6; a++)
+			if (header->layout[a][1] > 4 || header->layout[a][3] >= header->stride)
+				return false;
+
+		uint64_t sourceSize;
+		int64_t sourceTime;
+		if (!sourceStats(objFile, sourceSize, sourceTime))
+			return true; // source not shipped: the cache was baked ahead of time
+		if (sourceSize != header->sourceSize)
+			return false;
+		if (sourceTime == header->sourceTime)
+			return true;
+		// touched (copied, checked out again) but maybe not changed
+		uint64_t sourceHash;
+		restamp = hashFile(objFile, sourceHash) && sourceHash == header->sourceHash;
+		return restamp;
+	}
+
+	// store objFile's current timestamp in cacheFile's header
+	static void restampCache(const char *cacheFile, const char *objFile) {
+		uint64_t sourceSize;
+		int64_t sourceTime;
+		if (!sourceStats(objFile, sourceSize, sourceTime))
+			return;
+		FILE *fp = fopen(cacheFile, "r+b");
+		if (!fp)
+			return;
+		if (fseek(fp, (long) offsetof(meshCacheHeader, sourceTime), SEEK_SET) == 0)
+			fwrite(&sourceTime, sizeof(sourceTime), 1, fp);
+		fclose(fp);
+	}
+
+	static void uploadCache(const char *data, meshInfo &mesh, meshSource *source) {
+		const meshCacheHeader *header = (const meshCacheHeader *) data;
+		vertexLayout layout;
+		layout.stride = header->stride;
+		for (int a = 0; a < 6; a++) {
+			layout.attributes[a].type = header->layout[a][0];
+			layout.attributes[a].components = (GLint) header->layout[a][1];
+			layout.attributes[a].normalized = (GLboolean) header->layout[a][2];
+			layout.attributes[a].offset = header->layout[a][3];
+		}
+		const GLvoid *vertices = data + header->vertexOffset;
+		const GLvoid *indices = header->indexCount ? data + header->indexOffset : nullptr;
+		if (source) {
+			source->attributes = header->attributes;
+			unpackVertices(header->vertexCount, vertices, layout, source->vertices);
+			if (header->indexType == GL_UNSIGNED_SHORT)
+				source->indices.assign((const GLushort *) indices, (const GLushort *) indices + header->indexCount);
+			else
+				source->indices.assign((const GLuint *) indices, (const GLuint *) indices + header->indexCount);
+		}
+		mesh.vertexCount = header->vertexCount;
+		mesh.indexCount = header->indexCount;
+		mesh.attributes = header->attributes;
+		for (int c = 0; c < 3; c++) {
+			mesh.boundsMin[c] = header->boundsMin[c];
+			mesh.boundsMax[c] = header->boundsMax[c];
+		}
+		mesh.vao = createLaidOutMesh(header->vertexCount, vertices, layout, header->indexCount, indices, header->indexType);
+	}
+
+	bool loadMeshCached(const char *objFile, meshInfo &mesh) {
+		return loadMeshCached(objFile, mesh, RT3D_FORMAT_FLOAT);
+	}
+
+	bool loadMeshCached(const char *objFile, meshInfo &mesh, const GLuint format) {
+		return loadMeshCached(objFile, mesh, format, nullptr);
+	}
+
+	bool loadMeshCached(const char *objFile, meshInfo &mesh, const GLuint format, meshSource *source) {
+		memset(&mesh, 0, sizeof(mesh));
+		std::string cacheFile = meshCacheName(objFile);
+
+		mappedFile cache;
+		if (mapFile(cacheFile.c_str(), cache)) {
+			bool restamp;
+			if (validCache(cache.data, cache.size, objFile, format, restamp)) {
+				uploadCache(cache.data, mesh, source);
+				unmapFile(cache);
+				if (restamp)
+					restampCache(cacheFile.c_str(), objFile);
+				std::cout << "mesh " << objFile << " loaded from " << cacheFile << std::endl;
+				return true;
+			}
+			unmapFile(cache);
+			std::cout << "mesh cache " << cacheFile << " is out of date" << std::endl;
+		}
+
+		// no usable cache: parse the source, then save the result for next time
+		std::vector<char> blob;
+		if (!buildMeshCache(objFile, blob, format)) {
+			std::cout << "Unable to load mesh " << objFile << std::endl;
+			return false;
+		}
+		if (!writeBlob(cacheFile.c_str(), blob))
+			std::cout << "Unable to write mesh cache " << cacheFile << std::endl;
+		uploadCache(blob.data(), mesh, source);
+		return true;
+	}
+
+}
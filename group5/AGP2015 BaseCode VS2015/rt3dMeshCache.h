@@ -0,0 +1,59 @@
+// rt3dMeshCache.h
+// Binary mesh cache (.rt3dmesh) for OBJ models
+//
+// The first time a model is loaded it is parsed as normal, tangents are generated, and the
+// result is written next to it as interleaved vertex data + index data + bounds, already packed in
+// the RT3D_FORMAT_ layout it was loaded with. Later runs map that file and upload it with one
+// glBufferData per buffer - no parsing and no work per vertex at all.
+// A cache is used while the source file's size and timestamp still match it, without reading the source; if only the
+// timestamp differs the source is hashed, and a matching hash keeps the cache (taking the new timestamp).
+// If the source file is missing (assets baked ahead of time with -bake) the cache is trusted.
+//
+// Limitations:
+// Data is stored in the machine's byte order (little endian on every platform we ship on). A cache
+// holds one format; loading it in another rebuilds it in that one.
+#ifndef RT3D_MESH_CACHE
+#define RT3D_MESH_CACHE
+
+#include <GL/glew.h>
+#include <vector>
+#include <string>
+
+#define RT3D_MESH_CACHE_VERSION 2
+
+namespace rt3d {
+
+	// everything the application needs to know about a loaded mesh
+	struct meshInfo {
+		GLuint vao;
+		GLuint vertexCount;
+		GLuint indexCount;
+		GLuint attributes;		// mask of (1 << RT3D_VERTEX) etc
+		GLfloat boundsMin[3];
+		GLfloat boundsMax[3];
+	};
+
+	// a mesh's data kept in memory, as the cache holds it: floats interleaved in createInterleavedMesh's order
+	struct meshSource {
+		GLuint attributes;		// mask of (1 << RT3D_VERTEX) etc
+		std::vector<GLfloat> vertices;
+		std::vector<GLuint> indices;
+	};
+
+	void calculateTangents(std::vector<GLfloat> &tangents, const std::vector<GLfloat> &verts, const std::vector<GLfloat> &normals,
+		const std::vector<GLfloat> &tex_coords, const std::vector<GLuint> &indices);
+
+	// cube.obj -> cube.rt3dmesh
+	std::string meshCacheName(const char *objFile);
+	// Parse objFile and write its cache, stored in format, to cacheFile. Does not need a GL context.
+	bool bakeMesh(const char *objFile, const char *cacheFile, const GLuint format);
+	// Load objFile through its cache, (re)building the cache if it's missing or stale, and create its VAO
+	bool loadMeshCached(const char *objFile, meshInfo &mesh);
+	// as above, with the VAO's vertex data stored in the given RT3D_FORMAT_ layout (and the cache stored in it too)
+	bool loadMeshCached(const char *objFile, meshInfo &mesh, const GLuint format);
+	// as above, also copying the mesh's vertices and indices into source (if not nullptr), e.g. for static batching
+	bool loadMeshCached(const char *objFile, meshInfo &mesh, const GLuint format, meshSource *source);
+
+}
+
+#endif
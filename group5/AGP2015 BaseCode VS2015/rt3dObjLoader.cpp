@@ -8,11 +8,21 @@
 // Does not support groups or multiple meshes per file
 // Does not support anything other than very straightforward OBJ models
 // Will not generate normals if the model is missing them - or any other missing data
+//
+// The file is mapped read-only (rt3d::mapFile) and scanned in place: tokens are never
+// copied out into strings or streams, and numbers are converted by the small parsers below
 #include "rt3dObjLoader.h"
 #include "rt3d.h"
 #include <iostream>
-#include <sstream>
-#include <map>
+#include <cstdio>
+#include <cmath>
+#include <chrono>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
 
 #define FORMAT_UNKNOWN 0
 #define FORMAT_V 1
@@ -20,190 +30,686 @@
 #define FORMAT_VTN 3
 #define FORMAT_VN 4
 
+// Files smaller than this are always parsed on the calling thread
+#define OBJ_MIN_CHUNK_SIZE (1 << 20)
+
 namespace rt3d {
-    
+
 	struct position {
 		GLfloat x;
 		GLfloat y;
 		GLfloat z;
 	};
-    
+
 	struct faceIndex {
 		int v;
 		int t;
 		int n;
 	};
-    
-	int determineFaceFormat(std::string fString) {
-		unsigned int delim1 = fString.find('/');
-		if (delim1 == std::string::npos)
-			return FORMAT_V;		
-		unsigned int delim2 = fString.rfind('/');
-		if (delim1 == delim2)
-			return FORMAT_VT;
-		if (delim2 == (delim1+1))
-			return FORMAT_VN;
-		return FORMAT_VTN;
-	}
-    
-	faceIndex getFace(std::string fString, int fFormat) {
-		// still need to sort out how to handle v/t properly, as well as v//n
-		int delim1 = fString.find('/');
-		int delim2 = fString.rfind('/');
-		
-		std::string vstr = fString.substr(0, delim1);
-		std::stringstream buffer;
-		if ( fFormat == FORMAT_VT ) {
-			// v/t format
-			std::string tstr = fString.substr(delim1+1, fString.size() );
-			buffer << vstr << " " << tstr << " " << 0 << " ";
+
+	// Open addressing hash table (linear probing) from a face corner to its output vertex index
+	// The corner's v/t/n indices are stored inline in the slot, so a lookup never allocates
+	// and is usually a single cache line access
+	class vertexIndexTable {
+	public:
+		// expected is an estimate of the number of unique corners; the table grows if it's exceeded
+		vertexIndexTable(size_t expected) : count(0) {
+			size_t capacity = 16;
+			while (capacity < expected * 2)
+				capacity *= 2;
+			slots.assign(capacity, emptySlot());
+			mask = capacity - 1;
 		}
-		else {
-			// v/t/n format or v//n format
-			std::string nstr = fString.substr(delim2+1, fString.size()-delim2 );
-			if ( fFormat == FORMAT_VTN ) {
-				std::string tstr = fString.substr(delim1+1, delim2-(delim1+1) );
-				buffer << vstr << " " << tstr << " " << nstr << " ";
+		// returns the index already stored for f, or stores and returns newIndex if f is new
+		GLuint findOrInsert(const faceIndex &f, GLuint newIndex) {
+			size_t i = hash(f) & mask;
+			while (slots[i].index != EMPTY_SLOT) {
+				if (slots[i].key.v == f.v && slots[i].key.t == f.t && slots[i].key.n == f.n)
+					return slots[i].index;
+				i = (i + 1) & mask;
+			}
+			slots[i].key = f;
+			slots[i].index = newIndex;
+			if (++count * 2 > slots.size())
+				grow();
+			return newIndex;
+		}
+		static size_t hash(const faceIndex &f) {
+			unsigned long long h = (unsigned long long) (unsigned int) f.v * 0x9E3779B97F4A7C15ULL;
+			h ^= (unsigned long long) (unsigned int) f.t * 0xC2B2AE3D27D4EB4FULL;
+			h ^= (unsigned long long) (unsigned int) f.n * 0x165667B19E3779F9ULL;
+			return (size_t) (h ^ (h >> 32));
+		}
+	private:
+		static const GLuint EMPTY_SLOT = 0xFFFFFFFF;
+		struct slot {
+			faceIndex key;
+			GLuint index;
+		};
+		std::vector<slot> slots;
+		size_t mask;
+		size_t count;
+
+		static slot emptySlot() {
+			slot s;
+			s.key.v = s.key.t = s.key.n = 0;
+			s.index = EMPTY_SLOT;
+			return s;
+		}
+		void grow() {
+			std::vector<slot> old(slots.size() * 2, emptySlot());
+			old.swap(slots);
+			mask = slots.size() - 1;
+			for (size_t j = 0; j < old.size(); j++) {
+				if (old[j].index == EMPTY_SLOT)
+					continue;
+				size_t i = hash(old[j].key) & mask;
+				while (slots[i].index != EMPTY_SLOT)
+					i = (i + 1) & mask;
+				slots[i] = old[j];
+			}
+		}
+	};
+
+	static const double powersOf10[] = {
+		1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+		1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+	};
+
+	// spaces within a line - newlines are handled by skipLine
+	static inline bool isSpace(char c) {
+		return c == ' ' || c == '\t' || c == '\r';
+	}
+
+	static inline bool isDigit(char c) {
+		return c >= '0' && c <= '9';
+	}
+
+	static inline const char* skipSpaces(const char *p, const char *end) {
+		while (p < end && isSpace(*p))
+			p++;
+		return p;
+	}
+
+	// returns the start of the next line
+	static inline const char* skipLine(const char *p, const char *end) {
+		while (p < end && *p != '\n')
+			p++;
+		return (p < end) ? p + 1 : end;
+	}
+
+	// true if p is the end of the current token
+	static inline bool tokenEnd(const char *p, const char *end) {
+		return p >= end || isSpace(*p) || *p == '\n';
+	}
+
+	// Parse a decimal float such as -1.25e-3 starting at p
+	// Up to 19 significant digits are gathered in an integer and scaled once at the end,
+	// which is much faster than operator>> and plenty accurate for vertex data
+	static const char* parseFloat(const char *p, const char *end, GLfloat &value) {
+		p = skipSpaces(p, end);
+		bool negative = false;
+		if (p < end && (*p == '-' || *p == '+')) {
+			negative = (*p == '-');
+			p++;
+		}
+		unsigned long long mantissa = 0;
+		int digits = 0;
+		int exponent = 0;
+		while (p < end && isDigit(*p)) {
+			if (digits < 19) {
+				mantissa = mantissa * 10 + (*p - '0');
+				if (mantissa != 0) digits++;
 			}
 			else
-				buffer << vstr << " " << 0 << " " << nstr << " ";
-		}
-		
-		faceIndex f;
-		buffer >> f.v >> f.t >> f.n;
-		f.v--; f.t--, f.n--;
-		buffer.clear();
-		return f;
-	}
-    
-    
-	void addVertex(std::string fString1, std::map<std::string,GLuint> &indexMap, 
-                   std::vector<position> &inVerts, std::vector<position> &inCoords, std::vector<position> &inNorms, 
-                   std::vector<GLfloat> &verts, std::vector<GLfloat> &texcoords, std::vector<GLfloat> &norms, 
-                   std::vector<GLuint> &indices, int fFormat, int &index) {
-        
-		auto itr = indexMap.find(fString1);
-		if (itr == indexMap.end()) {
-			faceIndex f = getFace(fString1, fFormat);
-			verts.push_back(inVerts[f.v].x);
-			verts.push_back(inVerts[f.v].y);
-			verts.push_back(inVerts[f.v].z);
-			if (fFormat < FORMAT_VN) {
-				texcoords.push_back(inCoords[f.t].x);
-				texcoords.push_back(inCoords[f.t].y);
+				exponent++;
+			p++;
+		}
+		if (p < end && *p == '.') {
+			p++;
+			while (p < end && isDigit(*p)) {
+				if (digits < 19) {
+					mantissa = mantissa * 10 + (*p - '0');
+					if (mantissa != 0) digits++;
+					exponent--;
+				}
+				p++;
 			}
-			if (fFormat > FORMAT_VT) {
-				norms.push_back(inNorms[f.n].x);
-				norms.push_back(inNorms[f.n].y);
-				norms.push_back(inNorms[f.n].z);
+		}
+		if (p < end && (*p == 'e' || *p == 'E')) {
+			p++;
+			bool negativeExp = false;
+			if (p < end && (*p == '-' || *p == '+')) {
+				negativeExp = (*p == '-');
+				p++;
+			}
+			int e = 0;
+			while (p < end && isDigit(*p)) {
+				if (e < 10000) e = e * 10 + (*p - '0');
+				p++;
 			}
-			indexMap.insert(std::pair<std::string, GLuint>(fString1, index)); 
-			indices.push_back(index++);
+			exponent += negativeExp ? -e : e;
 		}
-		else {
-			indices.push_back( itr->second );
+		double result = (double) mantissa;
+		if (mantissa != 0 && exponent != 0) {
+			if (exponent > 0)
+				result *= (exponent <= 22) ? powersOf10[exponent] : std::pow(10.0, exponent);
+			else
+				result /= (-exponent <= 22) ? powersOf10[-exponent] : std::pow(10.0, -exponent);
 		}
+		value = (GLfloat) (negative ? -result : result);
+		return p;
 	}
-    
-    
-    
-	void loadObj(const char* filename, std::vector<GLfloat> &verts, std::vector<GLfloat> &norms,
-                 std::vector<GLfloat> &texcoords, std::vector<GLuint> &indices) {
-        
-		GLint fileLength;
-		char *fileSource = loadFile(filename, fileLength);
-        
-		if (fileLength == 0)
-			// should report error here too
-			return;
-        
-		std::stringstream  fileStream;
-		fileStream << fileSource;
-        
-		char line[256];
-		std::string lineHeader;
-		std::string fString1;
-		std::string fString2;
-		std::string fString3;
-		std::stringstream buffer;
+
+	static const char* parseInt(const char *p, const char *end, int &value) {
+		bool negative = false;
+		if (p < end && (*p == '-' || *p == '+')) {
+			negative = (*p == '-');
+			p++;
+		}
+		int result = 0;
+		while (p < end && isDigit(*p)) {
+			result = result * 10 + (*p - '0');
+			p++;
+		}
+		value = negative ? -result : result;
+		return p;
+	}
+
+	// OBJ indices are 1 based, and negative indices count back from the last element read so far
+	// missing indices (0) become -1
+	static inline int resolveIndex(int index, size_t count) {
+		if (index > 0)
+			return index - 1;
+		if (index < 0)
+			return (int) count + index;
+		return -1;
+	}
+
+	// Parse a single face corner: v, v/t, v//n or v/t/n
+	// Indices are returned exactly as written in the file, format is the layout of this corner
+	static const char* parseFaceCorner(const char *p, const char *end, faceIndex &f, int &format) {
+		p = skipSpaces(p, end);
+		f.v = f.t = f.n = 0;
+		p = parseInt(p, end, f.v);
+		format = FORMAT_V;
+		if (p < end && *p == '/') {
+			p++;
+			if (p < end && *p == '/') {
+				p++;
+				p = parseInt(p, end, f.n);
+				format = FORMAT_VN;
+			}
+			else {
+				p = parseInt(p, end, f.t);
+				format = FORMAT_VT;
+				if (p < end && *p == '/') {
+					p++;
+					p = parseInt(p, end, f.n);
+					format = FORMAT_VTN;
+				}
+			}
+		}
+		// skip anything unexpected left in the token
+		while (!tokenEnd(p, end))
+			p++;
+		return p;
+	}
+
+	// A contiguous run of whole lines from the file, parsed independently of the rest
+	// Face indices are stored resolved against the whole file, except for relative (negative)
+	// indices: these can only be resolved against the data read within the chunk, so their
+	// positions are kept in relative and the chunk's base counts are added once known
+	struct objChunk {
+		const char *begin;
+		const char *end;
 		std::vector<position> inVerts;
-		std::vector<position> inNorms;
 		std::vector<position> inCoords;
-		//std::vector<GLint> indexVector;
-        
-		GLfloat x,y,z;
-		GLint a,b,c;
-        
-		int i=0, iCount = 0;
+		std::vector<position> inNorms;
+		std::vector<faceIndex> corners;
+		std::vector<GLuint> relative;	// corner * 3 + component
+		int format;						// format of the first face in this chunk
+		size_t vertBase;
+		size_t coordBase;
+		size_t normBase;
+		// deduplication, see loadObj
+		std::vector<GLuint> cornerUnique;	// per corner: which of the chunk's unique corners it is
+		std::vector<faceIndex> uniques;		// the chunk's unique corners, in the order they are first used in it
+		std::vector<std::vector<GLuint> > shardUniques;	// uniques by hash shard
+		std::vector<GLuint> ownerChunk;		// per unique: the chunk and unique of its first use in the whole file
+		std::vector<GLuint> ownerUnique;
+		std::vector<GLuint> rank;			// per unique first used in this chunk: its place among those
+		size_t cornerBase;					// corners in the chunks before this one
+		size_t ownedBase;					// unique corners first used in the chunks before this one
+	};
+
+	static inline int resolveChunkIndex(int index, size_t count, objChunk &chunk, int component) {
+		if (index < 0)
+			chunk.relative.push_back(GLuint(chunk.corners.size() * 3 + component));
+		return resolveIndex(index, count);
+	}
+
+	static void parseChunk(objChunk &chunk) {
+		const char *p = chunk.begin;
+		const char *end = chunk.end;
 		position tmp;
-		std::map<std::string,GLuint> indexMap;
-		int fFormat = FORMAT_UNKNOWN;
-        
-		std::cout << "started parsing obj image..." << std::endl;
-        
-		while (fileStream.good()) {
-			//fileStream.getline(line, 256);
-			fileStream >> lineHeader;
-			switch (lineHeader[0]) {
+		faceIndex corner;
+		int cornerFormat;
+		chunk.format = FORMAT_UNKNOWN;
+
+		while (p < end) {
+			p = skipSpaces(p, end);
+			if (p >= end)
+				break;
+			switch (*p) {
                 case 'v':
-                    if ( lineHeader.length() > 1)
-                        switch (lineHeader[1]) {
-                            case 't': 
-                                fileStream >> tmp.x >> tmp.y;
-                                inCoords.push_back(tmp);
-                                break;
-                            case 'n':
-                                fileStream >> tmp.x >> tmp.y >> tmp.z;
-                                inNorms.push_back(tmp);
-                                break;
-                            default:
-                                break;
-                        }
-                    else {
-                        fileStream >> tmp.x >> tmp.y >> tmp.z;
-                        inVerts.push_back(tmp);
+                    if (p + 1 < end && p[1] == 't' && tokenEnd(p + 2, end)) {
+                        p = parseFloat(p + 2, end, tmp.x);
+                        p = parseFloat(p, end, tmp.y);
+                        chunk.inCoords.push_back(tmp);
                     }
-                    break;
-                case 'f':
-                    fileStream >> fString1 >> fString2 >> fString3;
-                    if (!fFormat)
-                        fFormat = determineFaceFormat(fString1);
-                    if (fFormat > FORMAT_V) {
-                        addVertex(fString1, indexMap, inVerts, inCoords, inNorms, verts, texcoords, norms, indices, fFormat, iCount);
-                        addVertex(fString2, indexMap, inVerts, inCoords, inNorms, verts, texcoords, norms, indices, fFormat, iCount);
-                        addVertex(fString3, indexMap, inVerts, inCoords, inNorms, verts, texcoords, norms, indices, fFormat, iCount);
+                    else if (p + 1 < end && p[1] == 'n' && tokenEnd(p + 2, end)) {
+                        p = parseFloat(p + 2, end, tmp.x);
+                        p = parseFloat(p, end, tmp.y);
+                        p = parseFloat(p, end, tmp.z);
+                        chunk.inNorms.push_back(tmp);
                     }
-                    else {
-                        buffer << fString1 << " " << fString2 << " " << fString3;
-                        buffer >> a >> b >> c;
-                        buffer.clear();
-                        indices.push_back(a-1);
-                        indices.push_back(b-1);
-                        indices.push_back(c-1);
+                    else if (tokenEnd(p + 1, end)) {
+                        p = parseFloat(p + 1, end, tmp.x);
+                        p = parseFloat(p, end, tmp.y);
+                        p = parseFloat(p, end, tmp.z);
+                        chunk.inVerts.push_back(tmp);
                     }
                     break;
-                case '#': 
-                    fileStream.getline(line, 256); // ignore line
+                case 'f':
+                    if (!tokenEnd(p + 1, end))
+                        break;
+                    p++;
+                    for (int c = 0; c < 3; c++) {
+                        p = parseFaceCorner(p, end, corner, cornerFormat);
+                        corner.v = resolveChunkIndex(corner.v, chunk.inVerts.size(), chunk, 0);
+                        corner.t = resolveChunkIndex(corner.t, chunk.inCoords.size(), chunk, 1);
+                        corner.n = resolveChunkIndex(corner.n, chunk.inNorms.size(), chunk, 2);
+                        chunk.corners.push_back(corner);
+                    }
+                    if (!chunk.format)
+                        chunk.format = cornerFormat;
                     break;
                 default:
-                    fileStream.getline(line, 256); // ignore line
+                    // comments, groups, materials etc are ignored
+                    break;
+			}
+			p = skipLine(p, end);
+		}
+	}
+
+	// Copy this chunk's attributes into the merged arrays, and rebase its relative indices
+	static void mergeChunk(objChunk &chunk, std::vector<position> &inVerts,
+		std::vector<position> &inCoords, std::vector<position> &inNorms) {
+		std::copy(chunk.inVerts.begin(), chunk.inVerts.end(), inVerts.begin() + chunk.vertBase);
+		std::copy(chunk.inCoords.begin(), chunk.inCoords.end(), inCoords.begin() + chunk.coordBase);
+		std::copy(chunk.inNorms.begin(), chunk.inNorms.end(), inNorms.begin() + chunk.normBase);
+		for (size_t i = 0; i < chunk.relative.size(); i++) {
+			faceIndex &f = chunk.corners[chunk.relative[i] / 3];
+			switch (chunk.relative[i] % 3) {
+				case 0: f.v += (int) chunk.vertBase; break;
+				case 1: f.t += (int) chunk.coordBase; break;
+				default: f.n += (int) chunk.normBase; break;
+			}
+		}
+		// release the chunk's copies as early as possible
+		std::vector<position>().swap(chunk.inVerts);
+		std::vector<position>().swap(chunk.inCoords);
+		std::vector<position>().swap(chunk.inNorms);
+	}
+
+	// Deduplicate the chunk's corners on their own, in the order they are first used in the chunk, and sort its unique
+	// corners into shards by hash for findOwners. Its attributes must already be merged.
+	static void dedupeChunk(objChunk &chunk, size_t expected, GLuint shards) {
+		vertexIndexTable table(expected);
+		chunk.cornerUnique.resize(chunk.corners.size());
+		for (size_t c = 0; c < chunk.corners.size(); c++) {
+			GLuint unique = table.findOrInsert(chunk.corners[c], (GLuint) chunk.uniques.size());
+			if (unique == chunk.uniques.size())
+				chunk.uniques.push_back(chunk.corners[c]);
+			chunk.cornerUnique[c] = unique;
+		}
+		std::vector<faceIndex>().swap(chunk.corners);
+		chunk.ownerChunk.assign(chunk.uniques.size(), 0);
+		chunk.ownerUnique.resize(chunk.uniques.size());
+		for (size_t u = 0; u < chunk.uniques.size(); u++)
+			chunk.ownerUnique[u] = (GLuint) u;
+		chunk.shardUniques.assign(shards, std::vector<GLuint>());
+		if (shards > 1)
+			for (size_t u = 0; u < chunk.uniques.size(); u++) {
+				// the table's own hash, remixed so a shard's corners still spread over every slot of a shard table
+				unsigned long long h = vertexIndexTable::hash(chunk.uniques[u]) * 0xD6E8FEB86659FD93ULL;
+				chunk.shardUniques[(size_t) (((h >> 32) * shards) >> 32)].push_back((GLuint) u);
 			}
-            
+	}
+
+	// For one shard of the unique corners, walk the chunks in file order and point every chunk's copy of a corner at
+	// the first chunk to use it
+	static void findOwners(std::vector<objChunk> &chunks, size_t shard) {
+		size_t expected = 0;
+		for (size_t i = 0; i < chunks.size(); i++)
+			expected += chunks[i].shardUniques[shard].size();
+		vertexIndexTable table(expected);
+		std::vector<GLuint> ownerChunk, ownerUnique;	// by owner, in order of first use
+		for (size_t i = 0; i < chunks.size(); i++) {
+			objChunk &chunk = chunks[i];
+			const std::vector<GLuint> &uniques = chunk.shardUniques[shard];
+			for (size_t j = 0; j < uniques.size(); j++) {
+				GLuint owner = table.findOrInsert(chunk.uniques[uniques[j]], (GLuint) ownerChunk.size());
+				if (owner == ownerChunk.size()) {
+					ownerChunk.push_back((GLuint) i);
+					ownerUnique.push_back(uniques[j]);
+				}
+				chunk.ownerChunk[uniques[j]] = ownerChunk[owner];
+				chunk.ownerUnique[uniques[j]] = ownerUnique[owner];
+			}
+		}
+	}
+
+	// Number the unique corners first used in chunk i in the order they appear in it; returns how many there are
+	static size_t rankOwned(objChunk &chunk, size_t i) {
+		chunk.rank.assign(chunk.uniques.size(), 0);
+		GLuint owned = 0;
+		for (size_t u = 0; u < chunk.uniques.size(); u++)
+			if (chunk.ownerChunk[u] == i && chunk.ownerUnique[u] == u)
+				chunk.rank[u] = owned++;
+		return owned;
+	}
+
+	// Write chunk i's indices, and the attributes of the vertices first used in it, to their places in the output
+	static void fillChunk(std::vector<objChunk> &chunks, size_t i, int fFormat, const std::vector<position> &inVerts,
+		const std::vector<position> &inCoords, const std::vector<position> &inNorms, GLfloat *verts, GLfloat *texcoords,
+		GLfloat *norms, GLuint *indices) {
+		objChunk &chunk = chunks[i];
+		std::vector<GLuint> global(chunk.uniques.size());
+		for (size_t u = 0; u < chunk.uniques.size(); u++) {
+			const objChunk &owner = chunks[chunk.ownerChunk[u]];
+			global[u] = (GLuint) (owner.ownedBase + owner.rank[chunk.ownerUnique[u]]);
+			if (&owner != &chunk || chunk.ownerUnique[u] != u)
+				continue;
+			const faceIndex &f = chunk.uniques[u];
+			GLfloat *v = verts + (size_t) global[u] * 3;
+			v[0] = inVerts[f.v].x; v[1] = inVerts[f.v].y; v[2] = inVerts[f.v].z;
+			if (fFormat < FORMAT_VN) {
+				GLfloat *t = texcoords + (size_t) global[u] * 2;
+				t[0] = inCoords[f.t].x; t[1] = inCoords[f.t].y;
+			}
+			if (fFormat > FORMAT_VT) {
+				GLfloat *n = norms + (size_t) global[u] * 3;
+				n[0] = inNorms[f.n].x; n[1] = inNorms[f.n].y; n[2] = inNorms[f.n].z;
+			}
+		}
+		for (size_t c = 0; c < chunk.cornerUnique.size(); c++)
+			indices[chunk.cornerBase + c] = global[chunk.cornerUnique[c]];
+		std::vector<GLuint>().swap(chunk.cornerUnique);
+	}
+
+	// A fixed set of threads that run each parallel phase of a load, started once for all of them. run hands out
+	// task(0) ... task(count-1) to the workers and the calling thread, and returns once they are all done.
+	class workerPool {
+	public:
+		workerPool(unsigned int threadCount) : count(0), generation(0), busy(0), quit(false) {
+			for (unsigned int t = 1; t < threadCount; t++)
+				workers.push_back(std::thread(&workerPool::work, this));
+		}
+		~workerPool() {
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				quit = true;
+			}
+			wake.notify_all();
+			for (size_t t = 0; t < workers.size(); t++)
+				workers[t].join();
+		}
+		void run(size_t taskCount, const std::function<void(size_t)> &taskFunction) {
+			if (workers.empty() || taskCount <= 1) {
+				for (size_t i = 0; i < taskCount; i++)
+					taskFunction(i);
+				return;
+			}
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				task = &taskFunction;
+				count = taskCount;
+				next = 0;
+				busy = (unsigned int) workers.size();
+				generation++;
+			}
+			wake.notify_all();
+			runTasks();
+			std::unique_lock<std::mutex> lock(mutex);
+			done.wait(lock, [this]() { return busy == 0; });
+			task = nullptr;
+		}
+	private:
+		std::vector<std::thread> workers;
+		std::mutex mutex;
+		std::condition_variable wake, done;
+		const std::function<void(size_t)> *task;
+		size_t count;
+		std::atomic<size_t> next;
+		unsigned int generation;
+		unsigned int busy;
+		bool quit;
+
+		void runTasks() {
+			for (size_t i = next++; i < count; i = next++)
+				(*task)(i);
+		}
+		void work() {
+			unsigned int seen = 0;
+			for (;;) {
+				{
+					std::unique_lock<std::mutex> lock(mutex);
+					wake.wait(lock, [&]() { return quit || generation != seen; });
+					if (quit)
+						return;
+					seen = generation;
+				}
+				runTasks();
+				std::lock_guard<std::mutex> lock(mutex);
+				if (--busy == 0)
+					done.notify_one();
+			}
+		}
+	};
+
+
+	void loadObj(const char* filename, std::vector<GLfloat> &verts, std::vector<GLfloat> &norms,
+                 std::vector<GLfloat> &texcoords, std::vector<GLuint> &indices, unsigned int threadCount) {
+
+		mappedFile file;
+		if (!mapFile(filename, file))
+			// should report error here too
+			return;
+
+		std::chrono::high_resolution_clock::time_point startTime = std::chrono::high_resolution_clock::now();
+
+		if (threadCount == 0)
+			threadCount = std::max(1u, std::thread::hardware_concurrency());
+		// not worth starting threads for small files
+		size_t chunkCount = 1;
+		if (threadCount > 1 && file.size >= OBJ_MIN_CHUNK_SIZE)
+			chunkCount = std::min<size_t>(threadCount * 4, file.size / OBJ_MIN_CHUNK_SIZE);
+
+		std::cout << "started parsing obj image..." << std::endl;
+
+		// split the file into chunks of roughly equal size, moving each split forward to a line start
+		std::vector<objChunk> chunks(chunkCount);
+		const char *end = file.data + file.size;
+		const char *p = file.data;
+		for (size_t i = 0; i < chunkCount; i++) {
+			chunks[i].begin = p;
+			if (i == chunkCount - 1)
+				p = end;
+			else {
+				p = std::max(p, file.data + file.size / chunkCount * (i + 1));
+				p = (p > file.data) ? skipLine(p - 1, end) : p;
+			}
+			chunks[i].end = p;
+		}
+
+		workerPool pool(chunkCount > 1 ? threadCount : 1);
+		pool.run(chunkCount, [&](size_t i) { parseChunk(chunks[i]); });
+
+		// chunk base counts are a running total of everything before it
+		size_t vertCount = 0, coordCount = 0, normCount = 0, cornerCount = 0;
+		int fFormat = FORMAT_UNKNOWN;
+		for (size_t i = 0; i < chunkCount; i++) {
+			chunks[i].vertBase = vertCount;
+			chunks[i].coordBase = coordCount;
+			chunks[i].normBase = normCount;
+			chunks[i].cornerBase = cornerCount;
+			vertCount += chunks[i].inVerts.size();
+			coordCount += chunks[i].inCoords.size();
+			normCount += chunks[i].inNorms.size();
+			cornerCount += chunks[i].corners.size();
+			if (!fFormat)
+				fFormat = chunks[i].format;
 		}
-        
-		// copy vertex data to output vectors in case only single index was provided....
-		if (fFormat == FORMAT_V) {
-			for (int v = 0; v < inVerts.size(); v++) {
+
+		// Deduplicate the corners so that the output is identical whatever the thread count: a vertex is numbered
+		// by where its corner is first used in the file, as a serial walk over every corner would number it.
+		// Each chunk is deduplicated on its own, then each hash shard of the unique corners finds the chunk that
+		// uses each of them first, and a running total of the corners each chunk is first to use places its
+		// vertices in the output - each step in parallel over chunks or shards.
+		// A mesh usually has about as many unique corners as its largest attribute array.
+		const GLuint shards = chunkCount > 1 ? threadCount * 4 : 1;
+		std::vector<position> inVerts(vertCount);
+		std::vector<position> inCoords(coordCount);
+		std::vector<position> inNorms(normCount);
+		pool.run(chunkCount, [&](size_t i) {
+			objChunk &chunk = chunks[i];
+			size_t expected = std::min(chunk.corners.size(),
+				std::max(chunk.inVerts.size(), std::max(chunk.inCoords.size(), chunk.inNorms.size())));
+			mergeChunk(chunk, inVerts, inCoords, inNorms);
+			if (fFormat > FORMAT_V)
+				dedupeChunk(chunk, expected, shards);
+		});
+
+		unmapFile(file);
+
+		const size_t indexBase = indices.size();
+		indices.resize(indexBase + cornerCount);
+		if (fFormat > FORMAT_V) {
+			if (chunkCount > 1)
+				pool.run(shards, [&](size_t shard) { findOwners(chunks, shard); });
+			std::vector<size_t> owned(chunkCount);
+			pool.run(chunkCount, [&](size_t i) { owned[i] = rankOwned(chunks[i], i); });
+			size_t uniqueCount = 0;
+			for (size_t i = 0; i < chunkCount; i++) {
+				chunks[i].ownedBase = uniqueCount;
+				uniqueCount += owned[i];
+			}
+
+			const size_t vertBase = verts.size(), coordBase = texcoords.size(), normBase = norms.size();
+			verts.resize(vertBase + uniqueCount * 3);
+			if (fFormat < FORMAT_VN)
+				texcoords.resize(coordBase + uniqueCount * 2);
+			if (fFormat > FORMAT_VT)
+				norms.resize(normBase + uniqueCount * 3);
+			GLfloat *vertOut = verts.data() + vertBase;
+			GLfloat *coordOut = texcoords.data() + coordBase;
+			GLfloat *normOut = norms.data() + normBase;
+			GLuint *indexOut = indices.data() + indexBase;
+			pool.run(chunkCount, [&](size_t i) {
+				fillChunk(chunks, i, fFormat, inVerts, inCoords, inNorms, vertOut, coordOut, normOut, indexOut);
+			});
+		}
+		else {
+			// copy vertex data to output vectors in case only single index was provided....
+			GLuint *indexOut = indices.data() + indexBase;
+			pool.run(chunkCount, [&](size_t i) {
+				const std::vector<faceIndex> &corners = chunks[i].corners;
+				for (size_t c = 0; c < corners.size(); c++)
+					indexOut[chunks[i].cornerBase + c] = corners[c].v;
+			});
+			verts.reserve(verts.size() + inVerts.size() * 3);
+			for (size_t v = 0; v < inVerts.size(); v++) {
 				verts.push_back(inVerts[v].x);
 				verts.push_back(inVerts[v].y);
-				verts.push_back(inVerts[v].z);			
+				verts.push_back(inVerts[v].z);
 			}
 		}
-        
-		std::cout << "finished parsing obj image..." << std::endl;
-        
-        
+
+		std::chrono::duration<double, std::milli> elapsed = std::chrono::high_resolution_clock::now() - startTime;
+		std::cout << "finished parsing obj image... (" << elapsed.count() << " ms, "
+			<< chunkCount << " chunks)" << std::endl;
+
+
 	}
-    
-    
+
+
+	void loadObj(const char* filename, std::vector<GLfloat> &verts, std::vector<GLfloat> &norms,
+                 std::vector<GLfloat> &texcoords, std::vector<GLuint> &indices) {
+		loadObj(filename, verts, norms, texcoords, indices, 1);
+	}
+
+
+	void generateObj(const char* filename, int gridSize) {
+		FILE *fp = fopen(filename, "wb");
+		if (!fp) {
+			std::cout << "Unable to create file " << filename << std::endl;
+			return;
+		}
+		// slightly bumpy grid so that the vertex data isn't trivially repetitive
+		for (int z = 0; z <= gridSize; z++)
+			for (int x = 0; x <= gridSize; x++)
+				fprintf(fp, "v %f %f %f\n", x / (float) gridSize, 0.05f * std::sin(x * 0.37f + z * 0.11f), z / (float) gridSize);
+		for (int z = 0; z <= gridSize; z++)
+			for (int x = 0; x <= gridSize; x++)
+				fprintf(fp, "vt %f %f\n", x / (float) gridSize, z / (float) gridSize);
+		fprintf(fp, "vn 0.000000 1.000000 0.000000\n");
+		int row = gridSize + 1;
+		for (int z = 0; z < gridSize; z++)
+			for (int x = 0; x < gridSize; x++) {
+				int a = z * row + x + 1;
+				int b = a + 1;
+				int c = a + row;
+				int d = c + 1;
+				fprintf(fp, "f %d/%d/1 %d/%d/1 %d/%d/1\n", a, a, c, c, b, b);
+				fprintf(fp, "f %d/%d/1 %d/%d/1 %d/%d/1\n", b, b, c, c, d, d);
+			}
+		fclose(fp);
+		std::cout << "generated " << filename << ": " << 2LL * gridSize * gridSize << " triangles" << std::endl;
+	}
+
+
+	void benchmarkObj(const char* filename, int runs, unsigned int threadCount) {
+		std::vector<GLfloat> verts;
+		std::vector<GLfloat> norms;
+		std::vector<GLfloat> texcoords;
+		std::vector<GLuint> indices;
+		double total = 0.0;
+		for (int i = 0; i < runs; i++) {
+			verts.clear(); norms.clear(); texcoords.clear(); indices.clear();
+			std::chrono::high_resolution_clock::time_point startTime = std::chrono::high_resolution_clock::now();
+			loadObj(filename, verts, norms, texcoords, indices, threadCount);
+			std::chrono::duration<double, std::milli> elapsed = std::chrono::high_resolution_clock::now() - startTime;
+			total += elapsed.count();
+		}
+		if (indices.empty()) {
+			std::cout << "benchmark: nothing loaded from " << filename << std::endl;
+			return;
+		}
+		double average = total / runs;
+		std::cout << "benchmark " << filename << ": " << threadCount << " threads, " << indices.size() / 3 << " triangles, "
+			<< verts.size() / 3 << " vertices, " << average << " ms per load, "
+			<< (indices.size() / 3) / (average / 1000.0) << " triangles/s" << std::endl;
+	}
+
+
+	void benchmarkObjScaling(const char* filename, int runs, unsigned int maxThreads) {
+		if (maxThreads == 0)
+			maxThreads = std::max(1u, std::thread::hardware_concurrency());
+		for (unsigned int threads = 1; threads <= maxThreads; threads *= 2)
+			benchmarkObj(filename, runs, threads);
+	}
+
+
 }
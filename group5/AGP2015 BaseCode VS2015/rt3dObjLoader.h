@@ -18,6 +18,18 @@ namespace rt3d {
 
 	void loadObj(const char* filename, std::vector<GLfloat> &verts, std::vector<GLfloat> &norms, 
 		std::vector<GLfloat> &texcoords, std::vector<GLuint> &indices);
+	// Parallel version: large files are split at line boundaries and parsed, deduplicated and written out on
+	// threadCount threads (0 uses every core). Output is identical to the serial loader.
+	void loadObj(const char* filename, std::vector<GLfloat> &verts, std::vector<GLfloat> &norms,
+		std::vector<GLfloat> &texcoords, std::vector<GLuint> &indices, unsigned int threadCount);
+
+	// Load time benchmarking
+	// generateObj writes a triangulated v/vt/vn grid with 2*gridSize*gridSize triangles
+	// benchmarkObj loads filename runs times, then reports average load time and triangles/s
+	// benchmarkObjScaling repeats benchmarkObj for 1, 2, 4... up to maxThreads threads
+	void generateObj(const char* filename, int gridSize);
+	void benchmarkObj(const char* filename, int runs, unsigned int threadCount);
+	void benchmarkObjScaling(const char* filename, int runs, unsigned int maxThreads);
 
 }
 
@@ -0,0 +1,128 @@
+#include "rt3dRenderQueue.h"
+#include "rt3d.h"
+#include <cstring>
+
+using namespace std;
+
+namespace rt3d {
+
+static stateStats stats;
+
+// what submitQueue has bound; 0 / GL_NONE until it binds something
+struct boundState {
+	GLuint program, texture, mesh;
+	GLenum cullFace;
+};
+static boundState bound;
+
+GLuint64 drawKey(const GLuint pass, const GLuint program, const GLenum cullFace, const GLuint texture, const GLuint mesh,
+	const GLfloat depth) {
+	GLfloat clamped = depth < 0.0f ? 0.0f : (depth > 1.0f ? 1.0f : depth);
+	return ((GLuint64) (pass & 0xF) << 60) | ((GLuint64) (program & 0xFFF) << 48) | ((GLuint64) (cullFace == GL_FRONT) << 47)
+		| ((GLuint64) (texture & 0x7FFF) << 32) | ((GLuint64) (mesh & 0xFFFF) << 16) | (GLuint64) (clamped * 65535.0f);
+}
+
+void sortQueue(renderQueue &queue) {
+	vector<drawItem> &items = queue.items;
+	if (items.size() < 2)
+		return;
+	// bits that differ between any two keys - a digit with none of them leaves the order as it is
+	GLuint64 any = 0, all = ~(GLuint64) 0;
+	for (size_t i = 0; i < items.size(); i++) {
+		any |= items[i].key;
+		all &= items[i].key;
+	}
+	const GLuint64 differ = any ^ all;
+	queue.scratch.resize(items.size());
+	for (GLuint shift = 0; shift < 64; shift += 8) {
+		if (((differ >> shift) & 0xFF) == 0)
+			continue;
+		size_t counts[257];
+		memset(counts, 0, sizeof(counts));
+		for (size_t i = 0; i < items.size(); i++)
+			counts[((items[i].key >> shift) & 0xFF) + 1]++;
+		for (int digit = 0; digit < 256; digit++)
+			counts[digit + 1] += counts[digit];
+		// stable, so the digits below this one keep their order
+		for (size_t i = 0; i < items.size(); i++)
+			queue.scratch[counts[(items[i].key >> shift) & 0xFF]++] = items[i];
+		items.swap(queue.scratch);
+	}
+}
+
+static void useProgram(const GLuint program) {
+	stats.requested++;
+	if (program != bound.program) {
+		glUseProgram(program);
+		bound.program = program;
+		stats.issued++;
+	}
+}
+
+static void bindTexture(const GLuint texture) {
+	if (texture == 0)
+		return;
+	stats.requested++;
+	if (texture != bound.texture) {
+		glBindTexture(GL_TEXTURE_2D, texture);
+		bound.texture = texture;
+		stats.issued++;
+	}
+}
+
+static void cullFace(const GLenum face) {
+	stats.requested++;
+	if (face != bound.cullFace) {
+		glCullFace(face);
+		bound.cullFace = face;
+		stats.issued++;
+	}
+}
+
+static void bindVertexArray(const GLuint mesh) {
+	stats.requested += 2; // the bind, and drawIndexedMesh's unbind after the draw
+	if (mesh != bound.mesh) {
+		glBindVertexArray(mesh);
+		bound.mesh = mesh;
+		stats.issued++;
+	}
+}
+
+void submitQueue(const renderQueue &queue, void (*setup)(const drawItem &item, void *context), void *context) {
+	if (queue.items.empty())
+		return;
+	memset(&bound, 0, sizeof(bound)); // anything could have been bound since the last submit
+	bound.cullFace = GL_NONE;
+	glActiveTexture(GL_TEXTURE0);
+	for (size_t i = 0; i < queue.items.size(); i++) {
+		const drawItem &item = queue.items[i];
+		useProgram(item.program);
+		bindTexture(item.texture);
+		cullFace(item.cullFace);
+		if (setup)
+			setup(item, context);
+		bindVertexArray(item.mesh);
+		if (item.instances)
+			drawBoundIndexedMeshInstanced(item.mesh, item.indexCount, GL_TRIANGLES, item.instanceBuffer, item.instances);
+		else
+			drawBoundIndexedMesh(item.mesh, item.indexCount, GL_TRIANGLES);
+		stats.draws++;
+	}
+	// leave things as drawing without the queue would
+	glBindVertexArray(0);
+	stats.issued++;
+	if (bound.cullFace != GL_BACK) {
+		glCullFace(GL_BACK);
+		stats.issued++;
+	}
+}
+
+const stateStats& getStateStats() {
+	return stats;
+}
+
+void resetStateStats() {
+	memset(&stats, 0, sizeof(stats));
+}
+
+}
@@ -0,0 +1,60 @@
+// rt3dRenderQueue.h
+// Sorted submission of draw calls, through a cache of the GL state they bind
+//
+// Instead of drawing as it goes, a pass records a drawItem for each draw: what it binds, and a 64-bit sort key made
+// from the pass, program, cull face, texture and mesh (top bits down), then depth, so like draws sit next to each other
+// and go front to back. sortQueue orders the items by key with an LSD radix sort, 8 bits a pass, skipping the digits
+// every item shares. submitQueue then draws them in that order, binding programs, textures, cull faces and vertex
+// arrays through a cache of what is bound, so binds that change nothing are dropped - and vertex arrays are no longer
+// unbound after every draw, only once at the end.
+//
+// Limitations:
+// The key holds the low bits of GL names, so two programs (say) whose names only differ above those bits can end up
+// interleaved; that costs binds, never a wrong draw. The cache only trusts what it bound itself during a submitQueue,
+// as everything else still binds directly. Items are drawn in key order only, so the queue is for opaque draws.
+#ifndef RT3D_RENDER_QUEUE
+#define RT3D_RENDER_QUEUE
+
+#include <GL/glew.h>
+#include <vector>
+
+namespace rt3d {
+
+	struct drawItem {
+		GLuint64 key;			// from drawKey
+		GLuint program;
+		GLuint mesh;			// VAO, drawn indexed
+		GLuint indexCount;
+		GLuint texture;			// 2D texture for unit 0, 0 for a program that doesn't sample it
+		GLenum cullFace;		// GL_BACK or GL_FRONT
+		GLuint instances;		// copies to draw, from instanceBuffer - 0 for a plain draw
+		GLuint instanceBuffer;
+		GLuint user;			// for the submitQueue setup function, e.g. an index into the caller's own per draw data
+	};
+
+	struct renderQueue {
+		std::vector<drawItem> items;
+		std::vector<drawItem> scratch;	// the sort's other buffer
+	};
+
+	// counted since the last resetStateStats
+	struct stateStats {
+		GLuint draws;			// items submitted
+		GLuint requested;		// binds they asked for: program, texture, cull face and VAO each, and the VAO unbind after
+		GLuint issued;			// binds that reached GL
+	};
+
+	// Sort key: pass (4 bits), program (12), cull face (1), texture (15), mesh (16), then depth (16 bits of 0 to 1)
+	GLuint64 drawKey(const GLuint pass, const GLuint program, const GLenum cullFace, const GLuint texture, const GLuint mesh,
+		const GLfloat depth);
+	void sortQueue(renderQueue &queue);
+	// Draw every item in order. setup, if not nullptr, is called for each item once its program is bound and before its
+	// draw, to set the item's own uniforms; it must leave texture unit 0 active and not bind programs or vertex arrays.
+	void submitQueue(const renderQueue &queue, void (*setup)(const drawItem &item, void *context), void *context);
+
+	const stateStats& getStateStats();
+	void resetStateStats();
+
+}
+
+#endif
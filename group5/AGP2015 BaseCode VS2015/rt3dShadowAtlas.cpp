@@ -0,0 +1,112 @@
+#include "rt3dShadowAtlas.h"
+#include <algorithm>
+
+using namespace std;
+
+namespace rt3d {
+
+// the n-th cell along a Z-order curve: x is made of n's even bits, y of its odd bits
+static void mortonCell(const GLuint n, GLuint &x, GLuint &y) {
+	x = y = 0;
+	for (GLuint bit = 0; bit < 16; bit++) {
+		x |= ((n >> (2 * bit)) & 1) << bit;
+		y |= ((n >> (2 * bit + 1)) & 1) << bit;
+	}
+}
+
+// Place every tile in sizes, largest first: everything placed before a tile is then a whole number of cells of its size
+static void packFromScratch(const vector<GLuint> &sizes, vector<atlasTile> &tiles) {
+	vector<size_t> order(sizes.size());
+	for (size_t i = 0; i < order.size(); i++)
+		order[i] = i;
+	stable_sort(order.begin(), order.end(), [&sizes](size_t a, size_t b) { return sizes[a] > sizes[b]; });
+
+	unsigned long long used = 0;
+	for (size_t i = 0; i < order.size(); i++) {
+		atlasTile &tile = tiles[order[i]];
+		tile.size = sizes[order[i]];
+		mortonCell((GLuint) (used / ((unsigned long long) tile.size * tile.size)), tile.x, tile.y);
+		tile.x *= tile.size;
+		tile.y *= tile.size;
+		used += (unsigned long long) tile.size * tile.size;
+	}
+}
+
+// Keep the tiles whose size is unchanged and place the others, largest first, in the first free cells of their size
+// along the curve. false if one of them doesn't fit between the kept ones.
+static bool packChanged(const GLuint atlasSize, const vector<GLuint> &sizes, vector<atlasTile> &tiles) {
+	// occupancy of the atlas in cells of the smallest tile
+	GLuint cell = atlasSize;
+	for (size_t i = 0; i < sizes.size(); i++)
+		cell = min(cell, sizes[i]);
+	const GLuint cells = atlasSize / cell;
+	vector<bool> used((size_t) cells * cells, false);
+	vector<size_t> changed;
+	for (size_t i = 0; i < sizes.size(); i++) {
+		const atlasTile &tile = tiles[i];
+		if (tile.size != sizes[i]) {
+			changed.push_back(i);
+			continue;
+		}
+		for (GLuint y = tile.y / cell; y < (tile.y + tile.size) / cell; y++)
+			for (GLuint x = tile.x / cell; x < (tile.x + tile.size) / cell; x++)
+				used[(size_t) y * cells + x] = true;
+	}
+	stable_sort(changed.begin(), changed.end(), [&sizes](size_t a, size_t b) { return sizes[a] > sizes[b]; });
+
+	for (size_t i = 0; i < changed.size(); i++) {
+		const GLuint size = sizes[changed[i]], span = size / cell, slots = (atlasSize / size) * (atlasSize / size);
+		GLuint slot, x = 0, y = 0;
+		for (slot = 0; slot < slots; slot++) {
+			mortonCell(slot, x, y);
+			bool free = true;
+			for (GLuint cy = y * span; free && cy < (y + 1) * span; cy++)
+				for (GLuint cx = x * span; free && cx < (x + 1) * span; cx++)
+					free = !used[(size_t) cy * cells + cx];
+			if (free)
+				break;
+		}
+		if (slot == slots)
+			return false;
+		for (GLuint cy = y * span; cy < (y + 1) * span; cy++)
+			for (GLuint cx = x * span; cx < (x + 1) * span; cx++)
+				used[(size_t) cy * cells + cx] = true;
+		atlasTile &tile = tiles[changed[i]];
+		tile.x = x * size;
+		tile.y = y * size;
+		tile.size = size;
+	}
+	return true;
+}
+
+bool packShadowAtlas(const GLuint atlasSize, const GLuint minSize, const vector<float> &importance,
+	vector<GLuint> &sizes, vector<atlasTile> &tiles) {
+	unsigned long long area = 0;
+	const unsigned long long capacity = (unsigned long long) atlasSize * atlasSize;
+	for (size_t i = 0; i < sizes.size(); i++)
+		area += (unsigned long long) sizes[i] * sizes[i];
+
+	while (area > capacity) {
+		int shrink = -1;
+		for (size_t i = 0; i < sizes.size(); i++) {
+			if (sizes[i] <= minSize)
+				continue;
+			if (shrink < 0 || importance[i] < importance[shrink] || (importance[i] == importance[shrink] && sizes[i] > sizes[shrink]))
+				shrink = (int) i;
+		}
+		if (shrink < 0)
+			return false;
+		area -= 3ull * sizes[shrink] * sizes[shrink] / 4; // s*s - (s/2)*(s/2)
+		sizes[shrink] /= 2;
+	}
+
+	if (tiles.size() != sizes.size()) {
+		atlasTile unplaced = { 0, 0, 0 };
+		tiles.assign(sizes.size(), unplaced);
+	}
+	if (!packChanged(atlasSize, sizes, tiles))
+		packFromScratch(sizes, tiles);
+	return true;
+}
+
+}
@@ -0,0 +1,36 @@
+// rt3dShadowAtlas.h
+// Tile allocator for a shadow atlas
+//
+// Square tiles, each a power of two in size, are packed into one square depth texture. They are
+// placed largest first, each at the next free cell of a Z-order curve in cells of its own size, which
+// leaves no gaps: as long as the tiles' total area fits in the atlas, every tile fits. When it doesn't,
+// the least important tiles are halved until it does.
+// Repacking is incremental: a tile that keeps its size keeps its place, and only the tiles whose size
+// changed are placed again, in the first free cells of their size along the same curve.
+//
+// Limitations:
+// Tiles freed and placed over time leave holes. If the changed tiles don't fit in them, everything is
+// packed from scratch, and tiles that kept their size can move then too.
+#ifndef RT3D_SHADOW_ATLAS
+#define RT3D_SHADOW_ATLAS
+
+#include <GL/glew.h>
+#include <vector>
+
+namespace rt3d {
+
+	struct atlasTile {
+		GLuint x, y;	// texels from the atlas's bottom left corner
+		GLuint size;
+	};
+
+	// Place one tile for each entry of sizes (powers of two, no larger than atlasSize) in an atlasSize square atlas.
+	// If they don't all fit, tiles are halved - lowest importance first, the largest of those first - but not below
+	// minSize, and sizes is updated to what each tile got. Returns false if even that doesn't fit.
+	// tiles holds the last packing (size 0 for a tile not placed yet): tiles whose size is unchanged stay where they are.
+	bool packShadowAtlas(const GLuint atlasSize, const GLuint minSize, const std::vector<float> &importance,
+		std::vector<GLuint> &sizes, std::vector<atlasTile> &tiles);
+
+}
+
+#endif
@@ -0,0 +1,177 @@
+#include "rt3dStaticBatch.h"
+#include "rt3d.h"
+#include <cstring>
+
+using namespace std;
+
+namespace rt3d {
+
+// the group drawn with material, made empty if there isn't one yet
+static staticGroup& findGroup(staticBatch &batch, const GLuint material) {
+	for (size_t g = 0; g < batch.groups.size(); g++)
+		if (batch.groups[g].material == material)
+			return batch.groups[g];
+	staticGroup group;
+	memset(&group, 0, sizeof(group));
+	group.material = material;
+	batch.groups.push_back(group);
+	return batch.groups.back();
+}
+
+void initStaticBatch(staticBatch &batch, const GLuint attributes, const GLuint format) {
+	deleteStaticBatch(batch);
+	batch.attributes = attributes | (1 << RT3D_VERTEX);
+	batch.format = format;
+	batch.rebuilds = 0;
+}
+
+GLuint addStaticObject(staticBatch &batch, const meshSource &mesh, const GLuint material, const glm::mat4 &model) {
+	GLuint id = 0;
+	while (id < batch.objects.size() && batch.objects[id].mesh)
+		id++;
+	if (id == batch.objects.size())
+		batch.objects.push_back(staticObject());
+	staticObject &object = batch.objects[id];
+	object.mesh = &mesh;
+	object.material = material;
+	object.model = model;
+	staticGroup &group = findGroup(batch, material);
+	group.objects++;
+	group.dirty = true;
+	return id;
+}
+
+void removeStaticObject(staticBatch &batch, const GLuint id) {
+	staticObject &object = batch.objects[id];
+	if (!object.mesh)
+		return;
+	staticGroup &group = findGroup(batch, object.material);
+	group.objects--;
+	group.dirty = true;
+	object.mesh = nullptr;
+}
+
+void moveStaticObject(staticBatch &batch, const GLuint id, const glm::mat4 &model) {
+	staticObject &object = batch.objects[id];
+	if (!object.mesh || object.model == model)
+		return;
+	object.model = model;
+	findGroup(batch, object.material).dirty = true;
+}
+
+static glm::vec3 normalizeOrZero(const glm::vec3 &v) {
+	GLfloat length = glm::length(v);
+	return length > 0.0f ? v / length : v;
+}
+
+// append object's vertices in world space, laid out as the batch's attributes, and its indices
+static void appendObject(const staticBatch &batch, const staticObject &object, vector<GLfloat> &vertices,
+	vector<GLuint> &indices, staticGroup &group) {
+	const meshSource &mesh = *object.mesh;
+	const GLuint stride = interleavedStride(batch.attributes) / sizeof(GLfloat);
+	const GLuint srcStride = interleavedStride(mesh.attributes) / sizeof(GLfloat);
+	const GLuint first = GLuint(vertices.size() / stride);
+	const GLuint count = GLuint(mesh.vertices.size() / srcStride);
+	const glm::mat3 tangentMatrix(object.model);
+	const glm::mat3 normalMatrix = glm::transpose(glm::inverse(tangentMatrix));
+	const GLfloat handedness = glm::determinant(tangentMatrix) < 0.0f ? -1.0f : 1.0f; // a mirroring model flips it
+
+	vertices.resize(vertices.size() + (size_t) count * stride, 0.0f);
+	for (GLuint v = 0; v < count; v++) {
+		const GLfloat *src = &mesh.vertices[(size_t) v * srcStride];
+		GLfloat *dst = &vertices[(size_t) (first + v) * stride];
+		for (GLuint a = 0; a < 6; a++) {
+			const bool in = (mesh.attributes & (1 << a)) != 0, out = (batch.attributes & (1 << a)) != 0;
+			if (in && out) {
+				if (a == RT3D_VERTEX) {
+					glm::vec3 p = glm::vec3(object.model * glm::vec4(src[0], src[1], src[2], 1.0f));
+					for (int c = 0; c < 3; c++) {
+						dst[c] = p[c];
+						group.boundsMin[c] = (first + v == 0 || p[c] < group.boundsMin[c]) ? p[c] : group.boundsMin[c];
+						group.boundsMax[c] = (first + v == 0 || p[c] > group.boundsMax[c]) ? p[c] : group.boundsMax[c];
+					}
+				}
+				else if (a == RT3D_NORMAL) {
+					glm::vec3 n = normalizeOrZero(normalMatrix * glm::vec3(src[0], src[1], src[2]));
+					dst[0] = n.x; dst[1] = n.y; dst[2] = n.z;
+				}
+				else if (a == RT3D_TANGENT) {
+					glm::vec3 t = normalizeOrZero(tangentMatrix * glm::vec3(src[0], src[1], src[2]));
+					dst[0] = t.x; dst[1] = t.y; dst[2] = t.z; dst[3] = src[3] * handedness;
+				}
+				else
+					memcpy(dst, src, attributeSize(a) * sizeof(GLfloat));
+			}
+			if (in)
+				src += attributeSize(a);
+			if (out)
+				dst += attributeSize(a);
+		}
+	}
+
+	if (mesh.indices.empty()) {
+		for (GLuint v = 0; v < count; v++)
+			indices.push_back(first + v);
+	}
+	else {
+		for (size_t i = 0; i < mesh.indices.size(); i++)
+			indices.push_back(first + mesh.indices[i]);
+	}
+}
+
+static void rebuildGroup(staticBatch &batch, staticGroup &group) {
+	if (group.mesh)
+		deleteMesh(group.mesh);
+	group.mesh = 0;
+	group.indexCount = 0;
+	group.dirty = false;
+	batch.rebuilds++;
+	if (group.objects == 0)
+		return;
+
+	vector<GLfloat> vertices;
+	vector<GLuint> indices;
+	for (size_t i = 0; i < batch.objects.size(); i++)
+		if (batch.objects[i].mesh && batch.objects[i].material == group.material)
+			appendObject(batch, batch.objects[i], vertices, indices, group);
+	const GLuint stride = interleavedStride(batch.attributes) / sizeof(GLfloat);
+	group.mesh = createInterleavedMesh(GLuint(vertices.size() / stride), vertices.data(), batch.attributes,
+		GLuint(indices.size()), indices.data(), batch.format);
+	group.indexCount = GLuint(indices.size());
+}
+
+GLuint updateStaticBatch(staticBatch &batch) {
+	GLuint rebuilt = 0;
+	for (size_t g = 0; g < batch.groups.size(); g++)
+		if (batch.groups[g].dirty) {
+			rebuildGroup(batch, batch.groups[g]);
+			rebuilt++;
+		}
+	return rebuilt;
+}
+
+GLuint staticObjectCount(const staticBatch &batch) {
+	GLuint count = 0;
+	for (size_t i = 0; i < batch.objects.size(); i++)
+		if (batch.objects[i].mesh)
+			count++;
+	return count;
+}
+
+GLuint staticGroupCount(const staticBatch &batch) {
+	GLuint count = 0;
+	for (size_t g = 0; g < batch.groups.size(); g++)
+		if (batch.groups[g].objects)
+			count++;
+	return count;
+}
+
+void deleteStaticBatch(staticBatch &batch) {
+	for (size_t g = 0; g < batch.groups.size(); g++)
+		if (batch.groups[g].mesh)
+			deleteMesh(batch.groups[g].mesh);
+	batch.groups.clear();
+	batch.objects.clear();
+}
+
+}
@@ -0,0 +1,65 @@
+// rt3dStaticBatch.h
+// Static geometry batching: objects that never move, merged into one mesh per material
+//
+// Each object is a mesh (kept in memory as a meshSource), a material and a model matrix. The batch transforms every
+// object's vertices into world space - positions by the model matrix, normals by its inverse transpose, tangents by
+// its upper 3x3 - and appends them, indices offset past the vertices already there, to the mesh of the object's
+// material group. A group then draws in one call with an identity model matrix, however many objects are in it.
+// Adding, removing or moving an object only marks its group; updateStaticBatch rebuilds the marked groups and leaves
+// the others' meshes as they are.
+//
+// Limitations:
+// A group's objects can no longer be culled one by one - the group goes to every pass whole, with world bounds around
+// all of it. A rebuild redoes the whole group, so objects that move often don't belong in one. Every object keeps its
+// own copy of its mesh's vertices in its group, so many copies of a big mesh are better drawn instanced. Positions
+// are in world space, so a format with RT3D_FORMAT_HALF_POSITION loses more precision the further they are from 0.
+#ifndef RT3D_STATIC_BATCH
+#define RT3D_STATIC_BATCH
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+#include <vector>
+#include "rt3dMeshCache.h"
+
+namespace rt3d {
+
+	struct staticObject {
+		const meshSource *mesh;	// must stay valid while the object is in the batch; nullptr once removed
+		GLuint material;		// objects are grouped by this, e.g. their texture
+		glm::mat4 model;
+	};
+
+	struct staticGroup {
+		GLuint material;
+		GLuint mesh;			// VAO of the group's objects in world space, 0 while it has none
+		GLuint indexCount;
+		GLuint objects;
+		GLfloat boundsMin[3];	// world space
+		GLfloat boundsMax[3];
+		bool dirty;				// to be rebuilt by updateStaticBatch
+	};
+
+	struct staticBatch {
+		GLuint attributes;		// mask of (1 << RT3D_VERTEX) etc the groups' meshes hold - zero for an object without one
+		GLuint format;			// RT3D_FORMAT_ layout they are stored in
+		std::vector<staticObject> objects;	// by id; a removed object's id is reused by the next add
+		std::vector<staticGroup> groups;
+		GLuint rebuilds;		// groups rebuilt since initStaticBatch
+	};
+
+	void initStaticBatch(staticBatch &batch, const GLuint attributes, const GLuint format);
+	// returns the object's id
+	GLuint addStaticObject(staticBatch &batch, const meshSource &mesh, const GLuint material, const glm::mat4 &model);
+	void removeStaticObject(staticBatch &batch, const GLuint id);
+	// give object id a new model matrix; its group is only marked if the matrix is different
+	void moveStaticObject(staticBatch &batch, const GLuint id, const glm::mat4 &model);
+	// rebuild the marked groups, returning how many there were
+	GLuint updateStaticBatch(staticBatch &batch);
+	GLuint staticObjectCount(const staticBatch &batch);
+	// groups with objects in them - the draws the batch takes
+	GLuint staticGroupCount(const staticBatch &batch);
+	void deleteStaticBatch(staticBatch &batch);
+
+}
+
+#endif
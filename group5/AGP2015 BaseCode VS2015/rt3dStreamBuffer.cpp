@@ -0,0 +1,110 @@
+#include "rt3dStreamBuffer.h"
+#include "rt3d.h"
+#include <cstring>
+
+using namespace std;
+
+namespace rt3d {
+
+// wait until the GPU is finished with a region's last frame
+static void waitForFence(GLsync &fence) {
+	if (fence == 0)
+		return;
+	GLenum result = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+	while (result == GL_TIMEOUT_EXPIRED)
+		result = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+	glDeleteSync(fence);
+	fence = 0;
+}
+
+static void clearFences(streamBuffer &stream) {
+	for (int i = 0; i < RT3D_STREAM_FRAMES; i++) {
+		if (stream.fences[i] != 0)
+			glDeleteSync(stream.fences[i]);
+		stream.fences[i] = 0;
+	}
+}
+
+// give the buffer fresh storage; anything still queued keeps reading the old storage
+static void orphanStream(streamBuffer &stream, const GLuint frameSize) {
+	stream.frameSize = frameSize;
+	glBindBuffer(GL_ARRAY_BUFFER, stream.buffer);
+	glBufferData(GL_ARRAY_BUFFER, RT3D_STREAM_FRAMES * stream.frameSize, nullptr, GL_STREAM_DRAW);
+	clearFences(stream);
+	stream.head = 0;
+}
+
+void createStreamBuffer(streamBuffer &stream, const GLuint frameSize) {
+	memset(&stream, 0, sizeof(stream));
+	glGenBuffers(1, &stream.buffer);
+	orphanStream(stream, (frameSize + RT3D_STREAM_ALIGNMENT - 1) & ~(RT3D_STREAM_ALIGNMENT - 1));
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+void deleteStreamBuffer(streamBuffer &stream) {
+	if (stream.mapped)
+		unmapStream(stream);
+	clearFences(stream);
+	glDeleteBuffers(1, &stream.buffer);
+	stream.buffer = 0;
+}
+
+GLvoid* mapStream(streamBuffer &stream, const GLuint bytes, GLuint &offset) {
+	GLuint start = (stream.head + RT3D_STREAM_ALIGNMENT - 1) & ~(RT3D_STREAM_ALIGNMENT - 1);
+	if (start + bytes > stream.frameSize) {
+		// frame has outgrown its region: orphan, growing the regions if one allocation can't fit
+		GLuint frameSize = stream.frameSize;
+		while (frameSize < bytes)
+			frameSize *= 2;
+		orphanStream(stream, frameSize);
+		start = 0;
+	}
+	else
+		glBindBuffer(GL_ARRAY_BUFFER, stream.buffer);
+	// first write to this region since it was last fenced
+	waitForFence(stream.fences[stream.frame]);
+
+	offset = stream.frame * stream.frameSize + start;
+	stream.head = start + bytes;
+	stream.mapped = glMapBufferRange(GL_ARRAY_BUFFER, offset, bytes,
+		GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+	if (stream.mapped == nullptr)
+		exitFatalError("Unable to map stream buffer");
+	return stream.mapped;
+}
+
+void unmapStream(streamBuffer &stream) {
+	glBindBuffer(GL_ARRAY_BUFFER, stream.buffer);
+	glUnmapBuffer(GL_ARRAY_BUFFER);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	stream.mapped = nullptr;
+}
+
+GLuint streamData(streamBuffer &stream, const GLvoid *data, const GLuint bytes) {
+	GLuint offset;
+	memcpy(mapStream(stream, bytes, offset), data, bytes);
+	unmapStream(stream);
+	return offset;
+}
+
+void endStreamFrame(streamBuffer &stream) {
+	if (stream.head == 0)
+		return;		// nothing written, nothing to fence
+	if (stream.fences[stream.frame] != 0)
+		glDeleteSync(stream.fences[stream.frame]);
+	stream.fences[stream.frame] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	stream.frame = (stream.frame + 1) % RT3D_STREAM_FRAMES;
+	stream.head = 0;
+}
+
+void updateMesh(const GLuint mesh, const unsigned int bufferType, streamBuffer &stream, const GLfloat *data, const GLuint size) {
+	GLuint offset = streamData(stream, data, size * sizeof(GLfloat));
+	glBindVertexArray(mesh);
+	glBindBuffer(GL_ARRAY_BUFFER, stream.buffer);
+	glVertexAttribPointer((GLuint)bufferType, attributeSize(bufferType), GL_FLOAT, GL_FALSE, 0, (const GLvoid *) (size_t) offset);
+	glEnableVertexAttribArray(bufferType);
+	glBindVertexArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+}
@@ -0,0 +1,45 @@
+// rt3dStreamBuffer.h
+// Streaming vertex buffer for data that changes every frame (animated models, particles)
+//
+// One GL buffer is split into RT3D_STREAM_FRAMES regions used in turn, one per frame. Data is written
+// into the current region through an unsynchronized map, so the driver never has to stall or copy.
+// endStreamFrame drops a fence after the frame's draws; a region is only written again once the fence
+// from its last use has signalled. A frame that writes more than frameSize bytes orphans the buffer
+// (glBufferData with no data) and carries on in fresh storage - no buffers are ever created or deleted
+// while streaming.
+#ifndef RT3D_STREAM_BUFFER
+#define RT3D_STREAM_BUFFER
+
+#include <GL/glew.h>
+
+#define RT3D_STREAM_FRAMES		3	// frames the GPU may be behind the CPU before we wait
+#define RT3D_STREAM_ALIGNMENT	16	// each allocation starts on this many bytes
+
+namespace rt3d {
+
+	struct streamBuffer {
+		GLuint buffer;
+		GLuint frameSize;					// bytes each region holds
+		GLuint frame;						// region being written this frame
+		GLuint head;						// next free byte in that region
+		GLsync fences[RT3D_STREAM_FRAMES];	// set when a region's last frame was submitted
+		GLvoid *mapped;
+	};
+
+	void createStreamBuffer(streamBuffer &stream, const GLuint frameSize);
+	void deleteStreamBuffer(streamBuffer &stream);
+	// Map bytes of the current region for writing; offset receives where they live in stream.buffer.
+	// Must be followed by unmapStream before drawing.
+	GLvoid* mapStream(streamBuffer &stream, const GLuint bytes, GLuint &offset);
+	void unmapStream(streamBuffer &stream);
+	// Copy data into the stream and return its offset in stream.buffer
+	GLuint streamData(streamBuffer &stream, const GLvoid *data, const GLuint bytes);
+	// Fence everything drawn from the current region and move on to the next one
+	void endStreamFrame(streamBuffer &stream);
+
+	// Stream size floats into the stream and point attribute bufferType of mesh at them
+	void updateMesh(const GLuint mesh, const unsigned int bufferType, streamBuffer &stream, const GLfloat *data, const GLuint size);
+
+}
+
+#endif
@@ -0,0 +1,177 @@
+#include "rt3dUniforms.h"
+#include <vector>
+#include <map>
+#include <string>
+#include <cstring>
+
+using namespace std;
+
+namespace rt3d {
+
+// one uniform (or one element of a uniform array) and the value last uploaded to it
+struct uniformSlot {
+	GLint location;
+	GLint remaining;		// elements from this one to the end of its array, this one included
+	bool known;				// value holds what the program has
+	bool indexedName;		// resolved by name[index] - used to need a string built per set
+	GLfloat value[16];		// ints are kept here bit for bit
+};
+
+static vector<uniformSlot> slots;
+static map<GLuint, map<string, uniformHandle> > programUniforms;
+static uniformStats stats;
+
+void reflectUniforms(const GLuint program) {
+	map<string, uniformHandle> &names = programUniforms[program];
+	names.clear(); // a relinked program starts over; its old slots are just never used again
+
+	GLint count = 0, maxLength = 0;
+	glGetProgramiv(program, GL_ACTIVE_UNIFORMS, &count);
+	glGetProgramiv(program, GL_ACTIVE_UNIFORM_MAX_LENGTH, &maxLength);
+	vector<GLchar> name(maxLength + 1);
+
+	for (GLint i = 0; i < count; i++) {
+		GLint size;
+		GLenum type;
+		GLsizei length = 0;
+		glGetActiveUniform(program, i, maxLength + 1, &length, &size, &type, &name[0]);
+		string base(&name[0], length);
+		// arrays are reported once, as name[0], with their size
+		bool isArray = size > 1;
+		if (base.size() > 3 && base.compare(base.size() - 3, 3, "[0]") == 0) {
+			base.erase(base.size() - 3);
+			isArray = true;
+		}
+		for (GLint e = 0; e < size; e++) {
+			string element = isArray ? base + "[" + to_string(e) + "]" : base;
+			uniformSlot slot;
+			slot.location = glGetUniformLocation(program, element.c_str());
+			if (slot.location < 0)
+				break; // in a uniform block - not set with glUniform
+			slot.remaining = size - e;
+			slot.known = false;
+			slot.indexedName = false;
+			names[element] = (uniformHandle) slots.size();
+			if (isArray && e == 0)
+				names[base] = (uniformHandle) slots.size();
+			slots.push_back(slot);
+		}
+	}
+}
+
+uniformHandle uniform(const GLuint program, const char *name) {
+	stats.nameLookups++;
+	map<GLuint, map<string, uniformHandle> >::iterator p = programUniforms.find(program);
+	if (p == programUniforms.end()) {
+		reflectUniforms(program);
+		p = programUniforms.find(program);
+	}
+	map<string, uniformHandle>::iterator u = p->second.find(name);
+	return (u == p->second.end()) ? -1 : u->second;
+}
+
+uniformHandle uniform(const GLuint program, const char *name, const int index, const char *member) {
+	string element = string(name) + "[" + to_string(index) + "]";
+	if (member)
+		element += string(".") + member;
+	uniformHandle handle = uniform(program, element.c_str());
+	if (handle >= 0)
+		slots[handle].indexedName = true;
+	return handle;
+}
+
+// Compare count elements of elementSize bytes against what the program holds, and remember them.
+// Returns true if anything changed and the values need uploading.
+static bool changed(const uniformHandle handle, const GLsizei count, const void *data, const size_t elementSize) {
+	uniformSlot &first = slots[handle];
+	stats.queriesSaved++;
+	if (first.indexedName)
+		stats.namesSaved++;
+	const char *src = (const char*) data;
+	bool differs = false;
+	for (GLsizei e = 0; e < count && e < first.remaining; e++) {
+		uniformSlot &slot = slots[handle + e];
+		if (!slot.known || memcmp(slot.value, src + e * elementSize, elementSize) != 0) {
+			memcpy(slot.value, src + e * elementSize, elementSize);
+			slot.known = true;
+			differs = true;
+		}
+	}
+	if (differs)
+		stats.uploads++;
+	else
+		stats.redundant++;
+	return differs;
+}
+
+void setUniform1i(const uniformHandle handle, const GLint value) {
+	if (handle >= 0 && changed(handle, 1, &value, sizeof(GLint)))
+		glUniform1i(slots[handle].location, value);
+}
+
+void setUniform1iv(const uniformHandle handle, const GLsizei count, const GLint *values) {
+	if (handle >= 0 && changed(handle, count, values, sizeof(GLint)))
+		glUniform1iv(slots[handle].location, count, values);
+}
+
+void setUniform1f(const uniformHandle handle, const GLfloat value) {
+	if (handle >= 0 && changed(handle, 1, &value, sizeof(GLfloat)))
+		glUniform1f(slots[handle].location, value);
+}
+
+void setUniform3f(const uniformHandle handle, const GLfloat x, const GLfloat y, const GLfloat z) {
+	const GLfloat values[3] = { x, y, z };
+	if (handle >= 0 && changed(handle, 1, values, sizeof(values)))
+		glUniform3f(slots[handle].location, x, y, z);
+}
+
+void setUniform3fv(const uniformHandle handle, const GLsizei count, const GLfloat *values) {
+	if (handle >= 0 && changed(handle, count, values, 3 * sizeof(GLfloat)))
+		glUniform3fv(slots[handle].location, count, values);
+}
+
+void setUniform4fv(const uniformHandle handle, const GLsizei count, const GLfloat *values) {
+	if (handle >= 0 && changed(handle, count, values, 4 * sizeof(GLfloat)))
+		glUniform4fv(slots[handle].location, count, values);
+}
+
+void setUniformMatrix4fv(const uniformHandle handle, const GLfloat *data) {
+	setUniformMatrix4fv(handle, 1, data);
+}
+
+void setUniformMatrix4fv(const uniformHandle handle, const GLsizei count, const GLfloat *data) {
+	if (handle >= 0 && changed(handle, count, data, 16 * sizeof(GLfloat)))
+		glUniformMatrix4fv(slots[handle].location, count, GL_FALSE, data);
+}
+
+GLuint createUniformBuffer(const GLuint binding, const GLuint size) {
+	GLuint buffer;
+	glGenBuffers(1, &buffer);
+	glBindBuffer(GL_UNIFORM_BUFFER, buffer);
+	glBufferData(GL_UNIFORM_BUFFER, size, nullptr, GL_STREAM_DRAW);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	glBindBufferBase(GL_UNIFORM_BUFFER, binding, buffer);
+	return buffer;
+}
+
+void updateUniformBuffer(const GLuint buffer, const GLvoid *data, const GLuint size) {
+	glBindBuffer(GL_UNIFORM_BUFFER, buffer);
+	glBufferData(GL_UNIFORM_BUFFER, size, data, GL_STREAM_DRAW);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+}
+
+void bindUniformBlock(const GLuint program, const char *blockName, const GLuint binding) {
+	GLuint block = glGetUniformBlockIndex(program, blockName);
+	if (block != GL_INVALID_INDEX)
+		glUniformBlockBinding(program, block, binding);
+}
+
+const uniformStats& getUniformStats() {
+	return stats;
+}
+
+void resetUniformStats() {
+	memset(&stats, 0, sizeof(stats));
+}
+
+}
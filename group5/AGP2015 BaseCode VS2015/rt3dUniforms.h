@@ -0,0 +1,62 @@
+// rt3dUniforms.h
+// Uniform location cache and typed uniform setters
+//
+// When a program is linked (initShaders does this) its active uniforms are read once with
+// glGetActiveUniform and each one - each element, for arrays - gets a handle. Draw code resolves the
+// handles it needs once, at load time, and sets values through them: no glGetUniformLocation and no
+// "name[i].member" strings per frame. The value last uploaded through a handle is kept, and setting
+// the same value again makes no GL call at all.
+//
+// Limitations:
+// Like glUniform, a setter writes to the program that is currently bound, which must be the one the
+// handle came from. Every write to a program's uniforms must go through these setters (or the rt3d
+// functions built on them), otherwise the cached values go stale and changes can be dropped.
+// Members of uniform blocks have no handles - they live in the block's buffer.
+#ifndef RT3D_UNIFORMS
+#define RT3D_UNIFORMS
+
+#include <GL/glew.h>
+
+namespace rt3d {
+
+	// -1 for a uniform the program doesn't have; setters ignore it, as GL does location -1
+	typedef GLint uniformHandle;
+
+	// counted since the last resetUniformStats
+	struct uniformStats {
+		GLuint uploads;			// glUniform calls made
+		GLuint redundant;		// sets dropped because the program already held the value
+		GLuint queriesSaved;	// glGetUniformLocation calls the cache answered instead
+		GLuint namesSaved;		// "name[i].member" strings that didn't have to be built
+		GLuint nameLookups;		// handles looked up by name - ideally none once loading is done
+	};
+
+	// Read the active uniforms of a freshly linked program. Called by initShaders.
+	void reflectUniforms(const GLuint program);
+	uniformHandle uniform(const GLuint program, const char *name);
+	// name[index] or, with a member, name[index].member
+	uniformHandle uniform(const GLuint program, const char *name, const int index, const char *member);
+
+	// setters for arrays take a handle to the first element to write and write count elements from there
+	void setUniform1i(const uniformHandle handle, const GLint value);
+	void setUniform1iv(const uniformHandle handle, const GLsizei count, const GLint *values);
+	void setUniform1f(const uniformHandle handle, const GLfloat value);
+	void setUniform3f(const uniformHandle handle, const GLfloat x, const GLfloat y, const GLfloat z);
+	void setUniform3fv(const uniformHandle handle, const GLsizei count, const GLfloat *values);
+	void setUniform4fv(const uniformHandle handle, const GLsizei count, const GLfloat *values);
+	void setUniformMatrix4fv(const uniformHandle handle, const GLfloat *data);
+	void setUniformMatrix4fv(const uniformHandle handle, const GLsizei count, const GLfloat *data);
+
+	// Uniform blocks: one buffer bound to a fixed binding point is read by every program declaring the block
+	GLuint createUniformBuffer(const GLuint binding, const GLuint size);
+	// replace the buffer's contents; the old storage is orphaned so draws still reading it don't stall us
+	void updateUniformBuffer(const GLuint buffer, const GLvoid *data, const GLuint size);
+	// attach program's block blockName, if it has one, to binding
+	void bindUniformBlock(const GLuint program, const char *blockName, const GLuint binding);
+
+	const uniformStats& getUniformStats();
+	void resetUniformStats();
+
+}
+
+#endif
@@ -6,26 +6,47 @@
 
 in vec4 FragPos;
 
+// std140: each vec3 shares its 16 bytes with the float after it
 struct PointLight {
     vec3 position;
-    
     float constant;
-    float linear;
-    float quadratic;
-	
     vec3 ambient;
+    float linear;
     vec3 diffuse;
+    float quadratic;
     vec3 specular;
 };
 
+#ifndef NR_POINT_LIGHTS
 #define NR_POINT_LIGHTS 4
+#endif
 
-uniform PointLight pointLights[NR_POINT_LIGHTS];
+// binding 1: every light, written once per frame
+layout(std140) uniform Lights {
+    PointLight pointLights[NR_POINT_LIGHTS];
+};
+
+// binding 2: per-frame constants
+layout(std140) uniform Frame {
+    float far_plane;
+    int numShotsFired;
+    float clusterNear;          // view depth the first cluster slice starts at
+    float clusterSliceScale;    // slices per unit of log depth
+};
+
+#ifdef LAYERED
+flat in int currentLight; // from the geometry shader
+#else
 uniform int currentLight;
-uniform float far_plane;
+#endif
+
+#ifdef VSM
+layout(location = 0) out vec2 moments; // for variance shadow maps, as well as the depth
+#endif
 
 void main()
 {
+#ifndef DEPTH_PREPASS // which only needs the depth the rasterizer gives
     // get distance between fragment and light source
     float lightDistance = length(FragPos.xyz - pointLights[currentLight].position);
     
@@ -34,4 +55,13 @@ void main()
     
     // Write this as modified depth
     gl_FragDepth = lightDistance;
+
+#ifdef VSM
+    // the depth and its square; the square is widened by the depth's slope across the pixel,
+    // so surfaces at a grazing angle to the light don't shadow themselves
+    float dx = dFdx(lightDistance);
+    float dy = dFdy(lightDistance);
+    moments = vec2(lightDistance, lightDistance * lightDistance + 0.25 * (dx * dx + dy * dy));
+#endif
+#endif
 }  
\ No newline at end of file
@@ -4,25 +4,78 @@
 // Available: https://learnopengl.com/#!Advanced-Lighting/Shadows/Point-Shadows
 // [Accessed: December 2016]
 
+// With LAYERED defined every light's cubemap is rendered in one pass, into a cubemap array:
+// one instance of this shader runs per light and writes layer light * 6 + face
+#ifdef LAYERED
+#extension GL_ARB_gpu_shader5 : require
+#endif
+
+#ifndef NR_POINT_LIGHTS
+#define NR_POINT_LIGHTS 4
+#endif
+
+#ifdef LAYERED
+layout (triangles, invocations = NR_POINT_LIGHTS) in;
+#else
 layout (triangles) in;
+#endif
 layout (triangle_strip, max_vertices=18) out;
 
+#ifdef LAYERED
+// binding 3: six matrices per light, written once per frame
+layout(std140) uniform Shadows {
+    mat4 shadowMatrices[6 * NR_POINT_LIGHTS];
+};
+flat out int currentLight; // light whose cubemap this triangle is in
+uniform int skipFaces[NR_POINT_LIGHTS];
+#define SKIP_FACES skipFaces[light]
+#else
 uniform mat4 shadowMatrices[6];
+uniform int skipFaces;
+#define SKIP_FACES skipFaces
+#endif
+
+// Faces to leave out (bit n = face n) are set per object by the CPU, from the object's bounds.
+// With cullTriangles the remaining faces also drop each triangle that lies outside them.
+uniform bool cullTriangles;
+
+// true if the triangle is entirely on the outside of one of the clip volume's planes
+bool outsideFace(vec4 a, vec4 b, vec4 c)
+{
+    return (a.x >  a.w && b.x >  b.w && c.x >  c.w) || (a.x < -a.w && b.x < -b.w && c.x < -c.w) ||
+           (a.y >  a.w && b.y >  b.w && c.y >  c.w) || (a.y < -a.w && b.y < -b.w && c.y < -c.w) ||
+           (a.z >  a.w && b.z >  b.w && c.z >  c.w) || (a.z < -a.w && b.z < -b.w && c.z < -c.w);
+}
 
 
 out vec4 FragPos; // FragPos from GS (output per emitvertex)
 
 void main()
 {
+#ifdef LAYERED
+    int light = gl_InvocationID;
+#else
+    int light = 0;
+#endif
+    int skip = SKIP_FACES;
     for(int face = 0; face < 6; ++face)
     {
-        gl_Layer = face; // built-in variable that specifies to which face we render.
+        if ((skip & (1 << face)) != 0)
+            continue;
+        mat4 shadowMatrix = shadowMatrices[light * 6 + face];
+        vec4 clip[3] = vec4[](shadowMatrix * gl_in[0].gl_Position, shadowMatrix * gl_in[1].gl_Position, shadowMatrix * gl_in[2].gl_Position);
+        if (cullTriangles && outsideFace(clip[0], clip[1], clip[2]))
+            continue;
+        gl_Layer = light * 6 + face; // built-in variable that specifies to which face we render.
         for(int i = 0; i < 3; ++i) // for each triangle's vertices
         {
             FragPos = gl_in[i].gl_Position;
-            gl_Position = shadowMatrices[face] * FragPos;
+            gl_Position = clip[i];
+#ifdef LAYERED
+            currentLight = light;
+#endif
             EmitVertex();
         }    
         EndPrimitive();
     }
-}  
\ No newline at end of file
+}  
@@ -5,9 +5,47 @@
 // [Accessed: December 2016]
 
 layout (location = 0) in vec3 position;
+layout (location = 6) in uint md2Vertex; // md2 vertex this vertex decodes from, for keyframed models
+layout (location = 8) in mat4 instanceModel; // per instance (locations 8 to 11), for instanced draws
 uniform mat4 model;
+uniform bool instanced; // take the model matrix from instanceModel rather than model
+
+#ifdef DEPTH_PREPASS
+// DEPTH_PREPASS draws the camera's view instead, for the depth pre-pass of the lit objects
+
+// binding 0: the camera, shared by every scene program
+layout(std140) uniform Camera {
+    mat4 projection;
+    mat4 view;
+    vec3 viewPos;
+};
+
+invariant gl_Position; // the lit pass tests for equal depth, so must get exactly this one
+#endif
+
+// md2 models animated on the GPU keep their frames quantized in frameData (xyz, normal index per vertex).
+// Each vertex fetches its md2 vertex from the current and next frame, decodes and blends them.
+uniform bool keyframed;
+uniform usamplerBuffer frameData;
+uniform int frameStart[2];      // first vertex of the current and next frame in frameData
+uniform vec3 frameScale[2];
+uniform vec3 frameTranslate[2];
+uniform float interp;
+
+vec3 keyframePosition()
+{
+    vec3 a = vec3(texelFetch(frameData, frameStart[0] + int(md2Vertex)).xyz) * frameScale[0] + frameTranslate[0];
+    vec3 b = vec3(texelFetch(frameData, frameStart[1] + int(md2Vertex)).xyz) * frameScale[1] + frameTranslate[1];
+    return mix(a, b, interp);
+}
 
 void main()
 {
-    gl_Position = model * vec4(position, 1.0);
+    vec3 pos = keyframed ? keyframePosition() : position;
+    mat4 modelMatrix = instanced ? instanceModel : model;
+#ifdef DEPTH_PREPASS
+    gl_Position = projection * view * modelMatrix * vec4(pos, 1.0f);
+#else
+    gl_Position = modelMatrix * vec4(pos, 1.0);
+#endif
 }  
\ No newline at end of file